@@ -0,0 +1,210 @@
+/*
+ * The damage map: which PAR2 slices are hit by segments
+ * we couldn't fetch (or fetched broken), without reading
+ * a single byte of the files back from disk.
+ */
+#include "damagemap.h"
+
+struct damage_map mw_damage_map = { .files = NULL, .files_length = 0, .valid = false };
+
+uint64_t damagemap_part_size(struct NZBFile *file);
+void damagemap_mark_range(uint64_t slice_size, struct damage_file *dfile, struct damage_range *range);
+
+/// @brief finds the par2-file-entry for a file of the nzb, by 16k-md5 match or name first, by length second.
+/// @param set the recovery set
+/// @param file the nzb-file
+/// @return the par2 entry or NULL
+struct par_fileinfo *damagemap_match_file(struct par2_set *set, struct NZBFile *file) {
+    struct par_fileinfo *rv = NULL;
+    bool has_yenc_size = false;
+
+    if ((rv = par2_find_fileinfo_by_name(set, file->par2_filename)) != NULL)
+        return rv;
+    if ((rv = par2_find_fileinfo_by_name(set, file->yenc_filename)) != NULL)
+        return rv;
+    if ((rv = par2_find_fileinfo_by_name(set, file->filename)) != NULL)
+        return rv;
+
+    // file_size is only the real size if the first segment (=ybegin size=) arrived:
+    for (unsigned int i = 0; i < file->segmentsSize; i++) {
+        if ((file->segments[i].number == 1) && (file->segments[i].state != NSState_Pending) && (file->segments[i].state != NSState_Failed)) {
+            has_yenc_size = true;
+            break;
+        }
+    }
+    if (!has_yenc_size)
+        return NULL;
+
+    // the length has to be unique, otherwise we're guessing.
+    for (unsigned int i = 0; i < set->fileinfos_length; i++) {
+        if (set->fileinfos[i].file_length != file->file_size)
+            continue;
+        if (rv)
+            return NULL;
+        rv = &set->fileinfos[i];
+    }
+    return rv;
+}
+
+/// @brief the binary size of one (non-last) part of a file, derived from the segments we have.
+/// @param file 
+/// @return the size or 0 if we have nothing to derive it from
+uint64_t damagemap_part_size(struct NZBFile *file) {
+    unsigned int last_number = 0;
+    uint64_t rv = 0;
+
+    for (unsigned int i = 0; i < file->segmentsSize; i++) {
+        if (file->segments[i].number > last_number)
+            last_number = file->segments[i].number;
+    }
+
+    for (unsigned int i = 0; i < file->segmentsSize; i++) {
+        struct NZBSegment *seg = &file->segments[i];
+        if ((seg->state != NSState_Done) && (seg->state != NSState_CRCError))
+            continue;
+        // =ypart begin of part n is exactly (n-1)*partsize:
+        if ((seg->number > 1) && (seg->offset != NZBSEGMENT_OFFSET_UNKNOWN))
+            return seg->offset / (seg->number - 1);
+        if (seg->number < last_number)
+            rv = seg->decoded_bytes;
+    }
+    return rv;
+}
+
+/// @brief where does a segment live inside the (decoded) file ?
+/// @param file the file the segment belongs to
+/// @param seg the segment
+/// @param file_length the real length of the file
+/// @param range out: offset/length
+/// @return false if there's no way to tell.
+bool damagemap_segment_range(struct NZBFile *file, struct NZBSegment *seg, uint64_t file_length, struct damage_range *range) {
+    uint64_t part_size;
+
+    if ((seg->offset != NZBSEGMENT_OFFSET_UNKNOWN) && (seg->decoded_bytes > 0)) {
+        range->offset = seg->offset;
+        range->length = seg->decoded_bytes;
+        return true;
+    }
+
+    part_size = damagemap_part_size(file);
+    if (!part_size)
+        return false;
+
+    range->offset = (uint64_t)(seg->number - 1) * part_size;
+    if (range->offset >= file_length)
+        return false;
+    range->length = file_length - range->offset < part_size ? file_length - range->offset : part_size;
+    return true;
+}
+
+/// @brief marks every slice touched by range as damaged.
+/// @param slice_size 
+/// @param dfile 
+/// @param range 
+void damagemap_mark_range(uint64_t slice_size, struct damage_file *dfile, struct damage_range *range) {
+    uint64_t first, last;
+
+    if (!range->length || !dfile->slice_count)
+        return;
+
+    first = range->offset / slice_size;
+    last = (range->offset + range->length - 1) / slice_size;
+    if (last >= dfile->slice_count)
+        last = dfile->slice_count - 1;
+
+    for (uint64_t s = first; s <= last; s++) {
+        if (!dfile->slice_damaged[s]) {
+            dfile->slice_damaged[s] = true;
+            dfile->damaged_slices++;
+        }
+    }
+}
+
+/// @brief builds the damage map from the par2 data (Main/FileDesc/IFSC) and the segment states.
+/// @param map the map to fill, old content is freed.
+/// @return false if there's no par2 data to work with.
+bool damagemap_build(struct damage_map *map) {
+    extern struct NZB nzb_tree;
+    struct par2_set *set = par2_default_set();
+    bool has_recovery_set = false;
+
+    damagemap_free(map);
+
+    if (!set || !set->fileinfos_length)
+        return false;
+
+    for (unsigned int i = 0; i < set->fileinfos_length; i++) {
+        if (set->fileinfos[i].in_recovery_set) {
+            has_recovery_set = true;
+            break;
+        }
+    }
+
+    map->set = set;
+    map->files = (struct damage_file*)calloc(set->fileinfos_length, sizeof(struct damage_file));
+
+    for (unsigned int i = 0; i < set->fileinfos_length; i++) {
+        struct par_fileinfo *pfile = &set->fileinfos[i];
+        struct damage_file *dfile;
+
+        if (has_recovery_set && !pfile->in_recovery_set)
+            continue;   // non-recovery files can't be repaired anyway.
+
+        dfile = &map->files[map->files_length++];
+        dfile->parfile = pfile;
+        dfile->slice_count = pfile->slices ? pfile->slice_count : par2_slices_of_length(set, pfile->file_length);
+        dfile->slice_damaged = (uint8_t*)calloc(dfile->slice_count ? dfile->slice_count : 1, 1);
+
+        for (unsigned int f = 0; f < nzb_tree.max_files; f++) {
+            if (!nzb_tree.files[f].is_par_vol_file && (damagemap_match_file(set, &nzb_tree.files[f]) == pfile)) {
+                dfile->nzbfile = &nzb_tree.files[f];
+                break;
+            }
+        }
+
+        if (!dfile->nzbfile) {
+            // not in the nzb at all, every slice has to be recovered.
+            memset(dfile->slice_damaged, true, dfile->slice_count);
+            dfile->damaged_slices = dfile->slice_count;
+        } else {
+            // a joined file knows where it's holes are:
+            for (unsigned int h = 0; h < dfile->nzbfile->holes_length; h++) {
+                struct damage_range range = { .offset = dfile->nzbfile->holes[h].offset, .length = dfile->nzbfile->holes[h].length };
+                damagemap_mark_range(set->slice_size, dfile, &range);
+            }
+
+            for (unsigned int sg = 0; sg < dfile->nzbfile->segmentsSize; sg++) {
+                struct NZBSegment *seg = &dfile->nzbfile->segments[sg];
+                struct damage_range range;
+
+                if (seg->state == NSState_Done)
+                    continue;
+                if ((dfile->nzbfile->state == NFState_Done) && !seg->decoded_bytes)
+                    continue;   // one of the holes.
+
+                if (!damagemap_segment_range(dfile->nzbfile, seg, pfile->file_length, &range)) {
+                    // we can't locate it, so the whole file is suspect.
+                    range.offset = 0;
+                    range.length = pfile->file_length;
+                }
+                damagemap_mark_range(set->slice_size, dfile, &range);
+            }
+        }
+
+        map->total_slices += dfile->slice_count;
+        map->damaged_slices += dfile->damaged_slices;
+    }
+
+    map->recovery_blocks_needed = map->damaged_slices;
+    map->valid = true;
+    return true;
+}
+
+/// @brief frees the map.
+/// @param map 
+void damagemap_free(struct damage_map *map) {
+    for (unsigned int i = 0; i < map->files_length; i++)
+        free (map->files[i].slice_damaged);
+    free (map->files);
+    memset(map, 0, sizeof(struct damage_map));
+}
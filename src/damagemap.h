@@ -0,0 +1,39 @@
+#ifndef DAMAGEMAP_H
+#define DAMAGEMAP_H
+#include <stdbool.h>
+#include <stdint.h>
+#include "xmlhandler.h"
+#include "parfiles.h"
+
+// a byte range of a file we don't have (or have broken):
+struct damage_range {
+    uint64_t    offset;
+    uint64_t    length;
+};
+
+// one file of the recovery set and it's damaged slices:
+struct damage_file {
+    struct par_fileinfo *parfile;
+    struct NZBFile      *nzbfile;       // NULL if the file isn't part of the NZB
+    uint32_t            slice_count;
+    uint32_t            damaged_slices;
+    uint8_t             *slice_damaged; // one byte per slice, true = damaged
+};
+
+struct damage_map {
+    struct par2_set     *set;           // the recovery set the map was built for
+    struct damage_file  *files;
+    unsigned int        files_length;
+    uint32_t            total_slices;
+    uint32_t            damaged_slices;
+    uint32_t            recovery_blocks_needed;
+    bool                valid;          // false = no Main/IFSC data, numbers are meaningless
+};
+
+extern struct damage_map mw_damage_map;
+
+bool damagemap_build(struct damage_map *map);
+void damagemap_free(struct damage_map *map);
+bool damagemap_segment_range(struct NZBFile *file, struct NZBSegment *seg, uint64_t file_length, struct damage_range *range);
+struct par_fileinfo *damagemap_match_file(struct par2_set *set, struct NZBFile *file);
+#endif
@@ -0,0 +1,252 @@
+/*
+ * GF(2^16) arithmetic for the PAR2 Reed-Solomon code.
+ *
+ * The region multiply (dst ^= factor * src, 16 bit little endian words)
+ * is where repair spends all of its time, so there are SSSE3/AVX2/AVX-512
+ * kernels, picked once at runtime. They all use the same trick: a word is
+ * four nibbles, factor * word is the xor of four 16-entry lookups, and
+ * pshufb does 16/32/64 of these lookups at once.
+ */
+#include <string.h>
+#include <pthread.h>
+#include "gf16.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GF16_X86
+#endif
+
+typedef void (*gf16_region_fn)(uint8_t *dst, const uint8_t *src, const uint8_t tables[8][16], size_t len);
+
+// exp table is doubled, so log[a]+log[b] never needs a modulo.
+static uint16_t gf16_exp_table[GF16_ORDER*2];
+static uint16_t gf16_log_table[GF16_ORDER+1];
+static pthread_once_t gf16_once = PTHREAD_ONCE_INIT;
+static gf16_region_fn gf16_region_kernel = NULL;
+static const char *gf16_region_kernel_name = "scalar";
+
+static void gf16_build_tables(void);
+static void gf16_nibble_tables(uint16_t factor, uint8_t tables[8][16]);
+static void gf16_muladd_scalar(uint8_t *dst, const uint8_t *src, const uint8_t tables[8][16], size_t len);
+
+/// @brief initializes the log/exp tables and picks the fastest region kernel. Thread-safe, cheap after the first call.
+/// @param  -
+void gf16_init(void) {
+    pthread_once(&gf16_once, gf16_build_tables);
+}
+
+/// @brief a * b
+uint16_t gf16_mul(uint16_t a, uint16_t b) {
+    if (!a || !b)
+        return 0;
+    return gf16_exp_table[gf16_log_table[a] + gf16_log_table[b]];
+}
+
+/// @brief a / b, b must not be 0
+uint16_t gf16_div(uint16_t a, uint16_t b) {
+    if (!a || !b)
+        return 0;
+    return gf16_exp_table[gf16_log_table[a] + GF16_ORDER - gf16_log_table[b]];
+}
+
+/// @brief a ^ n
+uint16_t gf16_pow(uint16_t a, uint32_t n) {
+    if (!n)
+        return 1;
+    if (!a)
+        return 0;
+    return gf16_exp_table[((uint64_t)gf16_log_table[a] * n) % GF16_ORDER];
+}
+
+/// @brief 2 ^ n
+uint16_t gf16_exp(uint32_t n) {
+    return gf16_exp_table[n % GF16_ORDER];
+}
+
+/// @brief log2(a), a must not be 0
+uint16_t gf16_log(uint16_t a) {
+    return gf16_log_table[a];
+}
+
+/// @brief the name of the region kernel in use (for the log).
+const char *gf16_kernel_name(void) {
+    gf16_init();
+    return gf16_region_kernel_name;
+}
+
+/// @brief the per-factor lookups: tables[2k] / tables[2k+1] are the low / high byte of factor * (n << 4k)
+/// @param factor
+/// @param tables
+static void gf16_nibble_tables(uint16_t factor, uint8_t tables[8][16]) {
+    for (unsigned int k = 0; k < 4; k++) {
+        for (unsigned int n = 0; n < 16; n++) {
+            uint16_t product = gf16_mul(factor, (uint16_t)(n << (4*k)));
+            tables[2*k][n] = product & 0xFF;
+            tables[2*k+1][n] = product >> 8;
+        }
+    }
+}
+
+/// @brief dst ^= factor * src for len bytes of 16 bit little endian words.
+/// @param dst if len is odd, dst has to have room for len+1 bytes (the last word's high byte).
+/// @param src
+/// @param factor
+/// @param len
+void gf16_muladd_region(uint8_t *dst, const uint8_t *src, uint16_t factor, size_t len) {
+    uint8_t tables[8][16];
+
+    if (!factor || !len)
+        return;
+
+    gf16_init();
+    gf16_nibble_tables(factor, tables);
+    gf16_region_kernel(dst, src, (const uint8_t (*)[16])tables, len);
+}
+
+static void gf16_muladd_scalar(uint8_t *dst, const uint8_t *src, const uint8_t tables[8][16], size_t len) {
+    size_t i;
+
+    for (i = 0; i + 1 < len; i += 2) {
+        dst[i]   ^= tables[0][src[i] & 15] ^ tables[2][src[i] >> 4] ^ tables[4][src[i+1] & 15] ^ tables[6][src[i+1] >> 4];
+        dst[i+1] ^= tables[1][src[i] & 15] ^ tables[3][src[i] >> 4] ^ tables[5][src[i+1] & 15] ^ tables[7][src[i+1] >> 4];
+    }
+
+    // odd length: the missing high byte is 0.
+    if (i < len) {
+        dst[i]   ^= tables[0][src[i] & 15] ^ tables[2][src[i] >> 4];
+        dst[i+1] ^= tables[1][src[i] & 15] ^ tables[3][src[i] >> 4];
+    }
+}
+
+#ifdef GF16_X86
+/*
+ * All three kernels: split 32/64/128 bytes into a vector of low bytes and one of
+ * high bytes (in-lane, that's why unpack puts them back in the same order),
+ * look up the four nibbles for both halves of the product, interleave, xor.
+ */
+__attribute__((target("ssse3")))
+static void gf16_muladd_ssse3(uint8_t *dst, const uint8_t *src, const uint8_t tables[8][16], size_t len) {
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    const __m128i even = _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i odd = _mm_setr_epi8(1, 3, 5, 7, 9, 11, 13, 15, -1, -1, -1, -1, -1, -1, -1, -1);
+    __m128i t[8];
+    size_t i;
+
+    for (unsigned int k = 0; k < 8; k++)
+        t[k] = _mm_loadu_si128((const __m128i*)tables[k]);
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        __m128i a = _mm_loadu_si128((const __m128i*)&src[i]);
+        __m128i b = _mm_loadu_si128((const __m128i*)&src[i+16]);
+        __m128i lo = _mm_unpacklo_epi64(_mm_shuffle_epi8(a, even), _mm_shuffle_epi8(b, even));
+        __m128i hi = _mm_unpacklo_epi64(_mm_shuffle_epi8(a, odd), _mm_shuffle_epi8(b, odd));
+        __m128i n0 = _mm_and_si128(lo, mask), n1 = _mm_and_si128(_mm_srli_epi16(lo, 4), mask);
+        __m128i n2 = _mm_and_si128(hi, mask), n3 = _mm_and_si128(_mm_srli_epi16(hi, 4), mask);
+        __m128i rlo = _mm_xor_si128(_mm_xor_si128(_mm_shuffle_epi8(t[0], n0), _mm_shuffle_epi8(t[2], n1)),
+                                    _mm_xor_si128(_mm_shuffle_epi8(t[4], n2), _mm_shuffle_epi8(t[6], n3)));
+        __m128i rhi = _mm_xor_si128(_mm_xor_si128(_mm_shuffle_epi8(t[1], n0), _mm_shuffle_epi8(t[3], n1)),
+                                    _mm_xor_si128(_mm_shuffle_epi8(t[5], n2), _mm_shuffle_epi8(t[7], n3)));
+        __m128i d0 = _mm_loadu_si128((const __m128i*)&dst[i]);
+        __m128i d1 = _mm_loadu_si128((const __m128i*)&dst[i+16]);
+        _mm_storeu_si128((__m128i*)&dst[i], _mm_xor_si128(d0, _mm_unpacklo_epi8(rlo, rhi)));
+        _mm_storeu_si128((__m128i*)&dst[i+16], _mm_xor_si128(d1, _mm_unpackhi_epi8(rlo, rhi)));
+    }
+
+    gf16_muladd_scalar(&dst[i], &src[i], tables, len - i);
+}
+
+__attribute__((target("avx2")))
+static void gf16_muladd_avx2(uint8_t *dst, const uint8_t *src, const uint8_t tables[8][16], size_t len) {
+    const __m256i mask = _mm256_set1_epi8(0x0F);
+    const __m256i even = _mm256_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, -1, -1, -1, -1, -1, -1, -1, -1,
+                                          0, 2, 4, 6, 8, 10, 12, 14, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m256i odd = _mm256_setr_epi8(1, 3, 5, 7, 9, 11, 13, 15, -1, -1, -1, -1, -1, -1, -1, -1,
+                                         1, 3, 5, 7, 9, 11, 13, 15, -1, -1, -1, -1, -1, -1, -1, -1);
+    __m256i t[8];
+    size_t i;
+
+    for (unsigned int k = 0; k < 8; k++)
+        t[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)tables[k]));
+
+    for (i = 0; i + 64 <= len; i += 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)&src[i]);
+        __m256i b = _mm256_loadu_si256((const __m256i*)&src[i+32]);
+        __m256i lo = _mm256_unpacklo_epi64(_mm256_shuffle_epi8(a, even), _mm256_shuffle_epi8(b, even));
+        __m256i hi = _mm256_unpacklo_epi64(_mm256_shuffle_epi8(a, odd), _mm256_shuffle_epi8(b, odd));
+        __m256i n0 = _mm256_and_si256(lo, mask), n1 = _mm256_and_si256(_mm256_srli_epi16(lo, 4), mask);
+        __m256i n2 = _mm256_and_si256(hi, mask), n3 = _mm256_and_si256(_mm256_srli_epi16(hi, 4), mask);
+        __m256i rlo = _mm256_xor_si256(_mm256_xor_si256(_mm256_shuffle_epi8(t[0], n0), _mm256_shuffle_epi8(t[2], n1)),
+                                       _mm256_xor_si256(_mm256_shuffle_epi8(t[4], n2), _mm256_shuffle_epi8(t[6], n3)));
+        __m256i rhi = _mm256_xor_si256(_mm256_xor_si256(_mm256_shuffle_epi8(t[1], n0), _mm256_shuffle_epi8(t[3], n1)),
+                                       _mm256_xor_si256(_mm256_shuffle_epi8(t[5], n2), _mm256_shuffle_epi8(t[7], n3)));
+        __m256i d0 = _mm256_loadu_si256((const __m256i*)&dst[i]);
+        __m256i d1 = _mm256_loadu_si256((const __m256i*)&dst[i+32]);
+        _mm256_storeu_si256((__m256i*)&dst[i], _mm256_xor_si256(d0, _mm256_unpacklo_epi8(rlo, rhi)));
+        _mm256_storeu_si256((__m256i*)&dst[i+32], _mm256_xor_si256(d1, _mm256_unpackhi_epi8(rlo, rhi)));
+    }
+
+    gf16_muladd_scalar(&dst[i], &src[i], tables, len - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void gf16_muladd_avx512(uint8_t *dst, const uint8_t *src, const uint8_t tables[8][16], size_t len) {
+    const __m512i mask = _mm512_set1_epi8(0x0F);
+    const __m512i even = _mm512_broadcast_i32x4(_mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, -1, -1, -1, -1, -1, -1, -1, -1));
+    const __m512i odd = _mm512_broadcast_i32x4(_mm_setr_epi8(1, 3, 5, 7, 9, 11, 13, 15, -1, -1, -1, -1, -1, -1, -1, -1));
+    __m512i t[8];
+    size_t i;
+
+    for (unsigned int k = 0; k < 8; k++)
+        t[k] = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i*)tables[k]));
+
+    for (i = 0; i + 128 <= len; i += 128) {
+        __m512i a = _mm512_loadu_si512((const void*)&src[i]);
+        __m512i b = _mm512_loadu_si512((const void*)&src[i+64]);
+        __m512i lo = _mm512_unpacklo_epi64(_mm512_shuffle_epi8(a, even), _mm512_shuffle_epi8(b, even));
+        __m512i hi = _mm512_unpacklo_epi64(_mm512_shuffle_epi8(a, odd), _mm512_shuffle_epi8(b, odd));
+        __m512i n0 = _mm512_and_si512(lo, mask), n1 = _mm512_and_si512(_mm512_srli_epi16(lo, 4), mask);
+        __m512i n2 = _mm512_and_si512(hi, mask), n3 = _mm512_and_si512(_mm512_srli_epi16(hi, 4), mask);
+        __m512i rlo = _mm512_xor_si512(_mm512_xor_si512(_mm512_shuffle_epi8(t[0], n0), _mm512_shuffle_epi8(t[2], n1)),
+                                       _mm512_xor_si512(_mm512_shuffle_epi8(t[4], n2), _mm512_shuffle_epi8(t[6], n3)));
+        __m512i rhi = _mm512_xor_si512(_mm512_xor_si512(_mm512_shuffle_epi8(t[1], n0), _mm512_shuffle_epi8(t[3], n1)),
+                                       _mm512_xor_si512(_mm512_shuffle_epi8(t[5], n2), _mm512_shuffle_epi8(t[7], n3)));
+        __m512i d0 = _mm512_loadu_si512((const void*)&dst[i]);
+        __m512i d1 = _mm512_loadu_si512((const void*)&dst[i+64]);
+        _mm512_storeu_si512((void*)&dst[i], _mm512_xor_si512(d0, _mm512_unpacklo_epi8(rlo, rhi)));
+        _mm512_storeu_si512((void*)&dst[i+64], _mm512_xor_si512(d1, _mm512_unpackhi_epi8(rlo, rhi)));
+    }
+
+    gf16_muladd_scalar(&dst[i], &src[i], tables, len - i);
+}
+#endif
+
+/// @brief builds log/exp and does the runtime dispatch.
+/// @param  -
+static void gf16_build_tables(void) {
+    uint32_t x = 1;
+
+    for (uint32_t i = 0; i < GF16_ORDER; i++) {
+        gf16_exp_table[i] = (uint16_t)x;
+        gf16_exp_table[i + GF16_ORDER] = (uint16_t)x;
+        gf16_log_table[x] = (uint16_t)i;
+        x <<= 1;
+        if (x & 0x10000)
+            x ^= GF16_POLYNOMIAL;
+    }
+    gf16_log_table[0] = 0;  // undefined, guarded by the callers.
+
+    gf16_region_kernel = gf16_muladd_scalar;
+#ifdef GF16_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw")) {
+        gf16_region_kernel = gf16_muladd_avx512;
+        gf16_region_kernel_name = "avx512";
+    } else if (__builtin_cpu_supports("avx2")) {
+        gf16_region_kernel = gf16_muladd_avx2;
+        gf16_region_kernel_name = "avx2";
+    } else if (__builtin_cpu_supports("ssse3")) {
+        gf16_region_kernel = gf16_muladd_ssse3;
+        gf16_region_kernel_name = "ssse3";
+    }
+#endif
+}
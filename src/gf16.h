@@ -0,0 +1,19 @@
+#ifndef GF16_H
+#define GF16_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// GF(2^16) w. the PAR2 generator polynomial x^16 + x^12 + x^3 + x + 1
+#define GF16_POLYNOMIAL 0x1100B
+#define GF16_ORDER      65535
+
+void gf16_init(void);
+uint16_t gf16_mul(uint16_t a, uint16_t b);
+uint16_t gf16_div(uint16_t a, uint16_t b);
+uint16_t gf16_pow(uint16_t a, uint32_t n);
+uint16_t gf16_exp(uint32_t n);
+uint16_t gf16_log(uint16_t a);
+void gf16_muladd_region(uint8_t *dst, const uint8_t *src, uint16_t factor, size_t len);
+const char *gf16_kernel_name(void);
+#endif
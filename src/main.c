@@ -12,13 +12,18 @@
 #include "xmlhandler.h"
 #include "utils.h"
 #include "parfiles.h"
+#include "watch.h"
+#include "prefetch.h"
 
 // local variables
 SSL_CTX *ssl_ctx;
 
 char* app_name = NULL;
 char* cfg_file = NULL;
-char* nzb_file = NULL;
+char* nzb_file = NULL;              // the one being downloaded, one of nzb_files
+char** nzb_files = NULL;            // batch mode: every nzb from the command line and -b
+unsigned int nzb_files_length = 0;
+char* watch_dir = NULL;             // watch-folder mode
 
 int max_threads = -1;
 bool quiet_output = false;
@@ -33,10 +38,14 @@ void parse_user_args(int argc, char **argv);
 void print_help(void);
 void print_config(void);
 void cleanup(void);
-void init_connection(void);
+bool init_connection(void);
+void add_nzb_file(const char *filename);
+bool add_nzb_list(const char *listname);
+bool download_nzb(char *filename);
 
 int main(int argc, char **argv) {
     struct passwd* userInfo;
+    int rv = EXIT_SUCCESS;
 
     setlocale(LC_ALL, "");
     atexit(cleanup);
@@ -48,20 +57,14 @@ int main(int argc, char **argv) {
 
     // check if user has passed nzb-file (at least..)
     parse_user_args(argc, argv);            
-    if (!nzb_file)
+    if (!nzb_files_length && !watch_dir)
         return EXIT_FAILURE;
 
-    // load it!
-    if (!nzb_load(nzb_file)) {
-        LOG_MESSAGE(true, "NZB File loading failed!\n");
-        return EXIT_FAILURE;
-    }
     // the nzb-file is everything we need to know from the user, load config:        
     if (!xml_load_config(cfg_file)) {
         LOG_MESSAGE(true, "Error opening config file\n");
         return EXIT_FAILURE;
     }
-
     // set values for max. threads:
     if (max_threads != -1) { // threads was not set in cmd line
         if (pair_find(config_server, "connections"))    // was threads set in config ?
@@ -74,13 +77,79 @@ int main(int argc, char **argv) {
     rapidyenc_decode_init();
     rapidyenc_crc_init();
 
-    // and initialize everything to connecto the server
-    init_connection();  
-    return EXIT_SUCCESS;
+    // one nzb after the other, the connections are made once and kept for all of them. The next
+    // one is parsed meanwhile, the connections idle in the tail of this one start on it:
+    for (unsigned int n = 0; n < nzb_files_length; n++) {
+        if (nzb_files_length > 1)
+            q_printf("\n[%u/%u] %s\n", n + 1, nzb_files_length, nzb_files[n]);
+        prefetch_start(n + 1 < nzb_files_length ? nzb_files[n + 1] : NULL);
+        if (!download_nzb(nzb_files[n]))
+            rv = EXIT_FAILURE;
+    }
+    prefetch_reset();
+    // .. and for everything that shows up in the watched directory:
+    if (watch_dir && !watch_folder(watch_dir, download_nzb))
+        rv = EXIT_FAILURE;
+    mw_disconnect();
+    return rv;
+}
+
+/// @brief loads, downloads and post-processes one nzb.
+/// @param filename 
+/// @return true if the release was completed.
+bool download_nzb(char *filename) {
+    bool rv = false;
+
+    nzb_file = filename;
+    // the download directory holds the nzb cache:
+    if (mw_prepare_directories()) {
+        // load it! (the rest is parsed while the download runs)
+        if (nzb_load(nzb_file)) {
+            // and initialize everything to connect to the server
+            rv = init_connection();
+        } else
+            LOG_MESSAGE(true, "NZB File loading failed!\n");
+    }
+    mw_unload_nzb();
+    nzb_file = NULL;
+    return rv;
+}
+
+/// @brief queues a nzb for download, w. it's absolute path (par2bin changes the directory for a while).
+/// @param filename 
+void add_nzb_file(const char *filename) {
+    char *path = realpath(filename, NULL);
+
+    nzb_files = (char**)realloc(nzb_files, sizeof(char*) * (nzb_files_length + 1));
+    nzb_files[nzb_files_length++] = path ? path : strdup(filename);     // a missing one fails w. it's name.
+}
+
+/// @brief queues every nzb of a list file, one per line (empty lines and # comments are skipped).
+/// @param listname 
+/// @return false if the list couldn't be read.
+bool add_nzb_list(const char *listname) {
+    FILE *list = fopen(listname, "r");
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t length;
+
+    if (!list) {
+        LOG_MESSAGE(true, "Couldn't open: %s, Error: %s (%i)\n", listname, strerror(errno), errno);
+        return false;
+    }
+    while ((length = getline(&line, &line_size, list)) != -1) {
+        while ((length > 0) && ((line[length - 1] == '\n') || (line[length - 1] == '\r')))
+            line[--length] = 0;
+        if (length && (line[0] != '#'))
+            add_nzb_file(line);
+    }
+    free (line);
+    fclose (list);
+    return true;
 }
 
 void parse_user_args(int argc, char **argv) {
-    const char *options="+c:t:n:hsqrk";
+    const char *options="+c:t:n:b:w:hsqrk";
     int opt;
     
     while ((opt = getopt(argc, argv, options)) != -1) {
@@ -112,25 +181,38 @@ void parse_user_args(int argc, char **argv) {
                     exit (1);
                 }
                 break;
+            case 'b':   // batch: a list of nzbs
+                if (!add_nzb_list(optarg))
+                    exit (EXIT_FAILURE);
+                break;
+            case 'w':   // watch-folder
+                watch_dir = realpath(optarg, NULL);
+                if (!watch_dir) {
+                    LOG_MESSAGE(true, "Error: Couldn't find the watch folder %s, Error: %s (%i)\n", optarg, strerror(errno), errno);
+                    exit (EXIT_FAILURE);
+                }
+                break;
             case 'h':   // help
-                if (nzb_file) free (nzb_file);
                 print_help();
-                return;
+                exit (EXIT_FAILURE);
         }
     }
 
-    if (optind < argc)
-        nzb_file = strdup(argv[optind]);
+    // every other argument is a nzb too:
+    for (int i = optind; i < argc; i++)
+        add_nzb_file(argv[i]);
 
-    if (!nzb_file) {
-        LOG_MESSAGE(true, "Error: You have to pass the name of a NZB file with %s [options] <file>\n", app_name);
+    if (!nzb_files_length && !watch_dir) {
+        LOG_MESSAGE(true, "Error: You have to pass the name of a NZB file with %s [options] <file> [<file>..]\n", app_name);
     }
 }
 
 void print_help(void) {
-    printf ("%s [options] <filename> - NZB downloader\n\n", app_name);
+    printf ("%s [options] <filename> [<filename>..] - NZB downloader\n\n", app_name);
     printf ("-c FILE\t\t-\tConfig File Name [%s]\n", cfg_file);
     printf ("-t NUMBER\t-\tMax. Connections To Use [%i]\n", max_threads);
+    printf ("-b FILE\t\t-\tBatch: Download every NZB listed in FILE (one per line)\n");
+    printf ("-w DIR\t\t-\tWatch: Download every NZB that appears in DIR, move it to DIR/done or DIR/failed\n");
     printf ("-q\t\t-\tQuiet!\n");
     printf ("-s\t\t-\tPrint default-config (%s -s > ~/.nzbweaver.cfg)\n", app_name);
     printf ("-r\t\t-\tRemove NZB file after unpacking\n");
@@ -141,20 +223,28 @@ void print_help(void) {
 void print_config(void) {
     printf ("<config>\n");
     printf ("<server address=\"best.news.server.com\" port=\"119\" ssl=\"false\" connection=\"5\" username=\"username\" password=\"password\"/>\n");
-    printf ("<download path=\"/my/drive/Downloads/\" unrarbin=\"/usr/bin/unrar\" par2bin=\"/usr/bin/par2\" cancelthreshpct=\"90\" skipvolfiles=\"false\" naming=\"0\" />\n");
+    printf ("<download path=\"/my/drive/Downloads/\" unrarbin=\"/usr/bin/unrar\" par2bin=\"/usr/bin/par2\" par2threads=\"0\" par2jobs=\"0\" volmarginpct=\"10\" schedule=\"metadata\" streamunpack=\"false\" directunpack=\"false\" abortencrypted=\"true\" unrarjobs=\"0\" cancelthreshpct=\"90\" prefetchmb=\"64\" skipvolfiles=\"false\" naming=\"0\" />\n");
     printf ("</config>\n");
 }
 
 void cleanup(void) {
     if (app_name) free (app_name);
     if (cfg_file) free (cfg_file);
-    if (nzb_file) free (nzb_file);
+    for (unsigned int n = 0; n < nzb_files_length; n++)
+        free (nzb_files[n]);
+    free (nzb_files);
+    if (watch_dir) free (watch_dir);
 
+    prefetch_reset();
     cleanup_xmlhandler();
+    par2_index_free();
 }
 
 
-void init_connection(void) {
+/// @brief connects (once) and downloads the loaded nzb.
+/// @param  -
+/// @return true if the release was completed.
+bool init_connection(void) {
     int port = 0;
     bool useSSL = false;
     char *address = NULL, *username = NULL, *password = NULL;
@@ -180,7 +270,7 @@ void init_connection(void) {
         exit (EXIT_FAILURE);
     }
 
-    if (useSSL) {
+    if (useSSL && !ssl_ctx) {
         SSL_library_init();
         SSL_load_error_strings();
         OpenSSL_add_all_algorithms();
@@ -208,5 +298,5 @@ void init_connection(void) {
         }
     }
 
-    mw_connect(address, port, username, password, useSSL, max_threads);
+    return mw_connect(address, port, username, password, useSSL, max_threads);
 }
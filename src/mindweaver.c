@@ -9,14 +9,20 @@
  */
 #include "mindweaver.h"
 #include <termios.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <sys/sysmacros.h>
+#include <openssl/evp.h>
 
 // variables:
 struct nntp_server *nntp_connections = NULL;
 pthread_t          *mw_threads = NULL;
 pthread_mutex_t     mw_last_check_block = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t     mw_par2_index_lock = PTHREAD_MUTEX_INITIALIZER;
 int                 mw_cancel_thresh_pct = 0;
-uint64_t            mw_failed_segments = 0;
-uint64_t            mw_expected_segments = 0;
+atomic_bool         mw_encrypted_found = false;     // reported once per download
+struct par2_repair_run *mw_par2_runs = NULL;        // the recovery sets of the last verify
+unsigned int        mw_par2_runs_length = 0;
 
 struct nntp_server nntp_server_info;
 unsigned int mw_max_threads = 0;
@@ -43,6 +49,8 @@ int             mw_force_rename = RENAME_GUESS;
 void *mw_thread_work (void* arg);
 void *mw_draw_display(void* arg);
 void mw_handle_sigwinch(int sig);
+void mw_par2_identify(struct NZBFile *curFile);
+void mw_match_par2_name(struct NZBFile *file);
 
 // for the brief overview:
 const char *nzb_status_text[] = {
@@ -59,7 +67,6 @@ const char *nzb_status_text[] = {
 /// @return 
 bool mw_connect(char *address, uint16_t port, char *username, char *password, bool useSSL, unsigned int threads) {
     mw_max_threads = threads;
-    extern struct NZB nzb_tree;
     
     if (!nntp_connections) {
         // copy the data so the caller doesn't have to care about lifetime:
@@ -71,39 +78,55 @@ bool mw_connect(char *address, uint16_t port, char *username, char *password, bo
         nntp_server_info.use_ssl = useSSL;
         nntp_server_info.username = username ? strdup(username) : NULL;
         nntp_server_info.connectionID = 0;
+        nntp_server_info.connected = false;
         // reserve enough space for all our connections:
         nntp_connections = (struct nntp_server*)calloc(threads, sizeof(struct nntp_server));
         mw_threads = (pthread_t*)calloc(threads, sizeof(pthread_t));
         mw_thread_infos = (struct thread_user_data*)calloc(threads, sizeof(struct thread_user_data));
-
-        if (!mw_prepare_directories())
+        if (!stats_init(threads))
             return false;
-    } else {
-        memset(nntp_connections, 0, sizeof(struct nntp_server)*threads);
-        memset(mw_threads, 0, sizeof(pthread_t)*threads);
-        memset(mw_thread_infos, 0, sizeof(struct thread_user_data)*threads);
+
+        // copy the original memory to the thread-connection-infos, the threads connect them once
+        // and they're kept for every pass and every nzb (see mw_disconnect):
+        for (unsigned int i = 0; i < threads; i++) {
+            memcpy(&nntp_connections[i], &nntp_server_info, sizeof(struct nntp_server));    // one string, multiple pointers.. 
+            nntp_connections[i].connectionID = i;
+            mw_thread_infos[i].connection = &nntp_connections[i];
+            mw_thread_infos[i].stats_slot = i;
+        }
     }
 
+    if (!mw_prepare_directories())
+        return false;
+    nzb_schedule_set_workers(threads);
+
+    // everything else starts over for this nzb:
+    mw_runLoop = true;
+    mw_quit_download = false;
+    mw_post_ok_operation = true;
+    atomic_store(&mw_encrypted_found, false);
+    mw_download_type = NZBDownload_Everything;
+    unpack_stream_init();
+    rarstore_init();
+
     if (pair_find(config_downloads, "cancelthreshpct"))
         mw_cancel_thresh_pct = atoi(pair_find(config_downloads, "cancelthreshpct"));
 
-    for (unsigned int curFile = 0; curFile < nzb_tree.max_files; curFile++)
-        mw_expected_segments += nzb_tree.files[curFile].segmentsSize;
-
     if (mw_volpar_after_incomplete)
         mw_download_type = NZBDownload_Content; // download content first, not everything!
 
     epoch_download_start = time(NULL);
 
-    // copy the original memory to the thread-connection-infos, and give it a go..
+    // give it a go..
     for (unsigned int i = 0; i < threads; i++) {
-        memcpy(&nntp_connections[i], &nntp_server_info, sizeof(struct nntp_server));    // one string, multiple pointers.. 
-        nntp_connections[i].connectionID = i;
+        nntp_connections[i].work_done = false;
         mw_thread_infos[i].dbg_article = NULL;
-        mw_thread_infos[i].connection = &nntp_connections[i];
         mw_thread_infos[i].downloaded = NULL;
         mw_thread_infos[i].filename = NULL;
         mw_thread_infos[i].filesize = NULL;
+        mw_thread_infos[i].in_tail = false;
+    }
+    for (unsigned int i = 0; i < threads; i++) {
         if (pthread_create(&mw_threads[i], NULL, mw_thread_work, (void*)&mw_thread_infos[i]) != 0)
             return false;
         pthread_detach(mw_threads[i]);
@@ -111,9 +134,32 @@ bool mw_connect(char *address, uint16_t port, char *username, char *password, bo
     }
 
     // enter key-press-draw-loop
-    mw_loop();
+    return mw_loop();
+}
 
-    return true;    
+/// @brief closes the connections of the pool (after the last nzb).
+/// @param  -
+void mw_disconnect(void) {
+    for (unsigned int i = 0; nntp_connections && (i < mw_max_threads); i++) {
+        if (nntp_connections[i].connected)
+            nntp_disconnect(&nntp_connections[i]);
+        nntp_connections[i].connected = false;
+    }
+}
+
+/// @brief forgets everything about the current nzb, the connections stay.
+/// @param  -
+void mw_unload_nzb(void) {
+    unpack_stream_reset();
+    rarstore_reset();
+    sfv_reset();
+    stats_reset();
+    free (mw_par2_runs);
+    mw_par2_runs = NULL;
+    mw_par2_runs_length = 0;
+    damagemap_free(&mw_damage_map);
+    par2_index_free();
+    cleanup_xmlhandler();
 }
 
 /// @brief prepares directories for the download
@@ -124,6 +170,9 @@ bool mw_prepare_directories(void) {
     extern char* nzb_file;
     extern struct NZB nzb_tree;
 
+    if (nzb_tree.download_destination)
+        return true;    // done before the nzb was loaded
+
     unsigned int nzbname_len = strlen(nzb_file);
     // download-path exists, so prepare the download path for this nzb:
     char *nzbname_start = nzb_file, *nzbname_end = nzb_file+nzbname_len, *nzbPath = NULL;
@@ -179,30 +228,34 @@ void *mw_thread_work (void* arg) {
     bool    am_i_last_thread = true;
     double  pct_failed = 0.;
 
-    // connect
-    if (!nntp_connect(serverInfo)) {
-        LOG_MESSAGE(false, "thread %i connection failed");
-        userData->connection->work_done = true;
-        goto thread_exit;
+    // connect, unless the last pass/nzb did already (and the server didn't drop it while idle):
+    if (serverInfo->connected && !nntp_is_alive(serverInfo)) {
+        LOG_MESSAGE(false, "thread %i: the server closed the idle connection, reconnecting.", userData->connection->connectionID);
+        nntp_close(serverInfo);
+        serverInfo->connected = false;
     }
-
-    // if we have username/password, authenticate
-    if (serverInfo->username) {
-        if (!nntp_authenticate(serverInfo, serverInfo->username, serverInfo->password)) {
-            LOG_MESSAGE(false, "thread %i auth failed\n", userData->connection->connectionID);
+    if (!serverInfo->connected) {
+        if (!nntp_connect(serverInfo)) {
+            LOG_MESSAGE(false, "thread %i connection failed");
             userData->connection->work_done = true;
             goto thread_exit;
         }
+
+        // if we have username/password, authenticate
+        if (serverInfo->username) {
+            if (!nntp_authenticate(serverInfo, serverInfo->username, serverInfo->password)) {
+                LOG_MESSAGE(false, "thread %i auth failed\n", userData->connection->connectionID);
+                userData->connection->work_done = true;
+                goto thread_exit;
+            }
+        }
+        serverInfo->connected = true;
     }
 
     // iterate thru the tree until it returns false.
-    while (nzb_tree_next_segment(&curFile, &curSeg)) {
-        // write article-id as nzb-release/articleid
-        char *fullfilePath;
-        fullfilePath = mprintfv ("%s/%s", nzb_tree.download_destination, curSeg->articleID);
-
-        // stop everything ?
-        if (mw_quit_download) {
+    while (nzb_tree_next_segment(userData->connection->connectionID, &curFile, &curSeg)) {
+        // stop everything ? (a parse error before mw_connect() reset mw_quit_download is in the tree)
+        if (mw_quit_download || nzb_tree.parse_failed) {
             LOG_MESSAGE(false, "mw_quit_download == true, stopping Thread %i", userData->connection->connectionID);
             break;
         }
@@ -214,15 +267,23 @@ void *mw_thread_work (void* arg) {
         curFile->open_segments++;
 
         // request an article from the server -> this can and will fail!
-        if (mw_get_binary_from_article(userData, curFile, curSeg, &recvBuffer)) {
+        if (mw_get_segment(userData, curFile, curSeg, &recvBuffer)) {
+            // write article-id as nzb-release/articleid (the one that was fetched)
+            char *fullfilePath = mprintfv ("%s/%s", nzb_tree.download_destination, nzb_segment_article(curSeg));
             write_to_file(fullfilePath, (uint8_t*)recvBuffer, curSeg->decoded_bytes);
+            if (curSeg->number == 1) {
+                mw_par2_identify(curFile);
+                mw_check_encryption(curFile, (uint8_t*)recvBuffer, curSeg->decoded_bytes);
+            }
+            rarstore_segment(curFile, curSeg, (uint8_t*)recvBuffer);
             free(fullfilePath);
             free (recvBuffer);
             recvBuffer = NULL;
         } else {
-            mw_failed_segments++;
+            stats_add(userData->stats_slot, Stats_FailedSegments, 1);
 
-            pct_failed = (double)(mw_expected_segments-mw_failed_segments)/(double)mw_expected_segments;
+            // schedule_length grows while the nzb is parsed, these are the segments we know about:
+            pct_failed = (double)(nzb_tree.schedule_length-stats_sum(Stats_FailedSegments))/(double)nzb_tree.schedule_length;
             pct_failed *= 100.;
 
             if ((mw_cancel_thresh_pct > 0) && ((int)pct_failed < mw_cancel_thresh_pct)) {
@@ -235,7 +296,10 @@ void *mw_thread_work (void* arg) {
         }
 
         curFile->open_segments--;
-        curFile->remaining_segments--;
+        nzb_cache_store_segment(curSeg);
+        // remaining_segments counts the finished ones, exactly one thread takes it to 0:
+        if (atomic_fetch_sub(&curFile->remaining_segments, 1) == 1)
+            sfv_file_complete(curFile);
 
         LOG_MESSAGE(false, "Thread: %d loop ended, remaining_segments:%d, open_segments:%d, Filename: \"%s\"\n", userData->connection->connectionID,        
             curFile->remaining_segments, curFile->open_segments, curFile->filename);
@@ -243,6 +307,8 @@ void *mw_thread_work (void* arg) {
 
     if (!curFile && !curSeg)
         LOG_MESSAGE(false, "Thread %i has finished it's work, exiting..", userData->connection->connectionID);
+    if (!mw_quit_download && !nzb_tree.parse_failed)
+        mw_prefetch_tail(userData);
     userData->connection->work_done = true;
 
 thread_exit:
@@ -257,11 +323,59 @@ thread_exit:
     if (am_i_last_thread)
         mw_runLoop = false;
     pthread_mutex_unlock(&mw_last_check_block);
-    nntp_disconnect(serverInfo);
+    // a working connection is kept for the next pass/nzb:
+    if (!serverInfo->connected)
+        nntp_disconnect(serverInfo);
     pthread_exit(NULL);
 }
 
-/// @brief retrieves an article
+/// @brief the connection has nothing left to fetch, the others are still busy w. the tail of the nzb:
+///        meanwhile it fetches the first articles of the next one (see prefetch.c). It stops as soon
+///        as no other connection is downloading, so the nzb's end is put off by one article at most.
+/// @param userData 
+void mw_prefetch_tail(struct thread_user_data *userData) {
+    for (;;) {
+        bool others_busy = false;
+
+        pthread_mutex_lock(&mw_last_check_block);
+        userData->in_tail = true;
+        for (unsigned int i = 0; (i < mw_max_threads) && !others_busy; i++)
+            others_busy = !nntp_connections[i].work_done && !mw_thread_infos[i].in_tail;
+        pthread_mutex_unlock(&mw_last_check_block);
+
+        if (!others_busy || mw_quit_download || !prefetch_fetch(userData->connection))
+            return;
+    }
+}
+
+/// @brief retrieves a segment, if it's article fails the reposts of it (alternates) are tried.
+/// @param userData 
+/// @param curFile 
+/// @param curSeg 
+/// @param buffer the decoded data
+/// @return true if one of the articles was fetched.
+bool mw_get_segment(struct thread_user_data *userData, struct NZBFile *curFile, struct NZBSegment *curSeg, char **buffer) {
+    for (unsigned int alt = 0; ; alt++) {
+        struct NZBSegment *altSeg;
+        uint32_t article;
+
+        if (mw_get_binary_from_article(userData, curFile, curSeg, buffer))
+            return true;
+        if ((altSeg = nzb_segment_alternate(curFile, curSeg, alt)) == NULL) {
+            curFile->crcOk = false; // with some failed segments, the file cannot be ok.
+            return false;
+        }
+
+        // the failed one becomes the alternate, so the segment file is named after the good one:
+        LOG_MESSAGE(false, "Segment-Nr:%d of \"%s\" failed, trying repost %s", curSeg->number, curFile->filename, nzb_segment_article(altSeg));
+        article = curSeg->article;
+        curSeg->article = altSeg->article;
+        altSeg->article = article;
+        nzb_cache_store_segment(altSeg);
+    }
+}
+
+/// @brief retrieves an article, a failed one doesn't touch curFile->crcOk (a repost may still come).
 /// @param articleID 
 /// @param binSize 
 /// @return 
@@ -275,10 +389,10 @@ bool mw_get_binary_from_article(struct thread_user_data *userData, struct NZBFil
         return false;
     }
 
-    // request an article from the server -> this can and will fail!
-    if (nntp_get_article(serverInfo, curSeg->articleID, &recvBuffer)) {
+    // request an article from the server -> this can and will fail! (unless it was prefetched in the last nzb's tail)
+    if (prefetch_take(nzb_segment_article(curSeg), &recvBuffer) || nntp_get_article(serverInfo, nzb_segment_article(curSeg), &recvBuffer)) {
         LOG_MESSAGE(false, "%d thread fetched segment-Nr:%d for file \"%s\"\n", userData->connection->connectionID, curSeg->number, curFile->filename);
-        userData->dbg_article = curSeg->articleID;
+        userData->dbg_article = nzb_segment_article(curSeg);
         userData->filename = curFile->filename;
         userData->downloaded = &curFile->download_size;     
         userData->filesize = &curFile->file_size;
@@ -297,29 +411,37 @@ bool mw_get_binary_from_article(struct thread_user_data *userData, struct NZBFil
             }
    
             // decode w. rapidyenc & return binary size:
-            binarySize = nntp_decode_yenc(yEncStart, &binary, &crcOk);
-            if (binarySize == 0) {
-                curFile->crcOk = false;     // yea this isn't ok.
-                goto error;
+            binarySize = nntp_decode_yenc(yEncStart, &binary, &crcOk, &curSeg->offset, &curSeg->crc32);
+            if (binarySize == 0)
+                goto error;     // yea this isn't ok.
+
+            if (crcOk == -1) curFile->crcOk = false;   // no crc in the trailer is no damage.
+            curSeg->state = crcOk == -1 ? NSState_CRCError : NSState_Done;
+
+            // the first 16k identify the file in the FileDesc packets, whatever the nzb/yEnc names say:
+            if ((curSeg->number == 1) && (curSeg->state == NSState_Done) && curFile->file_size) {
+                uint64_t length_16k = curFile->file_size < 16384 ? curFile->file_size : 16384;
+                if (binarySize >= length_16k) {
+                    EVP_Digest(binary, length_16k, curFile->md5_16k, NULL, EVP_md5(), NULL);
+                    curFile->has_md5_16k = true;
+                }
             }
-
-            if (!crcOk) curFile->crcOk = false;
             
             curSeg->decoded_bytes = binarySize;
             *userData->downloaded += binarySize;
-            nzb_tree.release_downloaded += curSeg->bytes;   // because the release_size is from nzb too, not from yenc-header!!
+            stats_add(userData->stats_slot, Stats_ReleaseDownloaded, curSeg->bytes);   // because the release_size is from nzb too, not from yenc-header!!
             *buffer = binary;
             free (recvBuffer);
         }
     } else {
         LOG_MESSAGE (false, "FAILED: Request of segment Nr: %d for File \"%s\"\n", curSeg->number, curFile->filename);
-        curFile->crcOk = false; // with some failed segments, the file cannot be ok.
         goto error;
     }    
 
     return true;
 error:
     if (recvBuffer) free(recvBuffer);
+    curSeg->state = NSState_Failed;
     *buffer = NULL;
     return false;
 }
@@ -345,6 +467,56 @@ bool mw_parse_yenc_header (char *yEncStart, struct NZBFile *curFile, uint64_t **
     return true;
 }
 
+/// @brief loads the index par2 as soon as it's first segment is on disk and names every file
+///        whose first 16k are known. Called after every first segment of a file.
+/// @param curFile the file whose first segment just arrived
+void mw_par2_identify(struct NZBFile *curFile) {
+    extern struct NZB nzb_tree;
+
+    pthread_mutex_lock(&mw_par2_index_lock);
+    if (!par2_default_set()) {
+        bool isMain = false;
+
+        if ((curFile->segmentsSize == 1) && !curFile->is_par_vol_file &&
+            (string_ends_width(curFile->filename, ".par2") || string_ends_width(curFile->yenc_filename, ".par2")) &&
+            get_par2_filenames(curFile, &isMain) && par2_default_set()) {
+            LOG_MESSAGE(false, "Index par2 %s loaded during download, %u files in the set.", curFile->filename, par2_default_set()->fileinfos_length);
+            for (unsigned int i = 0; i < nzb_tree.max_files; i++)
+                mw_match_par2_name(&nzb_tree.files[i]);
+        }
+    } else
+        mw_match_par2_name(curFile);
+    pthread_mutex_unlock(&mw_par2_index_lock);
+}
+
+/// @brief sets file->par2_filename if it's 16k-md5 matches exactly one FileDesc.
+/// @param file 
+void mw_match_par2_name(struct NZBFile *file) {
+    struct par_fileinfo *info;
+
+    if (!file->has_md5_16k || file->par2_filename)
+        return;
+
+    info = par2_find_fileinfo_by_md5_16k(par2_default_set(), file->md5_16k);
+    if (info && info->name && info->name_ok) {
+        file->par2_filename = strdup(info->name);
+        LOG_MESSAGE(false, "Identified %s as %s (16k-md5).", file->filename, file->par2_filename);
+    }
+}
+
+/// @brief the name a file is joined to: par2's, or the one nzb_tree.rename_files_to says.
+/// @param curFile
+/// @return
+char *mw_final_filename(struct NZBFile *curFile) {
+    extern struct NZB nzb_tree;
+
+    if (curFile->par2_filename)
+        return curFile->par2_filename;
+    if ((nzb_tree.rename_files_to == NZBRename_NZB) || !curFile->yenc_filename)
+        return curFile->filename;
+    return curFile->yenc_filename;
+}
+
 /// @brief The last thing we do for sure: Join every segment to files.
 /// @param curFile the current file to join
 /// @param trueFileName it's true name, revealed by par2 or the yEnc-Header.
@@ -352,6 +524,8 @@ void mw_join_segments(struct NZBFile *curFile) {
     int fd_complete_file = -1;
     extern struct NZB nzb_tree;
     char *finalName;
+    uint64_t position = 0;      // the end of what's written so far
+    bool after_gap = false;
 
     if (!curFile->yenc_filename) {
         LOG_MESSAGE(false, "Missing %s->yenc_filename, using nzb-provided.", curFile->filename);
@@ -362,7 +536,7 @@ void mw_join_segments(struct NZBFile *curFile) {
         curFile->yenc_filename = strdup(curFile->filename);
     }
 
-    finalName = nzb_tree.rename_files_to == NZBRename_NZB ?  curFile->filename : curFile->yenc_filename;
+    finalName = mw_final_filename(curFile);
 
     char *release_file_name = mprintfv("%s/%s", nzb_tree.download_destination, finalName);
 
@@ -380,41 +554,83 @@ void mw_join_segments(struct NZBFile *curFile) {
         return;
     }
 
+    // every segment goes to it's own offset, what's missing stays a zero-filled hole so the damage
+    // doesn't shift the rest of the file (and every par2 slice behind it):
+    free (curFile->holes);
+    curFile->holes = NULL;
+    curFile->holes_length = 0;
     for (unsigned int i = 0; i < curFile->segmentsSize; i++) {
-        if (curFile->segments[i].decoded_bytes == 0)
+        struct NZBSegment *seg = &curFile->segments[i];
+        struct damage_range range;
+        uint64_t offset = position;
+
+        if (seg->decoded_bytes == 0) {
+            after_gap = true;
             continue;
+        }
 
-        char *segmentFile = mprintfv("%s%s", nzb_tree.download_destination, curFile->segments[i].articleID);
+        char *segmentFile = mprintfv("%s%s", nzb_tree.download_destination, nzb_segment_article(seg));
         char *joinbuffer;
         int fd_join = open(segmentFile, O_RDONLY);
         
         if (fd_join == -1) {
-            LOG_MESSAGE(false, "Segment %d (%s) for File %s MISSING.", curFile->segments[i].number, curFile->segments[i].articleID, curFile->yenc_filename);
+            LOG_MESSAGE(false, "Segment %d (%s) for File %s MISSING.", seg->number, nzb_segment_article(seg), curFile->yenc_filename);
             unlink(segmentFile);
             free (segmentFile);
+            after_gap = true;
             continue;   // yea, a part could be missing, jump to next
         }
-        
-        joinbuffer = (char*)calloc(curFile->segments[i].decoded_bytes, 1);
-        ssize_t read_in_bytes = read(fd_join, joinbuffer, curFile->segments[i].decoded_bytes);
-        ssize_t wrote_out_bytes = write(fd_complete_file, joinbuffer, curFile->segments[i].decoded_bytes);
-        curFile->joined_size += wrote_out_bytes;
+
+        if (seg->offset != NZBSEGMENT_OFFSET_UNKNOWN)
+            offset = seg->offset;
+        else if (after_gap && damagemap_segment_range(curFile, seg, curFile->file_size ? curFile->file_size : UINT64_MAX, &range))
+            offset = range.offset;  // no =ypart, estimated from the part size.
+        after_gap = false;
+
+        if (offset > position)
+            mw_join_add_hole(curFile, position, offset - position);
+
+        joinbuffer = (char*)calloc(seg->decoded_bytes, 1);
+        ssize_t read_in_bytes = read(fd_join, joinbuffer, seg->decoded_bytes);
+        ssize_t wrote_out_bytes = pwrite(fd_complete_file, joinbuffer, seg->decoded_bytes, offset);
+        if (wrote_out_bytes > 0) {
+            curFile->joined_size += wrote_out_bytes;
+            if (offset + wrote_out_bytes > position)
+                position = offset + wrote_out_bytes;
+        }
         close(fd_join);
-        LOG_MESSAGE(false, "Segment %d (%s) for File %s written: %i of %i bytes.", curFile->segments[i].number, curFile->segments[i].articleID, curFile->yenc_filename, wrote_out_bytes, read_in_bytes);
+        LOG_MESSAGE(false, "Segment %d (%s) for File %s written: %i of %i bytes.", seg->number, nzb_segment_article(seg), curFile->yenc_filename, wrote_out_bytes, read_in_bytes);
         unlink(segmentFile);
         free(segmentFile);
         free(joinbuffer);
     }
 
-    curFile->state = NFState_Done;
-    // last file ?
-    if (nzb_tree.current_file == nzb_tree.max_files) {
-        mw_runLoop = false;
-        LOG_MESSAGE(false, "End of NZB-Queue reached, post-processing...");
+    // the missing tail:
+    if (curFile->file_size > position) {
+        mw_join_add_hole(curFile, position, curFile->file_size - position);
+        if (ftruncate(fd_complete_file, curFile->file_size) != 0)
+            LOG_MESSAGE(true, "(JOIN)Couldn't extend %s to %lu bytes, errno %i (%s)", release_file_name, curFile->file_size, errno, strerror(errno));
     }
+    close(fd_complete_file);
+    free (release_file_name);
+
+    for (unsigned int h = 0; h < curFile->holes_length; h++)
+        LOG_MESSAGE(false, "File %s: %lu bytes at %lu missing, zero-filled.", finalName, curFile->holes[h].length, curFile->holes[h].offset);
+
+    curFile->state = NFState_Done;
     return;
 }
 
+/// @brief adds a range to the holes of a file (the ones mw_join_segments had to zero-fill).
+/// @param curFile 
+/// @param offset 
+/// @param length 
+void mw_join_add_hole(struct NZBFile *curFile, uint64_t offset, uint64_t length) {
+    curFile->holes = (struct NZBRange*)realloc(curFile->holes, sizeof(struct NZBRange) * (curFile->holes_length + 1));
+    curFile->holes[curFile->holes_length].offset = offset;
+    curFile->holes[curFile->holes_length++].length = length;
+}
+
 /// @brief cleans up (the most) stuff
 /// @param  
 void mw_quit_and_clean(void) {
@@ -427,37 +643,52 @@ void mw_quit_and_clean(void) {
     if (mw_threads) free (mw_threads);
     if (nntp_connections) free (nntp_connections);
     if (mw_thread_infos) free (mw_thread_infos);
+    stats_free();
 }
 
-/// @brief prints the overview every n seconds.
+/// @brief prints the overview every n seconds, post-processes the download.
 /// @param  
-void mw_loop(void) {
+/// @return true if the release is complete (and unpacked).
+bool mw_loop(void) {
     extern struct NZB nzb_tree;
 
+    if (nzb_tree.missing_segments)
+        q_printf ("The nzb lacks %lu segments, they have to be repaired.\n", nzb_tree.missing_segments);
     q_printf ("Starting download...\n");
 
     while (mw_runLoop) {
         mw_print_overview();
+        unpack_stream_poll();
         usleep(100*1000);   // 10 updates per second ?
     }
 
     mw_print_overview();
 
+    if (nzb_tree.parse_failed) {
+        q_printf ("\nThe nzb couldn't be parsed completely, download failed.\n");
+        return false;
+    }
     if (mw_post_ok_operation) {
         q_printf ("\nDownload finished, assembling segments...\n");
-        mw_post_rename();
-    } else {
-        q_printf ("\nDownload failed.\n");
+        return mw_post_rename();
     }
+    q_printf ("\nDownload failed.\n");
+    return false;
 }
 
 /// @brief this what happens AFTER the network-downloads/decoding
 /// @param 
-void mw_post_rename(void) {
+/// @return false if verify/repair or the unpacking failed.
+bool mw_post_rename(void) {
     unsigned int filecnt;
     extern struct NZB nzb_tree;
     struct NZBFile *smallest_parfile = NULL;
-    bool check_repair_ok = true;
+    bool check_repair_ok = true, complete, sfv_verified = false;
+    unsigned int sfv_ok, sfv_bad, sfv_unknown;
+
+    // only a part of the nzb was downloaded:
+    if (nzb_tree.parse_failed)
+        return false;
 
     if (mw_force_rename == RENAME_GUESS) {
         /* here we are: the filename game
@@ -477,16 +708,28 @@ void mw_post_rename(void) {
             }
         }
 
-        if (smallest_parfile->segmentsSize > 1)
+        if (smallest_parfile && (smallest_parfile->segmentsSize > 1))
             smallest_parfile = NULL;    // the "main" segment shouldn't be larger than 1 message.
 
         LOG_MESSAGE(false, "Renaming: smallest_parfile %s found, checking par2 for file names.", smallest_parfile == NULL ? "not " : "was");    
         if (smallest_parfile) {
-            bool wasMainParFile;
+            bool wasMainParFile, all_identified = true;
             get_par2_filenames(smallest_parfile, &wasMainParFile);
             nzb_tree.rename_files_to = NZBRename_undefined;
 
+            // every file whose first 16k matched a FileDesc got it's name during the download already:
             for (filecnt = 0; filecnt < nzb_tree.max_files; filecnt++) {
+                struct NZBFile *curFile = &nzb_tree.files[filecnt];
+                mw_match_par2_name(curFile);
+                if (!curFile->par2_filename && !curFile->is_par_vol_file && (curFile != smallest_parfile) && nzb_file_in_download_pass(curFile))
+                    all_identified = false;
+            }
+            if (all_identified) {
+                LOG_MESSAGE(false, "Every file was identified by it's 16k-md5, no guessing needed.");
+                nzb_tree.rename_files_to = NZBRename_yEnc;
+            }
+
+            for (filecnt = 0; !all_identified && (filecnt < nzb_tree.max_files); filecnt++) {
                 struct NZBFile *curFile = &nzb_tree.files[filecnt];
                 if (is_par2_list(curFile->yenc_filename)) {
                     nzb_tree.rename_files_to = NZBRename_yEnc;
@@ -498,6 +741,8 @@ void mw_post_rename(void) {
                 }
             }
             LOG_MESSAGE(false, "Guessed valid filenames: %s\n", nzb_tree.rename_files_to == NZBRename_NZB ? "NZB-XML based" : "yEnc-Header based");
+            LOG_MESSAGE(false, "Name lookups: %lu (%lu exact, %lu substring), %lu windows hashed, %lu compares for %u par2 names.",
+                par_name_stats.lookups, par_name_stats.exact_hits, par_name_stats.substring_hits, par_name_stats.windows, par_name_stats.compares, par_filenames_length);
         } else {
             LOG_MESSAGE(false, "No Index par2 found!\n");
         }
@@ -506,7 +751,17 @@ void mw_post_rename(void) {
     else if (mw_force_rename == RENAME_FORCE_YENC)
         nzb_tree.rename_files_to = NZBRename_yEnc;
 
+    // the crc32s of the segments verify the files of a .sfv, w/o reading them back:
+    sfv_check_all();
+    if (sfv_summary(&sfv_ok, &sfv_bad, &sfv_unknown)) {
+        q_printf("\nSFV: %u files ok, %u damaged, %u not checked.\n", sfv_ok, sfv_bad, sfv_unknown);
+        sfv_verified = sfv_release_ok();
+    }
+
     for (filecnt = 0; filecnt < nzb_tree.max_files; filecnt++) {
+        // the volumes of the streaming unpack are joined already:
+        if (nzb_tree.files[filecnt].state == NFState_Done)
+            continue;
         switch (mw_download_type) {
             case NZBDownload_Content:
                 if (!nzb_tree.files[filecnt].is_par_vol_file)
@@ -517,148 +772,194 @@ void mw_post_rename(void) {
                 break;
         }
     }
-
-
-    // we can only do a integrity check if there's a parfile:
-    if (smallest_parfile) {
+    if (unpack_stream_finish())
+        q_printf("Unpacked while downloading.\n");
+    rarstore_finish();
+
+
+    // we can only do a integrity check if there's a parfile (or a .sfv):
+    if (smallest_parfile && sfv_verified) {
+        LOG_MESSAGE(false, "Every file was verified by the SFV, skipping par2.");
+    } else if (smallest_parfile) {
+        if (damagemap_build(&mw_damage_map)) {
+            q_printf("\nPAR2: %u of %u slices damaged, %u recovery blocks needed.\n", mw_damage_map.damaged_slices, mw_damage_map.total_slices, mw_damage_map.recovery_blocks_needed);
+            LOG_MESSAGE(false, "Damage map: %u of %u slices damaged (%u files), %u recovery blocks needed.", 
+                mw_damage_map.damaged_slices, mw_damage_map.total_slices, mw_damage_map.files_length, mw_damage_map.recovery_blocks_needed);
+        }
         LOG_MESSAGE(false, "Verifying release with par2.");
         check_repair_ok = mw_post_checkrepair( nzb_tree.rename_files_to == NZBRename_yEnc ? smallest_parfile->yenc_filename : smallest_parfile->filename );
+    } else if (sfv_bad) {
+        q_printf("SFV reported damaged files and there's no par2 to repair them.\n");
+        check_repair_ok = false;
     }
 
-    if (pair_find(config_downloads, "unrarbin") && check_repair_ok) {
-        q_printf("Verify/Repair went successful, unpacking.\n");
-        mw_unrar();
+    // w/o par2 nothing could repair a failed segment:
+    complete = check_repair_ok && (smallest_parfile || !stats_sum(Stats_FailedSegments));
+
+    // the volumes of the (verified) sets unpacked while downloading were needed for verify only:
+    rarstore_remove_volumes();
+
+    // a damaged par2 set keeps only it's own files packed:
+    if (pair_find(config_downloads, "unrarbin") && (check_repair_ok || mw_par2_runs_length)) {
+        if (check_repair_ok)
+            q_printf("Verify/Repair went successful, unpacking.\n");
+        else
+            q_printf("Verify/Repair failed for some par2 sets, unpacking the others.\n");
+        complete = mw_unrar() && complete;
     }
+
+    // only a failed release is resumed, it keeps the cache:
+    if (complete)
+        nzb_cache_remove();
+    return complete;
 }
 
-/// @brief 
-/// @param firstrarvol 
-/// @return 
-unsigned int mw_get_rar_volumes(char *firstrarvol, char ***rar_volumes) {
+/// @brief how many unrar may run at once: unrarjobs="N", 0 (the default) = one if the download directory
+///        is on a rotational disk (they'd just seek against each other), one per cpu else.
+/// @param sets the number of sets to unpack
+/// @return 1..sets
+unsigned int mw_unrar_max_jobs(unsigned int sets) {
     extern struct NZB nzb_tree;
-    const PCRE2_SPTR archRE = (PCRE2_SPTR)"Archive: (.+)";
-    FILE *cmdOut = NULL;
-    pcre2_code *compRE;
-    pcre2_match_data *matchData;
-    int pcre_err;
-    PCRE2_SIZE startOffset = 0, errOffset;
-    char *inBuffer = NULL;
-    char temp[128];
-    size_t inBuffer_size = 0, read_size;
-    char **rv = NULL;
-    unsigned int rv_cnt = 0;
-    char *syscmd;
-    char *rarPassWd = mw_rar_password_provided();
+    unsigned int jobs = 0;
+    struct stat dest_stat;
+
+    if (pair_find(config_downloads, "unrarjobs"))
+        jobs = atoi(pair_find(config_downloads, "unrarjobs"));
+
+    if (!jobs) {
+        jobs = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? (unsigned int)sysconf(_SC_NPROCESSORS_ONLN) : 1;
+        if (stat(nzb_tree.download_destination, &dest_stat) == 0) {
+            // a partition's queue is the one of it's disk:
+            char *rotational = mprintfv("/sys/dev/block/%u:%u/queue/rotational", major(dest_stat.st_dev), minor(dest_stat.st_dev));
+            char *disk_rotational = mprintfv("/sys/dev/block/%u:%u/../queue/rotational", major(dest_stat.st_dev), minor(dest_stat.st_dev));
+            FILE *in = fopen(rotational, "r");
+
+            if (!in)
+                in = fopen(disk_rotational, "r");
+            if (in) {
+                if (fgetc(in) == '1')
+                    jobs = 1;
+                fclose(in);
+            }
+            free (rotational);
+            free (disk_rotational);
+        }
+    }
+    return jobs > sets ? (sets ? sets : 1) : jobs;
+}
 
-    // password-check:
-    if (rarPassWd) {
-        syscmd = mprintfv("%s ltb -p%s -v \"%s/%s\"", pair_find(config_downloads, "unrarbin"), rarPassWd, nzb_tree.download_destination, firstrarvol);
-    } else {
-        syscmd = mprintfv("%s ltb -v \"%s/%s\"", pair_find(config_downloads, "unrarbin"), nzb_tree.download_destination, firstrarvol);
-    }
-
-    cmdOut = popen(syscmd, "r");
-    if (!cmdOut)
-        return 0;
-       
-    while ((read_size = fread(temp, 1, 128, cmdOut)) > 0) {
-        inBuffer = (char*)realloc(inBuffer, inBuffer_size+read_size+1);
-        memset(&inBuffer[inBuffer_size], 0, read_size+1);
-        memcpy(&inBuffer[inBuffer_size], temp, read_size);
-        inBuffer_size += read_size;
-    }
-    pclose(cmdOut);
-
-    compRE = pcre2_compile(archRE, PCRE2_ZERO_TERMINATED, 0, &pcre_err, &errOffset, NULL);
-    matchData = pcre2_match_data_create_from_pattern(compRE, NULL);
-    startOffset = 0;
-    while (pcre2_match(compRE, (const unsigned char*)inBuffer, inBuffer_size, startOffset, 0, matchData, NULL) >= 0) {
-        PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(matchData);
-        rv = (char**)realloc(rv, sizeof(char*)*(rv_cnt+1));
-        rv[rv_cnt] = strndup(&inBuffer[ovector[2]], (int)ovector[3]-ovector[2]);
-        rv_cnt++;
-        startOffset = ovector[1];
-    }
-    *rar_volumes = rv;
-    return rv_cnt;
+/// @brief runs the unrar commands of the jobs, at most max_running at once, every job's exit code
+///        ends up in it's rc.
+/// @param jobs
+/// @param jobs_length
+/// @param max_running
+void mw_unrar_run(struct mw_unrar_job *jobs, unsigned int jobs_length, unsigned int max_running) {
+    extern char **environ;
+    unsigned int next = 0, running = 0;
+
+    for (;;) {
+        int status;
+        pid_t pid;
+
+        while ((running < max_running) && (next < jobs_length)) {
+            struct mw_unrar_job *job = &jobs[next++];
+            char *argv[] = { "/bin/sh", "-c", job->syscmd, NULL };
+            int err;
+
+            if (!job->syscmd)
+                continue;
+            err = posix_spawn(&job->pid, "/bin/sh", NULL, NULL, argv, environ);
+            if (err != 0) {
+                LOG_MESSAGE(true, "Couldn't start %s, errno %i (%s)", job->syscmd, err, strerror(err));
+                job->pid = 0;
+                job->rc = -1;
+                continue;
+            }
+            running++;
+        }
+        if (!running)
+            break;
+
+        pid = waitpid(-1, &status, 0);
+        if (pid == -1) {
+            if (errno == EINTR)
+                continue;
+            LOG_MESSAGE(true, "waitpid failed, errno %i (%s)", errno, strerror(errno));
+            break;
+        }
+        for (unsigned int i = 0; i < next; i++) {
+            if (jobs[i].pid != pid)
+                continue;
+            jobs[i].pid = 0;
+            jobs[i].rc = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+            running--;
+        }
+    }
 }
 
-/// @brief 
+/// @brief unpacks every RAR set in the download directory (rarstore_scan), independent sets in parallel
+///        (mw_unrar_max_jobs), and removes the volumes of the ones that were unpacked.
 /// @param  
-void mw_unrar(void) {
+/// @return false if an archive couldn't be unpacked.
+bool mw_unrar(void) {
     extern struct NZB nzb_tree;
     DIR*    dirList = NULL;
     struct dirent   *file_in_dest_dir;
-    const PCRE2_SPTR partRE = (PCRE2_SPTR8)"part([0-9]+)";
-    pcre2_code *compRE;
-    pcre2_match_data *matchData;
-    int pcre_err;
-    PCRE2_SIZE errOffset;
+    struct rarstore_scan_set *sets = NULL;
+    struct mw_unrar_job *jobs;
+    unsigned int sets_length, max_jobs;
     char **rar_volumes = NULL;
     unsigned int rar_volumes_len = 0;
-    bool unpack_ok = true;
+    bool unpack_ok = true, keep_par2 = false;
+    char *rarPassWd = mw_rar_password_provided();
 
-    dirList = opendir(nzb_tree.download_destination);
-    if (!dirList) {
-        LOG_MESSAGE(false, "Couldn't opendir(%s), errno: %i, %s", nzb_tree.download_destination, errno, strerror(errno));
-        return;
-    }    
+    sets_length = rarstore_scan(nzb_tree.download_destination, &sets);
+    jobs = (struct mw_unrar_job*)calloc(sets_length ? sets_length : 1, sizeof(struct mw_unrar_job));
+    for (unsigned int s = 0; s < sets_length; s++) {
+        char *first_volume = sets[s].volumes[0];
+        bool verified = true;
+
+        for (unsigned int v = 0; v < sets[s].volumes_length; v++)
+            verified = verified && mw_par2_verified(sets[s].volumes[v]);
+
+        jobs[s].rc = -1;
+        if (!verified) {
+            LOG_MESSAGE(true, "%s/%s: par2 verify/repair failed, not unpacking.", nzb_tree.download_destination, first_volume);
+        } else if (unpack_stream_unpacked(first_volume)) {
+            // just the volumes to delete:
+            LOG_MESSAGE(false, "%s/%s was unpacked while downloading.", nzb_tree.download_destination, first_volume);
+            jobs[s].rc = 0;
+        } else if (!sets[s].complete) {
+            LOG_MESSAGE(true, "%s/%s: volumes are missing, not unpacking.", nzb_tree.download_destination, first_volume);
+        } else if (rarPassWd) {
+            // password-check:
+            jobs[s].syscmd = mprintfv("%s x -idq -o+ -p%s \"%s/%s\" \"%s\"", pair_find(config_downloads, "unrarbin"), rarPassWd, nzb_tree.download_destination, first_volume, nzb_tree.download_destination);
+        } else {
+            jobs[s].syscmd = mprintfv("%s x -idq -o+ \"%s/%s\" \"%s\"", pair_find(config_downloads, "unrarbin"), nzb_tree.download_destination, first_volume, nzb_tree.download_destination);
+        }
+    }
 
-    compRE = pcre2_compile(partRE, PCRE2_ZERO_TERMINATED, 0, &pcre_err, &errOffset, NULL);
-    matchData = pcre2_match_data_create_from_pattern(compRE, NULL);
+    max_jobs = mw_unrar_max_jobs(sets_length);
+    LOG_MESSAGE(false, "Unpacking %u RAR sets, %u at once.", sets_length, max_jobs);
+    mw_unrar_run(jobs, sets_length, max_jobs);
 
-    while ((file_in_dest_dir = readdir(dirList)) != NULL) {
-        if (file_in_dest_dir->d_type != DT_REG)
-            continue;
-        if (string_ends_width(file_in_dest_dir->d_name, ".rar")) {
-            // if there's a part[..] it's a multipart and we only have to work on part01
-            if (pcre2_match(compRE, (const unsigned char*)file_in_dest_dir->d_name, PCRE2_ZERO_TERMINATED, 0, 0, matchData, NULL) >= 0) {
-                PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(matchData);
-                char* numStr = strndup(&file_in_dest_dir->d_name[ovector[2]], ovector[3]-ovector[2]);
-                unsigned int partNum = atoi(numStr);
-                if (partNum == 1) {
-                    char *syscmd;
-                    char *rarPassWd = mw_rar_password_provided();
-
-                    // password-check:
-                    if (rarPassWd) {
-                        syscmd = mprintfv("%s x -idq -o+ -p%s \"%s/%s\" \"%s\"", pair_find(config_downloads, "unrarbin"), rarPassWd, nzb_tree.download_destination, file_in_dest_dir->d_name, nzb_tree.download_destination);
-                    } else {
-                        syscmd = mprintfv("%s x -idq -o+ \"%s/%s\" \"%s\"", pair_find(config_downloads, "unrarbin"), nzb_tree.download_destination, file_in_dest_dir->d_name, nzb_tree.download_destination);
-                    }
-
-                    char **tmp_volumes = NULL;
-                    int syscmd_rc;
-                    unsigned int tmp_volume_size;
-
-                    tmp_volume_size = mw_get_rar_volumes(file_in_dest_dir->d_name, &tmp_volumes); // keep the rar volume-names in mem.
-                    syscmd_rc = system(syscmd);
-                    if (WIFEXITED(syscmd_rc))
-                        syscmd_rc = WEXITSTATUS(syscmd_rc);
-                    if (syscmd_rc != 0) {
-                        LOG_MESSAGE(true, "%s returned %i", syscmd, syscmd_rc);
-                        unpack_ok = false;
-                        if (tmp_volumes && (tmp_volume_size > 0)) {
-                            for (unsigned int c = 0; c < tmp_volume_size; c++)
-                                free (tmp_volumes[c]);
-                        }
-                        free (tmp_volumes);
-                    } else {
-                        LOG_MESSAGE(false, "unrared %s/%s, continuing.", nzb_tree.download_destination, file_in_dest_dir->d_name);
-                        // copy the volumes of the rar, to delete it later.
-                        if (tmp_volumes && (tmp_volume_size > 0)) {
-                            rar_volumes = (char**)realloc(rar_volumes, sizeof(char*)*(rar_volumes_len+tmp_volume_size));
-                            memcpy(&rar_volumes[rar_volumes_len], tmp_volumes, sizeof(char*)*tmp_volume_size);
-                            rar_volumes_len += tmp_volume_size;
-                        }
-                    }
-                    free (syscmd);
-                }
-            }
+    for (unsigned int s = 0; s < sets_length; s++) {
+        if (jobs[s].rc != 0) {
+            if (jobs[s].syscmd)
+                LOG_MESSAGE(true, "%s returned %i", jobs[s].syscmd, jobs[s].rc);
+            unpack_ok = false;
+        } else {
+            if (jobs[s].syscmd)
+                LOG_MESSAGE(false, "unrared %s/%s, continuing.", nzb_tree.download_destination, sets[s].volumes[0]);
+            // keep the rar volume-names, to delete them later.
+            rar_volumes = (char**)realloc(rar_volumes, sizeof(char*)*(rar_volumes_len+sets[s].volumes_length));
+            for (unsigned int v = 0; v < sets[s].volumes_length; v++)
+                rar_volumes[rar_volumes_len++] = mprintfv("%s/%s", nzb_tree.download_destination, sets[s].volumes[v]);
         }
+        free (jobs[s].syscmd);
     }
-
-    closedir(dirList);
+    free (jobs);
+    rarstore_scan_free(sets, sets_length);
 
     if (unpack_ok && mw_remove_nzb_after_unpack)
         unlink(nzb_tree.name);
@@ -672,7 +973,11 @@ void mw_unrar(void) {
         free (rar_volumes[c]);
     }
 
-    dirList = opendir(nzb_tree.download_destination);
+    // a set that's still damaged needs it's par2 files for another try:
+    for (unsigned int r = 0; r < mw_par2_runs_length; r++)
+        keep_par2 = keep_par2 || !mw_par2_runs[r].verified;
+
+    dirList = keep_par2 ? NULL : opendir(nzb_tree.download_destination);
     if (dirList) {
         while ((file_in_dest_dir = readdir(dirList)) != NULL) {
             if ((file_in_dest_dir->d_type == DT_REG) && (string_ends_width(file_in_dest_dir->d_name, ".par2"))) {
@@ -690,25 +995,142 @@ void mw_unrar(void) {
     // last, but not least
 
     free (rar_volumes);
+    return unpack_ok;
 }
 
-/// @brief runs validate/repair for releases w. par2 files
-/// @param parfile 
-/// @return 
+/// @brief runs validate/repair for releases w. par2 files, every recovery set on it's own (and
+///        up to par2jobs="N" of them at once, 0 = one per cpu).
+/// @param parfile for par2bin
+/// @return true if every set is ok (or was repaired), mw_par2_verified() tells which ones are.
 bool mw_post_checkrepair(char *parfile) {
+    extern struct NZB nzb_tree;
+    extern struct pair *config_downloads;
+    extern struct par2_index par_index;
+    unsigned int par2threads = 0, jobs = 0, cpus;
+    bool all_verified = true;
+    struct par2_set *parfile_set;
+    char *parfile_path;
+
+    cpus = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? (unsigned int)sysconf(_SC_NPROCESSORS_ONLN) : 1;
+
+    // the in-process verify/repair first, par2bin is the fallback:
+    par2_index_directory(nzb_tree.download_destination);
+    free (mw_par2_runs);
+    mw_par2_runs = (struct par2_repair_run*)calloc(par_index.sets_length ? par_index.sets_length : 1, sizeof(struct par2_repair_run));
+    mw_par2_runs_length = 0;
+    for (unsigned int i = 0; i < par_index.sets_length; i++) {
+        if (!par_index.sets[i].slice_size)
+            continue;   // only recovery blocks, no Main packet.
+        memcpy(mw_par2_runs[mw_par2_runs_length].set_id, par_index.sets[i].set_id, 16);
+        mw_par2_runs[mw_par2_runs_length].active = true;
+        mw_par2_runs[mw_par2_runs_length++].rc = PAR2Repair_Error;
+    }
+
+    if (!mw_par2_runs_length) {
+        if (!pair_find(config_downloads, "par2bin"))
+            return true;    // true bc. try to unrar, if we couldn't check anything.
+        return mw_post_checkrepair_par2bin(parfile);
+    }
+
+    if (pair_find(config_downloads, "par2jobs"))
+        jobs = atoi(pair_find(config_downloads, "par2jobs"));
+    if (!jobs)
+        jobs = cpus;
+    if (jobs > mw_par2_runs_length)
+        jobs = mw_par2_runs_length;
+    if (pair_find(config_downloads, "par2threads"))
+        par2threads = atoi(pair_find(config_downloads, "par2threads"));
+    if (!par2threads)
+        par2threads = cpus / jobs ? cpus / jobs : 1;     // the sets share the cpus.
+
+    LOG_MESSAGE(false, "Verifying %u par2 sets, %u at once w. %u threads each.", mw_par2_runs_length, jobs, par2threads);
+    par2_repair_sets(nzb_tree.download_destination, mw_par2_runs, mw_par2_runs_length, false, jobs, par2threads);
+
+    // fetch only the vol-files we need (every set from its own ones), again if some of them turn out to be damaged:
+    while (mw_download_type != NZBDownload_Everything) {
+        uint32_t missing_blocks = 0, selected_blocks = 0;
+
+        for (unsigned int r = 0; r < mw_par2_runs_length; r++) {
+            struct par2_repair_run *run = &mw_par2_runs[r];
+            uint32_t set_missing;
+
+            run->active = run->rc == PAR2Repair_NotEnough;
+            if (!run->active)
+                continue;
+            set_missing = run->result.damaged_slices - run->result.recovery_blocks;
+            missing_blocks += set_missing;
+            selected_blocks += mw_select_recovery_volumes(par2_find_set(run->set_id, false), set_missing);
+        }
+        if (!missing_blocks)
+            break;
+
+        q_printf("Content incomplete, fetching %u additional recovery blocks.\n", missing_blocks);
+        if (!mw_fetch_selected_volumes(selected_blocks, missing_blocks))    // this blocks!
+            break;
+        par2_index_directory(nzb_tree.download_destination);
+        par2_repair_sets(nzb_tree.download_destination, mw_par2_runs, mw_par2_runs_length, false, jobs, par2threads);
+    }
+
+    for (unsigned int r = 0; r < mw_par2_runs_length; r++) {
+        struct par2_repair_run *run = &mw_par2_runs[r];
+
+        run->active = (run->rc == PAR2Repair_Repairable) || (run->rc == PAR2Repair_NotEnough);
+        if (run->active)
+            q_printf("\nDownload finished, par2 verify found %u of %u slices damaged, starting repair.\n", run->result.damaged_slices, run->result.total_slices);
+        else if (run->rc == PAR2Repair_Ok)
+            q_printf("\nDownload finished, par2 verify finished without any error found to repair.\n");
+    }
+    par2_repair_sets(nzb_tree.download_destination, mw_par2_runs, mw_par2_runs_length, true, jobs, par2threads);
+
+    for (unsigned int r = 0; r < mw_par2_runs_length; r++) {
+        struct par2_repair_run *run = &mw_par2_runs[r];
+
+        if (run->active && (run->rc == PAR2Repair_Repaired))
+            q_printf("Repaired %u slices.\n", run->result.damaged_slices);
+        else if (run->active)
+            LOG_MESSAGE(false, "native par2 repair failed (%i), %u slices damaged, %u recovery blocks.", run->rc, run->result.damaged_slices, run->result.recovery_blocks);
+        run->active = false;
+        run->verified = (run->rc == PAR2Repair_Ok) || (run->rc == PAR2Repair_Repaired) ||
+            ((run->rc == PAR2Repair_Error) && !pair_find(config_downloads, "par2bin"));   // try to unrar, if we couldn't check anything.
+        all_verified = all_verified && run->verified;
+    }
+
+    // if par2bin is not filled.. 
+    if (all_verified || !pair_find(config_downloads, "par2bin"))
+        return all_verified;
+
+    // par2bin has the last word for the set of parfile, the others stay as they are:
+    if (!mw_post_checkrepair_par2bin(parfile))
+        return false;
+    parfile_path = mprintfv("%s/%s", nzb_tree.download_destination, parfile);
+    parfile_set = par2_set_of_file(parfile_path);
+    free (parfile_path);
+    all_verified = true;
+    for (unsigned int r = 0; r < mw_par2_runs_length; r++) {
+        if (parfile_set && (memcmp(mw_par2_runs[r].set_id, parfile_set->set_id, 16) == 0))
+            mw_par2_runs[r].verified = true;
+        all_verified = all_verified && mw_par2_runs[r].verified;
+    }
+    return all_verified;
+}
+
+/// @brief verify/repair w. the external par2bin
+/// @param parfile 
+/// @return true if the files are ok or were repaired
+bool mw_post_checkrepair_par2bin(char *parfile) {
     extern struct NZB nzb_tree;
     extern struct pair *config_downloads;
     char *syscheckcmd = NULL;
     char oldcwd[PATH_MAX];
     int sysRc = 0;
     uint8_t par2Rc;
+    bool rv = false;
 
-    // if par2bin is not filled.. 
-    if (!pair_find(config_downloads, "par2bin"))
-        return true;    // true bc. try to unrar
-
-    getcwd(oldcwd, PATH_MAX);
-    //seems we have to chdir() into the directory where the par2 files are:
+    if (!getcwd(oldcwd, PATH_MAX)) {
+        LOG_MESSAGE(true, "Could not get the current directory, errno %i, %s", errno, strerror(errno));
+        return false;
+    }
+    //seems we have to chdir() into the directory where the par2 files are (back before returning):
     if (chdir(nzb_tree.download_destination) != 0) {
         LOG_MESSAGE(true, "Could not change to: %s!", nzb_tree.download_destination);
         return false;
@@ -734,32 +1156,57 @@ bool mw_post_checkrepair(char *parfile) {
         par2Rc = WEXITSTATUS(sysRc);
     else  {
         LOG_MESSAGE(true, "par2 had some error => !WIFEXITED\n");
-        return false;
+        goto done;
     }
 
     if (par2Rc == 0) {
         q_printf("\nDownload finished, par2 verify finished without any error found to repair.\n");
-        return true;
+        rv = true;
     } else if ((par2Rc == 1) || (par2Rc == 2)) {
         q_printf("\nDownload finished, but par2verify reported repairable errors, starting repair.\n");
 
         if (mw_download_type == NZBDownload_Content) {
-            mw_download_type = NZBDownload_Recovery;
             q_printf("Content incomplete, fetching additional recovery volumes.\n");
-            mw_fetch_recovery_volumes();    // this blocks!
+            // w/o the native verify, the damage map is the best guess we have:
+            mw_fetch_recovery_volumes(mw_damage_map.valid ? mw_damage_map.recovery_blocks_needed : UINT32_MAX);    // this blocks!
         }
 
         // if mw_fetch_recovery_volumes fails, still try to fix the content.
         syscheckcmd = mprintfv("%s r \"%s/%s\" 2>&1 > /dev/null", pair_find(config_downloads, "par2bin"), nzb_tree.download_destination, parfile);
         sysRc = system(syscheckcmd);
         free (syscheckcmd);
-        if (WEXITSTATUS(sysRc) != 0) {
+        if (WEXITSTATUS(sysRc) != 0)
             LOG_MESSAGE(false, "par2repair reported error.");
-            return false;
-        }
-        return true;
+        else
+            rv = true;
     }
-    return false;
+
+done:
+    if (chdir(oldcwd) != 0)
+        LOG_MESSAGE(true, "Could not change back to: %s!", oldcwd);
+    return rv;
+}
+
+/// @brief if the par2 set a file belongs to was verified (or repaired).
+/// @param name the final name of the file
+/// @return true if it was, or if no par2 set knows the file
+bool mw_par2_verified(const char *name) {
+    for (unsigned int r = 0; r < mw_par2_runs_length; r++) {
+        if (par2_find_fileinfo_by_name(par2_find_set(mw_par2_runs[r].set_id, false), name))
+            return mw_par2_runs[r].verified;
+    }
+    return true;
+}
+
+/// @brief how the par2 run of the set a file belongs to ended.
+/// @param name the final name of the file
+/// @return one of PAR2Repair_Result, -1 if no par2 set knows the file
+int mw_par2_rc(const char *name) {
+    for (unsigned int r = 0; r < mw_par2_runs_length; r++) {
+        if (par2_find_fileinfo_by_name(par2_find_set(mw_par2_runs[r].set_id, false), name))
+            return mw_par2_runs[r].rc;
+    }
+    return -1;
 }
 
 /// @brief 
@@ -785,20 +1232,21 @@ void mw_print_overview(void) {
     char *overview_text, *sizeString, *dlString, *speedString;
     double pct_done = 0., pct_failed = 0.;
     unsigned int curLineLen;
+    uint64_t release_downloaded = stats_sum(Stats_ReleaseDownloaded);
 
     if (nzb_tree.release_size > 0) {
-        pct_done = (double)nzb_tree.release_downloaded / (double)nzb_tree.release_size;
+        pct_done = (double)release_downloaded / (double)nzb_tree.release_size;
         pct_done *= 100.;
     }
 
-    if (mw_expected_segments > 0) {
-        pct_failed = (double)(mw_expected_segments-mw_failed_segments)/(double)mw_expected_segments;
+    if (nzb_tree.schedule_length > 0) {
+        pct_failed = (double)(nzb_tree.schedule_length-stats_sum(Stats_FailedSegments))/(double)nzb_tree.schedule_length;
         pct_failed *= 100.;
     }
 
     sizeString = strdup(mw_val_to_hr_string(nzb_tree.release_size));
-    dlString = strdup(mw_val_to_hr_string(nzb_tree.release_downloaded));
-    speedString = strdup(mw_val_to_hr_string(nzb_tree.release_downloaded / secondspassed));
+    dlString = strdup(mw_val_to_hr_string(release_downloaded));
+    speedString = strdup(mw_val_to_hr_string(release_downloaded / secondspassed));
 
     overview_text = mprintfv("NZB:%s, Size:%s, Downloaded: %s (%.2f%%) (%.2f%%), Speed:%s/s", 
                     nzb_tree.display_name, sizeString, dlString, pct_done, pct_failed, speedString);  
@@ -848,28 +1296,122 @@ char* mw_rar_password_provided(void) {
     return NULL;
 }
 
-/// @brief if only non-rec.vol were downloaded AND there are some rec-vols left, get them now.
-/// @param  -
+/// @brief looks at the headers in the first segment of a file: an encrypted RAR (headers or files) or zip
+///        can't be unpacked w/o a password, the download is stopped then (unless abortencrypted="false").
+/// @param curFile
+/// @param data the decoded first segment
+/// @param length
+void mw_check_encryption(struct NZBFile *curFile, const uint8_t *data, size_t length) {
+    struct rarstore_entry entry;
+    bool encrypted = false;
+    char *name = curFile->yenc_filename ? curFile->yenc_filename : curFile->filename;
+    const char *abort_encrypted = pair_find(config_downloads, "abortencrypted");
+
+    if ((length >= 8) && (memcmp(data, "PK\x07\x08", 4) == 0)) {
+        // a split zip starts w. the spanning marker:
+        data += 4;
+        length -= 4;
+    }
+    if ((length >= 30) && (memcmp(data, "PK\x03\x04", 4) == 0)) {
+        encrypted = data[6] & 0x01;     // general purpose flags of the first local file header
+    } else {
+        int rc = rarstore_parse_volume(data, length, &entry);
+
+        if (rc == RarStoreBlock_File)
+            free (entry.name);
+        encrypted = rc == RarStoreBlock_Encrypted;
+    }
+    // every worker can find one, the first one reports it:
+    if (!encrypted || atomic_exchange(&mw_encrypted_found, true))
+        return;
+
+    if (mw_rar_password_provided()) {
+        LOG_MESSAGE(false, "%s is encrypted, a password was provided.", name);
+        return;
+    }
+    if (abort_encrypted && (strcasecmp(abort_encrypted, "false") == 0)) {
+        q_printf("\n%s is encrypted and no password is known, it won't unpack.\n", name);
+        LOG_MESSAGE(false, "%s is encrypted and no password is known, continuing (abortencrypted=\"false\").", name);
+        return;
+    }
+    q_printf("\n%s is encrypted and no password is known, stopping the download.\n", name);
+    LOG_MESSAGE(false, "%s is encrypted and no password is known, stopping the download.", name);
+    mw_post_ok_operation = false;   // nothing to assemble
+    mw_quit_download = true;
+}
+
+/// @brief if only non-rec.vol were downloaded AND there are some rec-vols left, get the ones we need now.
+/// @param blocks_needed the number of missing recovery blocks, UINT32_MAX = every vol-file.
+/// @return true if something was fetched from the server, false in every other case
+bool mw_fetch_recovery_volumes(uint32_t blocks_needed) {
+    extern struct NZB nzb_tree;
+    uint32_t selected_blocks = 0;
+
+    if (blocks_needed == UINT32_MAX) {
+        for (unsigned int fileCnt = 0; fileCnt < nzb_tree.max_files; fileCnt++) {
+            struct NZBFile *curFile = &nzb_tree.files[fileCnt];
+            if (curFile->is_par_vol_file && (curFile->state != NFState_Done) && !curFile->recovery_wanted) {
+                curFile->recovery_wanted = true;
+                selected_blocks += curFile->par_vol_blocks;
+            }
+        }
+    } else
+        selected_blocks = mw_select_recovery_volumes(NULL, blocks_needed);
+
+    return mw_fetch_selected_volumes(selected_blocks, blocks_needed);
+}
+
+/// @brief marks the vol-files of a set (by their name base) to fetch for blocks_needed recovery blocks,
+///        plus volmarginpct="N" percent (default 10).
+/// @param set NULL = the vol-files of any set
+/// @param blocks_needed 
+/// @return the number of blocks selected
+uint32_t mw_select_recovery_volumes(struct par2_set *set, uint32_t blocks_needed) {
+    unsigned int margin_pct = 10;
+    const char *base = NULL;
+    size_t base_length = 0;
+
+    if (pair_find(config_downloads, "volmarginpct"))
+        margin_pct = atoi(pair_find(config_downloads, "volmarginpct"));
+    if (set && !(base_length = par2_set_name_base(set, &base)))
+        base = NULL;
+    return par2_select_recovery_volumes(blocks_needed, margin_pct, base, base_length);
+}
+
+/// @brief fetches the vol-files marked recovery_wanted (and not there yet) and joins them.
+/// @param selected_blocks the blocks they hold, for the log
+/// @param blocks_needed 
 /// @return true if something was fetched from the server, false in every other case
-bool mw_fetch_recovery_volumes(void) {
+bool mw_fetch_selected_volumes(uint32_t selected_blocks, uint32_t blocks_needed) {
     extern struct NZB nzb_tree;
     unsigned int max_recovery_segments = 0;
     unsigned int start_threads;
 
     // fetch recovery files only
     mw_download_type = NZBDownload_Recovery;
-    nzb_tree.current_file = 0;  // "reset" the tree counter
+    nzb_schedule_rewind();  // "reset" the tree counter
     mw_runLoop = true;  // just like in the other loop.
 
     for (unsigned int fileCnt = 0; fileCnt < nzb_tree.max_files; fileCnt++) {
         struct NZBFile *curFile = &nzb_tree.files[fileCnt];
-        if (!curFile->is_par_vol_file)
+        if (!curFile->is_par_vol_file || !curFile->recovery_wanted || (curFile->state == NFState_Done))
             continue;
         max_recovery_segments += curFile->segmentsSize;
     }
 
+    if (!max_recovery_segments) {
+        LOG_MESSAGE(false, "No recovery volumes left to fetch.");
+        return false;
+    }
+
+    LOG_MESSAGE(false, "Fetching %u recovery blocks (%u needed) in %u segments.", selected_blocks, blocks_needed, max_recovery_segments);
+
     start_threads = max_recovery_segments < mw_max_threads ? max_recovery_segments : mw_max_threads;
 
+    // the threads of the last pass are done, the new ones aren't:
+    for (unsigned int i = 0; i < start_threads; i++)
+        nntp_connections[i].work_done = false;
+
     for (unsigned int i = 0; i < start_threads; i++) {
         if (pthread_create(&mw_threads[i], NULL, mw_thread_work, (void*)&mw_thread_infos[i]) != 0) {
             LOG_MESSAGE(false, "Couldn't pthread_create(..) in mw_fetch_recovery, download may be incomplete.");
@@ -887,9 +1429,10 @@ bool mw_fetch_recovery_volumes(void) {
 
     // we have everything, iterate again and assemble VOL files:
     for (unsigned int fileCnt = 0; fileCnt < nzb_tree.max_files; fileCnt++) {
-        if (nzb_tree.files[fileCnt].is_par_vol_file)
-            mw_join_segments(&nzb_tree.files[fileCnt]);
+        struct NZBFile *curFile = &nzb_tree.files[fileCnt];
+        if (curFile->is_par_vol_file && curFile->recovery_wanted && (curFile->state != NFState_Done))
+            mw_join_segments(curFile);
     }
 
     return true;
-}
\ No newline at end of file
+}
@@ -15,14 +15,31 @@
 #include <dirent.h>
 
 #include "parfiles.h"
+#include "prefetch.h"
+#include "damagemap.h"
+#include "par2repair.h"
 #include "nntp.h"
+#include "nzbcache.h"
+#include "unpack.h"
+#include "rarstore.h"
+#include "sfv.h"
+#include "stats.h"
 #include "xmlhandler.h"
 
 struct thread_user_data {
     char *filename, *dbg_article;
     uint64_t *filesize;
-    uint64_t *downloaded;
+    atomic_uint_fast64_t *downloaded;
     struct nntp_server *connection;
+    unsigned int stats_slot;            // the worker's slot in the statistics
+    bool in_tail;                       // done w. the nzb, prefetching the next one (see mw_prefetch_tail)
+};
+
+// one RAR set for mw_unrar:
+struct mw_unrar_job {
+    char        *syscmd;        // NULL = nothing to run (unpacked while downloading, incomplete)
+    pid_t       pid;            // 0 = not running
+    int         rc;             // unrar's exit code, -1 = didn't run/killed
 };
 
 enum {
@@ -38,20 +55,33 @@ extern bool mw_volpar_after_incomplete;
 extern int  mw_force_rename;
 
 bool mw_connect(char *address, uint16_t port, char *username, char *password, bool useSSL, unsigned int threads);
-void mw_loop(void);
+bool mw_loop(void);
+void mw_disconnect(void);
+void mw_unload_nzb(void);
 void mw_quit_and_clean(void);
 bool mw_prepare_directories(void);
 void mw_join_segments(struct NZBFile *curFile);
+void mw_join_add_hole(struct NZBFile *curFile, uint64_t offset, uint64_t length);
+char *mw_final_filename(struct NZBFile *curFile);
 void mw_logMessage(char* file, int line, char *fmt, ...);
 void mw_SIGUSR(int sig);
 void mw_print_overview(void);
 char* mw_val_to_hr_string(uint64_t valIn);
-void mw_post_rename(void);
+bool mw_post_rename(void);
 bool mw_post_checkrepair(char *parfile);
-void mw_unrar(void);
-unsigned int mw_get_rar_volumes(char *firstrarvol, char ***rar_volumes);
+bool mw_post_checkrepair_par2bin(char *parfile);
+bool mw_par2_verified(const char *name);
+int mw_par2_rc(const char *name);
+bool mw_unrar(void);
+unsigned int mw_unrar_max_jobs(unsigned int sets);
+void mw_unrar_run(struct mw_unrar_job *jobs, unsigned int jobs_length, unsigned int max_running);
 bool mw_parse_yenc_header (char *yEncStart, struct NZBFile *curFile, uint64_t **filesize);
+void mw_prefetch_tail(struct thread_user_data *userData);
+bool mw_get_segment(struct thread_user_data *userData, struct NZBFile *curFile, struct NZBSegment *curSeg, char **buffer);
 bool mw_get_binary_from_article(struct thread_user_data *userData, struct NZBFile *curFile, struct NZBSegment *curSeg, char **buffer);
 char* mw_rar_password_provided(void);
-bool mw_fetch_recovery_volumes(void);
+void mw_check_encryption(struct NZBFile *curFile, const uint8_t *data, size_t length);
+bool mw_fetch_recovery_volumes(uint32_t blocks_needed);
+uint32_t mw_select_recovery_volumes(struct par2_set *set, uint32_t blocks_needed);
+bool mw_fetch_selected_volumes(uint32_t selected_blocks, uint32_t blocks_needed);
 #endif 
\ No newline at end of file
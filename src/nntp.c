@@ -2,6 +2,7 @@
  * Does the network and nntp work.
  */
 #include <string.h>
+#include <errno.h>
 #include <pcre2.h>
 #include <arpa/inet.h>
 #include <netdb.h>
@@ -263,6 +264,32 @@ void nntp_disconnect(struct nntp_server *connection) {
     connection->fd_socket = -1;
 }
 
+/// @brief is a kept connection still usable ? An idle one the server closed (or sent it's
+///        timeout message to) has something to read, a live one doesn't.
+/// @param connection 
+/// @return true if it can be used w/o reconnecting.
+bool nntp_is_alive(struct nntp_server *connection) {
+    char peek;
+
+    if (connection->fd_socket == -1)
+        return false;
+    if (recv(connection->fd_socket, &peek, 1, MSG_PEEK | MSG_DONTWAIT) == -1)
+        return (errno == EAGAIN) || (errno == EWOULDBLOCK);
+    return false;
+}
+
+/// @brief closes the socket w/o talking to the server (it's gone already).
+/// @param connection 
+void nntp_close(struct nntp_server *connection) {
+    if (connection->ssl_fd_socket) {
+        SSL_free(connection->ssl_fd_socket);
+        connection->ssl_fd_socket = NULL;
+    }
+    if (connection->fd_socket != -1)
+        close(connection->fd_socket);
+    connection->fd_socket = -1;
+}
+
 /// @brief sends/auths 
 /// @param username 
 /// @param password 
@@ -350,8 +377,10 @@ struct pair *nntp_get_yenc_meta (char *yencLine) {
 /// @param encoded_header_buffer - starting with =ybegin
 /// @param outBinary pointer to pointer for the output buffer - caller owned!
 /// @param isCRCOk -1 = crc not ok, 0 = crc entry not found, 1 = crc ok
+/// @param partOffset optional, the 0-based binary offset of this part inside the file (NZBSEGMENT_OFFSET_UNKNOWN if not reported)
+/// @param crcOut optional, the crc32 of the decoded data
 /// @return the size of the decoded buffer
-size_t nntp_decode_yenc (char *encoded_header_buffer, char **outBinary, int *isCRCOk) {
+size_t nntp_decode_yenc (char *encoded_header_buffer, char **outBinary, int *isCRCOk, uint64_t *partOffset, uint32_t *crcOut) {
     size_t binSize = 0;
     *outBinary = NULL;
     *isCRCOk = false;
@@ -369,6 +398,9 @@ size_t nntp_decode_yenc (char *encoded_header_buffer, char **outBinary, int *isC
     if (!isCRCOk)
         return 0;
 
+    if (partOffset)
+        *partOffset = NZBSEGMENT_OFFSET_UNKNOWN;
+
     /* prepare statements it, but once is enough */
     static pcre2_code *comp_re_start = NULL, *comp_re_end = NULL, *comp_re_part = NULL;
     if ((!comp_re_start) || (!comp_re_end) || (!comp_re_part)) {
@@ -400,7 +432,12 @@ size_t nntp_decode_yenc (char *encoded_header_buffer, char **outBinary, int *isC
             enc_data_start = ovector[3]+2; // skip \r\n
         }
         if (match_data) pcre2_match_data_free(match_data);
-    }
+
+        // =ypart begin is 1-based:
+        if (partOffset && pair_find(meta_part, "begin") && (strtoull(pair_find(meta_part, "begin"), NULL, 10) > 0))
+            *partOffset = strtoull(pair_find(meta_part, "begin"), NULL, 10) - 1;
+    } else if (partOffset)
+        *partOffset = 0;    // single part, starts at the beginning of the file.
 
     match_data = pcre2_match_data_create_from_pattern(comp_re_end, NULL);
     if (pcre2_match(comp_re_end, (const unsigned char*)encoded_header_buffer, PCRE2_ZERO_TERMINATED, 0, 0, match_data, NULL) >= 0) {   
@@ -416,12 +453,16 @@ size_t nntp_decode_yenc (char *encoded_header_buffer, char **outBinary, int *isC
     *outBinary = bufferOut;
 
     // we have a "(p)crc" entry in the end-pair ?
-    pair_crc32 = pair_find(meta_end, "crc32");
-    if (!pair_crc32)
-        pair_crc32 = pair_find(meta_end, "pcrc32");
+    // multipart: pcrc32 is the crc of this part, crc32 (if present) the one of the whole file.
+    pair_crc32 = pair_find(meta_end, "pcrc32");
+    if (!pair_crc32 && !meta_part)
+        pair_crc32 = pair_find(meta_end, "crc32");
+
+    crc32 = rapidyenc_crc(bufferOut, binSize, 0);
+    if (crcOut)
+        *crcOut = crc32;
 
     if (pair_crc32) {
-        crc32 = rapidyenc_crc(bufferOut, binSize, 0);
         if (crc32 != strtoul(pair_crc32, NULL, 16))
             *isCRCOk = -1;
         else
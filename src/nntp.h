@@ -48,6 +48,7 @@ struct nntp_server {
     uint16_t    connectionID;
     int         nntp_server_state;
     bool        use_body;
+    bool        connected;          // welcomed (and authenticated), kept between passes and nzbs
 };
 
 bool nntp_connect(struct nntp_server *connection);
@@ -59,6 +60,8 @@ int nntp_get_code_from_string(char *buffer, bool *isOk);
 bool nntp_authenticate(struct nntp_server *connection, char *username, char *password);
 struct pair *nntp_get_yenc_meta (char *yencLine);
 bool nntp_get_yenc_header_begin_end(char *encoded_buffer, char **yenc_data_begin, char **yenc_data_end);
-size_t nntp_decode_yenc (char *encoded_header_buffer, char **outBinary, int *isCRCOk);
+size_t nntp_decode_yenc (char *encoded_header_buffer, char **outBinary, int *isCRCOk, uint64_t *partOffset, uint32_t *crcOut);
 void nntp_disconnect(struct nntp_server *connection);
+bool nntp_is_alive(struct nntp_server *connection);
+void nntp_close(struct nntp_server *connection);
 #endif
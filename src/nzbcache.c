@@ -0,0 +1,342 @@
+/*
+ * The binary nzb cache: everything the parser found, written once after the parse and mapped on
+ * the next start of the same nzb.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <openssl/evp.h>
+#include "nzbcache.h"
+#include "stats.h"
+
+// non "exported" functions:
+bool nzb_cache_same_nzb(int cache_fd, struct nzb_cache_header *header, int nzb_fd, struct stat *nzb_stat);
+bool nzb_cache_section_ok(uint64_t offset, uint64_t size, uint64_t file_size);
+uint64_t nzb_cache_align(uint64_t offset);
+uint64_t nzb_cache_resume_file(struct NZBFile *file);
+
+// local variables:
+pthread_mutex_t     nzb_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+int                 nzb_cache_fd = -1;          // the cache we wrote, segment states go here
+uint64_t            nzb_cache_segments_offset = 0;
+bool                nzb_cache_mapped = false;   // the segments are the cache (MAP_SHARED)
+
+uint64_t nzb_cache_align(uint64_t offset) {
+    return (offset + NZB_CACHE_ALIGN - 1) & ~(uint64_t)(NZB_CACHE_ALIGN - 1);
+}
+
+bool nzb_cache_section_ok(uint64_t offset, uint64_t size, uint64_t file_size) {
+    return (offset <= file_size) && (size <= file_size - offset);
+}
+
+/// @brief is the cache from this nzb ? Same size and mtime is enough, a different mtime (copied,
+///        touched) needs the md5, if that matches the new mtime is stored.
+/// @param cache_fd
+/// @param header
+/// @param nzb_fd
+/// @param nzb_stat
+/// @return true if it's the same nzb.
+bool nzb_cache_same_nzb(int cache_fd, struct nzb_cache_header *header, int nzb_fd, struct stat *nzb_stat) {
+    uint8_t md5[16], buffer[65536];
+    EVP_MD_CTX *ctx;
+    off_t pos = 0;
+    ssize_t length;
+
+    if (header->nzb_size != (uint64_t)nzb_stat->st_size)
+        return false;
+    if ((header->nzb_mtime_sec == nzb_stat->st_mtim.tv_sec) && (header->nzb_mtime_nsec == nzb_stat->st_mtim.tv_nsec))
+        return true;
+
+    ctx = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(ctx, EVP_md5(), NULL);
+    while ((length = pread(nzb_fd, buffer, sizeof(buffer), pos)) > 0) {
+        EVP_DigestUpdate(ctx, buffer, length);
+        pos += length;
+    }
+    EVP_DigestFinal_ex(ctx, md5, NULL);
+    EVP_MD_CTX_free(ctx);
+    if ((length < 0) || (memcmp(md5, header->nzb_md5, 16) != 0))
+        return false;
+
+    header->nzb_mtime_sec = nzb_stat->st_mtim.tv_sec;
+    header->nzb_mtime_nsec = nzb_stat->st_mtim.tv_nsec;
+    if (pwrite(cache_fd, header, sizeof(struct nzb_cache_header), 0) != sizeof(struct nzb_cache_header))
+        LOG_MESSAGE(false, "Couldn't update the nzb cache header, errno %i (%s)", errno, strerror(errno));
+    return true;
+}
+
+/// @brief takes the segments the last run got as claimed: it's state is done and it's file is
+///        there w. the decoded size. The first segment is fetched again, it's yEnc header names
+///        the file (and it's first 16k identify it).
+/// @param file 
+/// @return the number of segments that don't have to be fetched.
+uint64_t nzb_cache_resume_file(struct NZBFile *file) {
+    extern struct NZB nzb_tree;
+    uint64_t rv = 0;
+
+    for (unsigned int sg = 0; sg < file->segmentsSize; sg++) {
+        struct NZBSegment *seg = &file->segments[sg];
+        struct stat seg_stat;
+        char *path;
+
+        if ((seg->state != NSState_Done) || (seg->number == 1) || !seg->decoded_bytes)
+            continue;
+        path = mprintfv("%s/%s", nzb_tree.download_destination, nzb_segment_article(seg));
+        if ((stat(path, &seg_stat) == 0) && S_ISREG(seg_stat.st_mode) && ((uint64_t)seg_stat.st_size == seg->decoded_bytes)) {
+            seg->claimed = true;
+            file->remaining_segments--;
+            file->download_size += seg->decoded_bytes;
+            stats_add(STATS_SHARED, Stats_ReleaseDownloaded, seg->bytes);
+            rv++;
+        } else
+            seg->state = NSState_Pending;
+        free (path);
+    }
+    return rv;
+}
+
+/// @brief maps the cache of this nzb (if there is one and it matches) and publishes all files.
+///        The segments the last run downloaded are skipped (see nzb_cache_resume_file).
+/// @param nzb_fd the opened nzb
+/// @param nzb_stat it's stat
+/// @return false if there's no usable cache, the nzb has to be parsed then.
+bool nzb_cache_load(int nzb_fd, struct stat *nzb_stat) {
+    extern struct NZB nzb_tree;
+    extern char* nzb_meta_password;
+    struct nzb_cache_header header;
+    struct nzb_cache_file *records = NULL;
+    struct NZBSegment *segments;
+    char *strings = NULL, *path;
+    struct stat cache_stat;
+    uint64_t file_size, resumed = 0;
+    int fd;
+
+    if (!nzb_tree.download_destination)
+        return false;
+
+    path = mprintfv("%s/%s", nzb_tree.download_destination, NZB_CACHE_NAME);
+    fd = open(path, O_RDWR);
+    free (path);
+    if (fd == -1)
+        return false;
+
+    if ((fstat(fd, &cache_stat) != 0) || (pread(fd, &header, sizeof(header), 0) != sizeof(header)))
+        goto reject;
+    file_size = cache_stat.st_size;
+    if ((memcmp(header.magic, NZB_CACHE_MAGIC, sizeof(header.magic)) != 0) || (header.version != NZB_CACHE_VERSION) ||
+        (header.segment_record_size != sizeof(struct NZBSegment)) || !header.file_count || !header.segment_count ||
+        !header.strings_size || !header.articles_size || (header.articles_size > UINT32_MAX) ||
+        (header.segment_count > file_size / sizeof(struct NZBSegment)) ||
+        !nzb_cache_section_ok(header.files_offset, (uint64_t)header.file_count * sizeof(struct nzb_cache_file), file_size) ||
+        !nzb_cache_section_ok(header.strings_offset, header.strings_size, file_size) ||
+        !nzb_cache_section_ok(header.segments_offset, header.segment_count * sizeof(struct NZBSegment), file_size) ||
+        !nzb_cache_section_ok(header.articles_offset, header.articles_size, file_size) ||
+        (header.segments_offset % NZB_CACHE_ALIGN) || (header.articles_offset % NZB_CACHE_ALIGN) ||
+        (header.password >= header.strings_size))
+        goto reject;
+    if (!nzb_cache_same_nzb(fd, &header, nzb_fd, nzb_stat))
+        goto reject;
+
+    records = (struct nzb_cache_file*)malloc(sizeof(struct nzb_cache_file) * header.file_count);
+    strings = (char*)malloc(header.strings_size);
+    if ((pread(fd, records, sizeof(struct nzb_cache_file) * header.file_count, header.files_offset) != (ssize_t)(sizeof(struct nzb_cache_file) * header.file_count)) ||
+        (pread(fd, strings, header.strings_size, header.strings_offset) != (ssize_t)header.strings_size) ||
+        strings[header.strings_size - 1])
+        goto reject;
+    for (uint32_t i = 0; i < header.file_count; i++) {
+        if ((records[i].first_segment > header.segment_count) ||
+            ((uint64_t)records[i].segment_count + records[i].alternate_count > header.segment_count - records[i].first_segment) ||
+            (records[i].filename >= header.strings_size))
+            goto reject;
+    }
+
+    if (!arena_map_file(&nzb_tree.segment_arena, fd, header.segments_offset, header.segment_count * sizeof(struct NZBSegment), true) ||
+        !arena_map_file(&nzb_tree.articles, fd, header.articles_offset, header.articles_size, false) ||
+        !arena_reserve(&nzb_tree.file_arena, sizeof(struct NZBFile) * header.file_count) ||
+        !arena_reserve(&nzb_tree.positions, sizeof(uint64_t) * (header.segment_count + header.file_count)))
+        goto reject;
+    segments = (struct NZBSegment*)nzb_tree.segment_arena.base;
+    if (nzb_tree.articles.base[header.articles_size - 1])
+        goto reject;
+    for (uint64_t s = 0; s < header.segment_count; s++) {
+        if (segments[s].article >= header.articles_size)
+            goto reject;
+        segments[s].claimed = false;
+    }
+
+    nzb_tree.files = (struct NZBFile*)nzb_tree.file_arena.base;
+    for (uint32_t i = 0; i < header.file_count; i++) {
+        struct NZBFile *file = (struct NZBFile*)arena_alloc(&nzb_tree.file_arena, sizeof(struct NZBFile), _Alignof(struct NZBFile));
+
+        file->crcOk = true;
+        file->filename = strdup(&strings[records[i].filename]);
+        file->segments = &segments[records[i].first_segment];
+        file->segmentsSize = records[i].segment_count;
+        file->alternatesSize = records[i].alternate_count;
+        nzb_file_index_segments(file);     // sorted already, the gaps and positions
+        file->remaining_segments = file->segmentsSize;
+        resumed += nzb_cache_resume_file(file);
+        nzb_schedule_publish_file(i);
+    }
+    if (header.password)
+        nzb_meta_password = strdup(&strings[header.password]);
+
+    LOG_MESSAGE(false, "NZB cache loaded: %u files, %lu segments, %lu downloaded already.", header.file_count, header.segment_count, resumed);
+    if (resumed)
+        q_printf("Resuming, %lu segments were downloaded already.\n", resumed);
+    nzb_cache_mapped = true;
+    free (records);
+    free (strings);
+    close (fd);     // the mappings stay
+    return true;
+
+reject:
+    LOG_MESSAGE(false, "The nzb cache doesn't match the nzb, parsing it.");
+    arena_release(&nzb_tree.segment_arena);
+    arena_release(&nzb_tree.articles);
+    arena_release(&nzb_tree.file_arena);
+    arena_release(&nzb_tree.positions);
+    nzb_tree.files = NULL;
+    free (records);
+    free (strings);
+    close (fd);
+    return false;
+}
+
+/// @brief writes the cache of the parsed nzb (the parser thread calls this when it's done).
+///        The segments written after that are stored by nzb_cache_store_segment().
+/// @param nzb_md5 md5 of the whole nzb
+/// @param nzb_stat
+void nzb_cache_write(const uint8_t *nzb_md5, struct stat *nzb_stat) {
+    extern struct NZB nzb_tree;
+    extern char* nzb_meta_password;
+    struct nzb_cache_header header = { 0 };
+    struct NZBSegment *segments = (struct NZBSegment*)nzb_tree.segment_arena.base;
+    uint32_t strings_pos = 1;
+    char *path, *tmp_path;
+    FILE *out;
+    bool ok;
+
+    if (!nzb_tree.download_destination || !nzb_tree.max_files)
+        return;
+
+    memcpy(header.magic, NZB_CACHE_MAGIC, sizeof(header.magic));
+    header.version = NZB_CACHE_VERSION;
+    header.segment_record_size = sizeof(struct NZBSegment);
+    header.nzb_size = nzb_stat->st_size;
+    header.nzb_mtime_sec = nzb_stat->st_mtim.tv_sec;
+    header.nzb_mtime_nsec = nzb_stat->st_mtim.tv_nsec;
+    memcpy(header.nzb_md5, nzb_md5, 16);
+    header.file_count = nzb_tree.max_files;
+    header.segment_count = nzb_tree.segment_arena.used / sizeof(struct NZBSegment);
+    header.files_offset = sizeof(header);
+    header.strings_offset = header.files_offset + sizeof(struct nzb_cache_file) * header.file_count;
+    header.strings_size = 1;
+    for (unsigned int i = 0; i < nzb_tree.max_files; i++)
+        header.strings_size += strlen(nzb_tree.files[i].filename) + 1;
+    if (nzb_meta_password) {
+        header.password = header.strings_size;
+        header.strings_size += strlen(nzb_meta_password) + 1;
+    }
+    header.segments_offset = nzb_cache_align(header.strings_offset + header.strings_size);
+    header.articles_offset = nzb_cache_align(header.segments_offset + sizeof(struct NZBSegment) * header.segment_count);
+    header.articles_size = nzb_tree.articles.used;
+
+    path = mprintfv("%s/%s", nzb_tree.download_destination, NZB_CACHE_NAME);
+    tmp_path = mprintfv("%s.tmp", path);
+
+    // the download threads wait here while the segments are written, so none gets lost:
+    pthread_mutex_lock(&nzb_cache_mutex);
+    out = fopen(tmp_path, "wb");
+    if (!out) {
+        LOG_MESSAGE(false, "Couldn't create %s, errno %i (%s)", tmp_path, errno, strerror(errno));
+        goto exit;
+    }
+    fwrite(&header, sizeof(header), 1, out);
+    for (unsigned int i = 0; i < nzb_tree.max_files; i++) {
+        struct nzb_cache_file record = {
+            .first_segment = nzb_tree.files[i].segments - segments,
+            .segment_count = nzb_tree.files[i].segmentsSize,
+            .filename = strings_pos,
+            .alternate_count = nzb_tree.files[i].alternatesSize
+        };
+        fwrite(&record, sizeof(record), 1, out);
+        strings_pos += strlen(nzb_tree.files[i].filename) + 1;
+    }
+    fputc(0, out);
+    for (unsigned int i = 0; i < nzb_tree.max_files; i++)
+        fwrite(nzb_tree.files[i].filename, strlen(nzb_tree.files[i].filename) + 1, 1, out);
+    if (nzb_meta_password)
+        fwrite(nzb_meta_password, strlen(nzb_meta_password) + 1, 1, out);
+    // the gaps are holes in the file:
+    fseeko(out, header.segments_offset, SEEK_SET);
+    fwrite(segments, sizeof(struct NZBSegment), header.segment_count, out);
+    fseeko(out, header.articles_offset, SEEK_SET);
+    fwrite(nzb_tree.articles.base, 1, header.articles_size, out);
+    ok = !ferror(out);
+    if ((fclose(out) != 0) || !ok || (rename(tmp_path, path) != 0)) {
+        LOG_MESSAGE(false, "Couldn't write the nzb cache %s, errno %i (%s)", path, errno, strerror(errno));
+        unlink(tmp_path);
+        goto exit;
+    }
+
+    nzb_cache_fd = open(path, O_RDWR);
+    nzb_cache_segments_offset = header.segments_offset;
+    LOG_MESSAGE(false, "NZB cache written: %s", path);
+
+exit:
+    pthread_mutex_unlock(&nzb_cache_mutex);
+    free (tmp_path);
+    free (path);
+}
+
+/// @brief stores the state of a segment in the cache (after it was downloaded or failed).
+/// @param seg
+void nzb_cache_store_segment(struct NZBSegment *seg) {
+    extern struct NZB nzb_tree;
+
+    if (nzb_cache_mapped)
+        return;     // the segments are the cache.
+
+    pthread_mutex_lock(&nzb_cache_mutex);
+    if (nzb_cache_fd != -1) {
+        off_t pos = nzb_cache_segments_offset + ((uint8_t*)seg - nzb_tree.segment_arena.base);
+        if (pwrite(nzb_cache_fd, seg, sizeof(struct NZBSegment), pos) != sizeof(struct NZBSegment))
+            LOG_MESSAGE(false, "Couldn't store segment %u in the nzb cache, errno %i (%s)", seg->number, errno, strerror(errno));
+    }
+    pthread_mutex_unlock(&nzb_cache_mutex);
+}
+
+/// @brief removes the cache of a release that's complete, there's nothing left to resume. A mapped
+///        cache stays valid until cleanup_nzbcache().
+/// @param
+void nzb_cache_remove(void) {
+    extern struct NZB nzb_tree;
+    char *path = mprintfv("%s/%s", nzb_tree.download_destination, NZB_CACHE_NAME);
+
+    pthread_mutex_lock(&nzb_cache_mutex);
+    if (nzb_cache_fd != -1)
+        close (nzb_cache_fd);
+    nzb_cache_fd = -1;
+    if ((unlink(path) != 0) && (errno != ENOENT))
+        LOG_MESSAGE(false, "Failed to remove %s, errno %i, %s", path, errno, strerror(errno));
+    else
+        LOG_MESSAGE(false, "Removed %s", path);
+    pthread_mutex_unlock(&nzb_cache_mutex);
+    free (path);
+}
+
+/// @brief cleans up any resources, waits for a running nzb_cache_write().
+/// @param
+void cleanup_nzbcache(void) {
+    pthread_mutex_lock(&nzb_cache_mutex);
+    if (nzb_cache_fd != -1)
+        close (nzb_cache_fd);
+    nzb_cache_fd = -1;
+    nzb_cache_mapped = false;
+    pthread_mutex_unlock(&nzb_cache_mutex);
+}
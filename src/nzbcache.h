@@ -0,0 +1,47 @@
+#ifndef NZBCACHE_H
+#define NZBCACHE_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include "xmlhandler.h"
+
+// The parsed nzb, next to the download. A restart maps it instead of parsing the nzb again,
+// the segment records are mapped shared, so their state is the resume state of the download.
+#define NZB_CACHE_NAME      ".nzbweaver.idx"
+#define NZB_CACHE_MAGIC     "NZBWIDX"
+#define NZB_CACHE_VERSION   2
+#define NZB_CACHE_ALIGN     65536       // the mapped sections start at a multiple of this (>= any page size)
+
+struct nzb_cache_header {
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    segment_record_size;    // sizeof(struct NZBSegment)
+    uint64_t    nzb_size;               // the nzb it was built from: size, mtime and md5
+    int64_t     nzb_mtime_sec;
+    int64_t     nzb_mtime_nsec;
+    uint8_t     nzb_md5[16];
+    uint32_t    file_count;
+    uint32_t    password;               // offset into the strings, 0 = none
+    uint64_t    segment_count;
+    uint64_t    files_offset;           // struct nzb_cache_file[file_count]
+    uint64_t    strings_offset;         // filenames & password, \0 terminated, starts w. ""
+    uint64_t    strings_size;
+    uint64_t    segments_offset;        // struct NZBSegment[segment_count]
+    uint64_t    articles_offset;        // nzb_tree.articles
+    uint64_t    articles_size;
+};
+
+struct nzb_cache_file {
+    uint64_t    first_segment;
+    uint32_t    segment_count;          // sorted by number, the alternates follow
+    uint32_t    filename;               // offset into the strings
+    uint32_t    alternate_count;
+    uint32_t    reserved;
+};
+
+bool nzb_cache_load(int nzb_fd, struct stat *nzb_stat);
+void nzb_cache_write(const uint8_t *nzb_md5, struct stat *nzb_stat);
+void nzb_cache_store_segment(struct NZBSegment *seg);
+void nzb_cache_remove(void);
+void cleanup_nzbcache(void);
+#endif
@@ -0,0 +1,760 @@
+/*
+ * In-process PAR2 verify & repair.
+ *
+ * Reed-Solomon over GF(2^16) as the spec describes it: every recovery
+ * block is R_e = sum(c_i^e * D_i) over all input slices D_i. With m slices
+ * missing we take m recovery blocks, strip the slices we have out of them
+ * (R'_e) and solve the m x m system for the missing ones.
+ *
+ * Input files and recovery volumes are mmap()ed, the work is split in
+ * byte-ranges ("chunks") of the slice size so every thread handles the same
+ * range of all slices and the buffers stay small.
+ *
+ * Independent recovery sets run side by side (par2_repair_sets), the index
+ * is complete before they start and only read while they run.
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <openssl/evp.h>
+#include "par2repair.h"
+#include "gf16.h"
+
+// the memory we allow the repair buffers to use (for all threads together)
+const uint64_t par2_repair_buffer_budget = 256ULL * 1024 * 1024;
+
+// one file of the recovery set
+struct par2_source {
+    struct par_fileinfo *info;
+    int         fd, fd_write;
+    uint8_t     *map;
+    uint64_t    size;           // usable bytes, never more than file_length
+    uint64_t    disk_size;      // what's really on disk
+    uint32_t    first_slice;    // global index of the first slice
+    uint32_t    slice_count;
+    bool        skipped;        // unsafe name: it's slices are solved, but never read or written
+};
+
+struct par2_job {
+    const char  *directory;
+    struct par2_set *set;
+    uint64_t    slice_size;
+    struct par2_source *sources;
+    unsigned int sources_length;
+    uint32_t    total_slices;
+    uint32_t    *slice_source;  // global slice -> index into sources
+    uint16_t    *constants;     // global slice -> c_i
+    uint8_t     *slice_ok;
+    // repair:
+    uint32_t    *missing;
+    uint32_t    missing_length;
+    struct par_recovery_block **used;
+    struct par_recovery_block **checking;   // the blocks for par2_work_check_block
+    uint8_t     *exponent_done; // used or no intact copy left
+    uint16_t    *inverse;       // missing_length x missing_length
+    uint64_t    chunk_size;
+    // the parallel-for:
+    void        (*work)(struct par2_job *job, uint64_t idx);
+    uint64_t    work_length;
+    atomic_uint_fast64_t work_next;
+    atomic_bool failed;
+};
+
+// par2_repair_sets: the runs are taken one by one by the pool's threads.
+struct par2_repair_pool {
+    const char  *directory;
+    struct par2_repair_run *runs;
+    unsigned int runs_length;
+    bool        do_repair;
+    unsigned int threads;       // per set
+    atomic_uint next;
+};
+
+static const uint8_t par2_zeroes[65536] = { 0 };
+
+bool par2_open_sources(struct par2_job *job);
+uint32_t par2_count_blocks(struct par2_job *job);
+struct par_recovery_block *par2_next_candidate(struct par2_job *job, uint32_t exponent);
+void par2_parallel(struct par2_job *job, unsigned int threads, uint64_t count, void (*work)(struct par2_job *job, uint64_t idx));
+void *par2_parallel_thread(void *arg);
+uint64_t par2_slice_data(struct par2_job *job, uint32_t slice, const uint8_t **data, uint64_t *slice_length);
+void par2_work_verify_slice(struct par2_job *job, uint64_t idx);
+void par2_work_check_block(struct par2_job *job, uint64_t idx);
+void par2_work_repair_chunk(struct par2_job *job, uint64_t idx);
+void par2_work_reverify_slice(struct par2_job *job, uint64_t idx);
+bool par2_verify_whole_file(struct par2_job *job, struct par2_source *src);
+bool par2_invert_matrix(uint16_t *matrix, uint16_t *inverse, uint32_t size);
+void par2_free_job(struct par2_job *job);
+void *par2_repair_pool_thread(void *arg);
+
+/// @brief verifies (and optionally repairs) a recovery set of the index, see par2_index_directory().
+/// @param directory where the files and the *.par2 volumes are
+/// @param set the recovery set
+/// @param do_repair false = verify only
+/// @param threads worker threads, 0 = one per cpu
+/// @param result optional, the numbers
+/// @return one of PAR2Repair_Result
+int par2_repair(const char *directory, struct par2_set *set, bool do_repair, unsigned int threads, struct par2_repair_result *result) {
+    struct par2_job job;
+    struct par2_repair_result res = { 0 };
+    int rv = PAR2Repair_Error;
+    uint16_t *matrix = NULL;
+    uint32_t used_length = 0;
+
+    memset(&job, 0, sizeof(struct par2_job));
+    job.directory = directory;
+    atomic_init(&job.work_next, 0);
+    atomic_init(&job.failed, false);
+
+    if (!threads)
+        threads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? (unsigned int)sysconf(_SC_NPROCESSORS_ONLN) : 1;
+
+    job.set = set;
+    if (!job.set || !job.set->fileinfos_length) {
+        LOG_MESSAGE(false, "par2_repair: no Main/FileDesc packets parsed, nothing to do.");
+        goto done;
+    }
+
+    job.slice_size = job.set->slice_size;
+    gf16_init();
+
+    if (!par2_open_sources(&job))
+        goto done;
+
+    // verify every slice:
+    par2_parallel(&job, threads, job.total_slices, par2_work_verify_slice);
+    for (unsigned int i = 0; i < job.sources_length; i++) {
+        if (!job.sources[i].info->slices)
+            par2_verify_whole_file(&job, &job.sources[i]);    // no IFSC, all or nothing.
+    }
+
+    res.total_slices = job.total_slices;
+    for (unsigned int i = 0; i < job.sources_length; i++) {
+        struct par2_source *src = &job.sources[i];
+        bool damaged = src->disk_size != src->info->file_length;  // too short or too long needs a repair too.
+
+        for (uint32_t s = src->first_slice; s < src->first_slice + src->slice_count; s++) {
+            if (!job.slice_ok[s]) {
+                res.damaged_slices++;
+                damaged = true;
+            }
+        }
+        if (damaged)
+            res.damaged_files++;
+    }
+
+    res.recovery_blocks = par2_count_blocks(&job);
+
+    LOG_MESSAGE(false, "par2_repair: %u of %u slices damaged in %u files, %u recovery blocks found, gf16 kernel: %s.",
+        res.damaged_slices, res.total_slices, res.damaged_files, res.recovery_blocks, gf16_kernel_name());
+
+    if (!res.damaged_files) {
+        rv = PAR2Repair_Ok;
+        goto done;
+    }
+
+    if (res.damaged_slices > res.recovery_blocks) {
+        rv = PAR2Repair_NotEnough;
+        goto done;
+    }
+
+    if (!do_repair) {
+        rv = PAR2Repair_Repairable;
+        goto done;
+    }
+
+    // collect the missing slices:
+    job.missing = (uint32_t*)calloc(res.damaged_slices ? res.damaged_slices : 1, sizeof(uint32_t));
+    for (uint32_t s = 0; s < job.total_slices; s++) {
+        if (!job.slice_ok[s])
+            job.missing[job.missing_length++] = s;
+    }
+
+    // pick recovery blocks w. distinct exponents and a valid packet md5, a broken one is replaced by it's duplicate from another volume:
+    job.used = (struct par_recovery_block**)calloc(job.missing_length ? job.missing_length : 1, sizeof(struct par_recovery_block*));
+    job.checking = (struct par_recovery_block**)calloc(job.missing_length ? job.missing_length : 1, sizeof(struct par_recovery_block*));
+    job.exponent_done = (uint8_t*)calloc(0x10000, 1);
+    while (used_length < job.missing_length) {
+        uint32_t candidates = 0;
+
+        for (uint32_t e = 0; (e < 0x10000) && (candidates < job.missing_length - used_length); e++) {
+            struct par_recovery_block *block = par2_next_candidate(&job, e);
+            if (block)
+                job.checking[candidates++] = block;
+        }
+        if (!candidates)
+            break;  // nothing left to check.
+
+        par2_parallel(&job, threads, candidates, par2_work_check_block);
+
+        for (uint32_t c = 0; (c < candidates) && (used_length < job.missing_length); c++) {
+            if (job.checking[c]->checked == 1) {
+                job.used[used_length++] = job.checking[c];
+                job.exponent_done[job.checking[c]->exponent] = true;
+            }
+        }
+    }
+
+    if (used_length < job.missing_length) {
+        LOG_MESSAGE(false, "par2_repair: only %u of %u recovery blocks are intact.", used_length, job.missing_length);
+        rv = PAR2Repair_NotEnough;
+        goto done;
+    }
+
+    // A[r][j] = c_j ^ e_r
+    matrix = (uint16_t*)calloc((size_t)job.missing_length * job.missing_length, sizeof(uint16_t));
+    job.inverse = (uint16_t*)calloc((size_t)job.missing_length * job.missing_length, sizeof(uint16_t));
+    for (uint32_t r = 0; r < job.missing_length; r++) {
+        for (uint32_t j = 0; j < job.missing_length; j++)
+            matrix[(size_t)r * job.missing_length + j] = gf16_pow(job.constants[job.missing[j]], job.used[r]->exponent);
+    }
+    if (!par2_invert_matrix(matrix, job.inverse, job.missing_length)) {
+        LOG_MESSAGE(true, "par2_repair: recovery matrix is singular, cannot repair w. these blocks.");
+        goto done;
+    }
+
+    // open the damaged files for writing:
+    for (unsigned int i = 0; i < job.sources_length; i++) {
+        struct par2_source *src = &job.sources[i];
+        char *fullpath;
+
+        if (src->skipped)
+            continue;
+        if ((src->disk_size == src->info->file_length) && (src->slice_count > 0)) {
+            bool damaged = false;
+            for (uint32_t s = src->first_slice; s < src->first_slice + src->slice_count; s++)
+                damaged |= !job.slice_ok[s];
+            if (!damaged)
+                continue;
+        }
+
+        fullpath = mprintfv("%s/%s", directory, src->info->name);
+        src->fd_write = open(fullpath, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+        if (src->fd_write == -1) {
+            LOG_MESSAGE(true, "par2_repair: couldn't open %s for writing, errno %i (%s)", fullpath, errno, strerror(errno));
+            free (fullpath);
+            goto done;
+        }
+        free (fullpath);
+    }
+
+    if (job.missing_length) {
+        // every thread gets its share of the buffer budget, 2 buffers (R' and output) per missing slice.
+        job.chunk_size = par2_repair_buffer_budget / ((uint64_t)threads * job.missing_length * 2);
+        job.chunk_size &= ~(uint64_t)127;
+        if (job.chunk_size < 4096)
+            job.chunk_size = 4096;
+        if (job.chunk_size > job.slice_size)
+            job.chunk_size = job.slice_size;
+
+        par2_parallel(&job, threads, (job.slice_size + job.chunk_size - 1) / job.chunk_size, par2_work_repair_chunk);
+    }
+
+    for (unsigned int i = 0; i < job.sources_length; i++) {
+        if (job.sources[i].fd_write == -1)
+            continue;
+        if (ftruncate(job.sources[i].fd_write, job.sources[i].info->file_length) != 0)
+            atomic_store(&job.failed, true);
+    }
+
+    if (atomic_load(&job.failed)) {
+        LOG_MESSAGE(true, "par2_repair: writing the repaired slices failed.");
+        goto done;
+    }
+
+    // read back what we wrote:
+    par2_parallel(&job, threads, job.missing_length, par2_work_reverify_slice);
+    for (uint32_t j = 0; j < job.missing_length; j++) {
+        if (!job.slice_ok[job.missing[j]]) {
+            LOG_MESSAGE(true, "par2_repair: slice %u failed to verify after repair.", job.missing[j]);
+            goto done;
+        }
+    }
+    rv = PAR2Repair_Repaired;
+
+done:
+    free (matrix);
+    par2_free_job(&job);
+    if (result)
+        memcpy(result, &res, sizeof(struct par2_repair_result));
+    return rv;
+}
+
+/// @brief mmaps every file of the recovery set, in the order of the Main packet (= the slice order of the spec).
+/// @param job
+/// @return false if the set is unusable
+bool par2_open_sources(struct par2_job *job) {
+    struct par_fileinfo **ordered;
+    uint32_t slice = 0, logbase = 0;
+
+    if (!job->set->recovery_ids_length) {
+        LOG_MESSAGE(false, "par2_repair: the Main packet lists no files.");
+        return false;
+    }
+
+    ordered = (struct par_fileinfo**)calloc(job->set->recovery_ids_length, sizeof(struct par_fileinfo*));
+    for (uint32_t i = 0; i < job->set->recovery_ids_length; i++) {
+        struct par_fileinfo *info = par2_find_fileinfo(job->set, &job->set->recovery_ids[i * 16], false);
+
+        if (!info || !info->name) {
+            LOG_MESSAGE(false, "par2_repair: no FileDesc for a file of the recovery set.");
+            free (ordered);
+            return false;
+        }
+        ordered[job->sources_length++] = info;
+    }
+
+    job->sources = (struct par2_source*)calloc(job->sources_length ? job->sources_length : 1, sizeof(struct par2_source));
+    for (unsigned int i = 0; i < job->sources_length; i++) {
+        struct par2_source *src = &job->sources[i];
+        struct stat st;
+        char *fullpath = mprintfv("%s/%s", job->directory, ordered[i]->name);
+
+        src->info = ordered[i];
+        src->skipped = !ordered[i]->name_ok;
+        src->fd = src->skipped ? -1 : open(fullpath, O_RDONLY);
+        src->fd_write = -1;
+        src->first_slice = slice;
+        src->slice_count = par2_slices_of_length(job->set, src->info->file_length);
+        slice += src->slice_count;
+
+        if ((src->fd != -1) && (fstat(src->fd, &st) == 0) && (st.st_size > 0)) {
+            src->disk_size = st.st_size;
+            src->size = src->disk_size < src->info->file_length ? src->disk_size : src->info->file_length;
+            src->map = (uint8_t*)mmap(NULL, src->disk_size, PROT_READ, MAP_SHARED, src->fd, 0);
+            if (src->map == MAP_FAILED) {
+                src->map = NULL;
+                src->size = 0;
+            } else
+                madvise(src->map, src->disk_size, MADV_SEQUENTIAL);
+        }
+        free (fullpath);
+    }
+    free (ordered);
+
+    job->total_slices = slice;
+    job->slice_ok = (uint8_t*)calloc(slice ? slice : 1, 1);
+    job->slice_source = (uint32_t*)calloc(slice ? slice : 1, sizeof(uint32_t));
+    job->constants = (uint16_t*)calloc(slice ? slice : 1, sizeof(uint16_t));
+
+    for (unsigned int i = 0; i < job->sources_length; i++) {
+        for (uint32_t s = 0; s < job->sources[i].slice_count; s++)
+            job->slice_source[job->sources[i].first_slice + s] = i;
+    }
+
+    // the spec: c_i = 2^n w. n the i-th number not divisible by 3, 5, 17 or 257
+    for (uint32_t s = 0; s < slice; s++) {
+        while (!(logbase % 3) || !(logbase % 5) || !(logbase % 17) || !(logbase % 257))
+            logbase++;
+        job->constants[s] = gf16_exp(logbase++);
+    }
+    return true;
+}
+
+/// @brief adds every *.par2 file of the directory to the index (files seen before are skipped), every
+///        recovery set in there is known afterwards.
+/// @param directory
+void par2_index_directory(const char *directory) {
+    DIR *dirList;
+    struct dirent *entry;
+
+    dirList = opendir(directory);
+    if (!dirList)
+        return;
+    while ((entry = readdir(dirList)) != NULL) {
+        char *fullpath;
+
+        if (!string_ends_width(entry->d_name, ".par2"))
+            continue;
+
+        fullpath = mprintfv("%s/%s", directory, entry->d_name);
+        par2_index_add_file(fullpath);
+        free (fullpath);
+    }
+    closedir(dirList);
+}
+
+/// @brief counts the recovery blocks of the job's set.
+/// @param job
+/// @return the number of distinct recovery blocks (the same block can be in more than one volume)
+uint32_t par2_count_blocks(struct par2_job *job) {
+    uint32_t distinct = 0;
+
+    for (uint32_t b = 0; b < job->set->blocks_length; b++) {
+        struct par_recovery_block *block = &job->set->blocks[b];
+        // only the first usable copy of an exponent counts:
+        if ((block->packet_length == sizeof(struct par_header) + 4 + job->slice_size) && (block->checked >= 0) &&
+            (par2_next_candidate(job, block->exponent) == block))
+            distinct++;
+    }
+    return distinct;
+}
+
+/// @brief the next copy of a recovery block that's worth a md5 check.
+/// @param job
+/// @param exponent
+/// @return the block or NULL if every copy was used/broken.
+struct par_recovery_block *par2_next_candidate(struct par2_job *job, uint32_t exponent) {
+    struct par_recovery_block *block;
+
+    if (job->exponent_done && job->exponent_done[exponent])
+        return NULL;
+
+    for (block = par2_find_recovery_block(job->set, exponent); block; block = block->next_duplicate >= 0 ? &job->set->blocks[block->next_duplicate] : NULL) {
+        if (block->packet_length != sizeof(struct par_header) + 4 + job->slice_size)
+            continue;   // not a block of this slice size.
+        if (block->checked >= 0)
+            return block;
+    }
+
+    if (job->exponent_done)
+        job->exponent_done[exponent] = true;
+    return NULL;
+}
+
+/// @brief runs par2_repair for every run that's active, up to jobs sets at once w. threads threads each.
+///        The index mustn't change meanwhile (par2_index_directory before).
+/// @param directory
+/// @param runs rc & result are set for the active ones
+/// @param runs_length
+/// @param do_repair
+/// @param jobs sets at once
+/// @param threads per set, 0 = one per cpu
+void par2_repair_sets(const char *directory, struct par2_repair_run *runs, unsigned int runs_length, bool do_repair, unsigned int jobs, unsigned int threads) {
+    struct par2_repair_pool pool = { .directory = directory, .runs = runs, .runs_length = runs_length, .do_repair = do_repair, .threads = threads };
+    pthread_t *workers;
+    unsigned int started = 0;
+
+    atomic_init(&pool.next, 0);
+    gf16_init();
+    if (jobs > runs_length)
+        jobs = runs_length;
+    if (!jobs)
+        return;
+
+    workers = (pthread_t*)calloc(jobs, sizeof(pthread_t));
+    for (unsigned int i = 1; i < jobs; i++) {
+        if (pthread_create(&workers[i], NULL, par2_repair_pool_thread, &pool) == 0)
+            started = i;
+        else
+            break;
+    }
+    par2_repair_pool_thread(&pool);    // the caller works too.
+    for (unsigned int i = 1; i <= started; i++)
+        pthread_join(workers[i], NULL);
+    free (workers);
+}
+
+/// @brief a thread of par2_repair_sets(), takes sets until there are none left.
+/// @param arg
+/// @return NULL
+void *par2_repair_pool_thread(void *arg) {
+    struct par2_repair_pool *pool = (struct par2_repair_pool*)arg;
+    unsigned int idx;
+
+    while ((idx = atomic_fetch_add(&pool->next, 1)) < pool->runs_length) {
+        struct par2_repair_run *run = &pool->runs[idx];
+
+        if (run->active)
+            run->rc = par2_repair(pool->directory, par2_find_set(run->set_id, false), pool->do_repair, pool->threads, &run->result);
+    }
+    return NULL;
+}
+
+/// @brief runs work(job, 0..count-1) on up to threads threads.
+/// @param job
+/// @param threads
+/// @param count
+/// @param work
+void par2_parallel(struct par2_job *job, unsigned int threads, uint64_t count, void (*work)(struct par2_job *job, uint64_t idx)) {
+    pthread_t *workers;
+    unsigned int started = 0;
+
+    if (!count)
+        return;
+
+    job->work = work;
+    job->work_length = count;
+    atomic_store(&job->work_next, 0);
+    if (threads > count)
+        threads = (unsigned int)count;
+
+    workers = (pthread_t*)calloc(threads, sizeof(pthread_t));
+    for (unsigned int i = 1; i < threads; i++) {
+        if (pthread_create(&workers[i], NULL, par2_parallel_thread, job) == 0)
+            started = i;
+        else
+            break;
+    }
+    par2_parallel_thread(job);    // the caller works too.
+    for (unsigned int i = 1; i <= started; i++)
+        pthread_join(workers[i], NULL);
+    free (workers);
+}
+
+/// @brief a worker of par2_parallel(), takes indices until there are none left.
+/// @param arg
+/// @return NULL
+void *par2_parallel_thread(void *arg) {
+    struct par2_job *job = (struct par2_job*)arg;
+    uint64_t idx;
+
+    while ((idx = atomic_fetch_add(&job->work_next, 1)) < job->work_length)
+        job->work(job, idx);
+
+    return NULL;
+}
+
+/// @brief the data of a slice we have on disk.
+/// @param job
+/// @param slice global slice index
+/// @param data out: pointer to the data (NULL if there's nothing)
+/// @param slice_length out: the real length of this slice (the last one of a file is shorter)
+/// @return the bytes available (<= slice_length), missing bytes are zeros for the math.
+uint64_t par2_slice_data(struct par2_job *job, uint32_t slice, const uint8_t **data, uint64_t *slice_length) {
+    struct par2_source *src = &job->sources[job->slice_source[slice]];
+    uint64_t offset = (uint64_t)(slice - src->first_slice) * job->slice_size;
+
+    *slice_length = src->info->file_length - offset < job->slice_size ? src->info->file_length - offset : job->slice_size;
+    *data = NULL;
+    if (!src->map || (offset >= src->size))
+        return 0;
+
+    *data = &src->map[offset];
+    return src->size - offset < *slice_length ? src->size - offset : *slice_length;
+}
+
+/// @brief md5 of a zero-padded slice (the IFSC hashes are over the full slice size)
+static void par2_md5_padded(uint64_t slice_size, const uint8_t *data, uint64_t length, uint8_t *md5) {
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    uint64_t pad = slice_size - length;
+
+    EVP_DigestInit_ex(ctx, EVP_md5(), NULL);
+    if (length)
+        EVP_DigestUpdate(ctx, data, length);
+    while (pad) {
+        uint64_t step = pad < sizeof(par2_zeroes) ? pad : sizeof(par2_zeroes);
+        EVP_DigestUpdate(ctx, par2_zeroes, step);
+        pad -= step;
+    }
+    EVP_DigestFinal_ex(ctx, md5, NULL);
+    EVP_MD_CTX_free(ctx);
+}
+
+/// @brief par2_parallel work: checks one slice against it's IFSC md5.
+void par2_work_verify_slice(struct par2_job *job, uint64_t idx) {
+    struct par2_source *src = &job->sources[job->slice_source[idx]];
+    const uint8_t *data;
+    uint64_t slice_length, available;
+    uint8_t md5[16];
+
+    if (!src->info->slices)
+        return; // par2_verify_whole_file() handles these.
+    if ((idx - src->first_slice) >= src->info->slice_count)
+        return; // IFSC is shorter than the file ?!
+
+    available = par2_slice_data(job, (uint32_t)idx, &data, &slice_length);
+    if (available < slice_length)
+        return; // truncated slice, can't be ok.
+
+    par2_md5_padded(job->slice_size, data, available, md5);
+    job->slice_ok[idx] = memcmp(md5, src->info->slices[idx - src->first_slice].md5_hash, 16) == 0;
+}
+
+/// @brief for files w/o IFSC packet: the md5 of the whole file decides about all of its slices.
+/// @param job
+/// @param src
+/// @return true if the file is ok.
+bool par2_verify_whole_file(struct par2_job *job, struct par2_source *src) {
+    uint8_t md5[16];
+
+    if (!src->map || (src->disk_size != src->info->file_length))
+        return false;
+
+    EVP_Digest(src->map, src->size, md5, NULL, EVP_md5(), NULL);
+    if (memcmp(md5, src->info->md5_hash_file, 16) != 0)
+        return false;
+
+    for (uint32_t s = 0; s < src->slice_count; s++)
+        job->slice_ok[src->first_slice + s] = true;
+    return true;
+}
+
+/// @brief par2_parallel work: md5-check of a recovery packet (job->checking[idx])
+void par2_work_check_block(struct par2_job *job, uint64_t idx) {
+    struct par_recovery_block *block = job->checking[idx];
+
+    if (block->checked)
+        return; // checked by an earlier run.
+    block->checked = par2_check_packet(block->packet, block->packet_length) ? 1 : -1;
+    if (block->checked < 0)
+        LOG_MESSAGE(false, "par2_repair: recovery block w. exponent %u is damaged, skipping.", block->exponent);
+}
+
+/// @brief par2_parallel work: rebuilds bytes [idx*chunk, (idx+1)*chunk) of every missing slice.
+void par2_work_repair_chunk(struct par2_job *job, uint64_t idx) {
+    uint64_t chunk_start = idx * job->chunk_size;
+    uint64_t chunk_length = job->slice_size - chunk_start < job->chunk_size ? job->slice_size - chunk_start : job->chunk_size;
+    uint32_t m = job->missing_length;
+    uint8_t *recovery, *output;
+
+    if (atomic_load(&job->failed))
+        return;
+
+    // +2: gf16_muladd_region may touch the high byte of an odd tail.
+    recovery = (uint8_t*)malloc((chunk_length + 2) * m);
+    output = (uint8_t*)calloc((chunk_length + 2) * m, 1);
+    if (!recovery || !output) {
+        atomic_store(&job->failed, true);
+        goto done;
+    }
+
+    // R'_r = R_r - sum(c_i^e_r * D_i) for every slice we have
+    for (uint32_t r = 0; r < m; r++)
+        memcpy(&recovery[r * (chunk_length + 2)], &job->used[r]->packet[sizeof(struct par_header) + 4 + chunk_start], chunk_length);
+
+    for (uint32_t s = 0; s < job->total_slices; s++) {
+        const uint8_t *data;
+        uint64_t slice_length, available;
+
+        if (!job->slice_ok[s])
+            continue;
+        available = par2_slice_data(job, s, &data, &slice_length);
+        if (available <= chunk_start)
+            continue;   // only (virtual) zeros left in this slice.
+        available -= chunk_start;
+        if (available > chunk_length)
+            available = chunk_length;
+
+        for (uint32_t r = 0; r < m; r++)
+            gf16_muladd_region(&recovery[r * (chunk_length + 2)], &data[chunk_start], gf16_pow(job->constants[s], job->used[r]->exponent), available);
+    }
+
+    // D_j = sum(inverse[j][r] * R'_r)
+    for (uint32_t j = 0; j < m; j++) {
+        for (uint32_t r = 0; r < m; r++)
+            gf16_muladd_region(&output[j * (chunk_length + 2)], &recovery[r * (chunk_length + 2)], job->inverse[(size_t)j * m + r], chunk_length);
+    }
+
+    for (uint32_t j = 0; j < m; j++) {
+        uint32_t slice = job->missing[j];
+        struct par2_source *src = &job->sources[job->slice_source[slice]];
+        uint64_t offset = (uint64_t)(slice - src->first_slice) * job->slice_size;
+        uint64_t slice_length = src->info->file_length - offset < job->slice_size ? src->info->file_length - offset : job->slice_size;
+        uint64_t write_length;
+
+        if ((slice_length <= chunk_start) || src->skipped)
+            continue;   // the padding of the last slice, not part of the file (or a file we don't write).
+        write_length = slice_length - chunk_start < chunk_length ? slice_length - chunk_start : chunk_length;
+        if (pwrite(src->fd_write, &output[j * (chunk_length + 2)], write_length, offset + chunk_start) != (ssize_t)write_length) {
+            LOG_MESSAGE(true, "par2_repair: pwrite to %s failed, errno %i (%s)", src->info->name, errno, strerror(errno));
+            atomic_store(&job->failed, true);
+        }
+    }
+
+done:
+    free (recovery);
+    free (output);
+}
+
+/// @brief par2_parallel work: reads back a repaired slice and checks it's md5.
+void par2_work_reverify_slice(struct par2_job *job, uint64_t idx) {
+    uint32_t slice = job->missing[idx];
+    struct par2_source *src = &job->sources[job->slice_source[slice]];
+    uint64_t offset = (uint64_t)(slice - src->first_slice) * job->slice_size;
+    uint64_t slice_length = src->info->file_length - offset < job->slice_size ? src->info->file_length - offset : job->slice_size;
+    uint8_t md5[16];
+    uint8_t *buffer;
+
+    if (src->skipped) {
+        job->slice_ok[slice] = true;    // solved, not written on purpose.
+        return;
+    }
+    buffer = (uint8_t*)malloc(slice_length ? slice_length : 1);
+    if (!buffer)
+        return;
+
+    if (pread(src->fd_write, buffer, slice_length, offset) == (ssize_t)slice_length) {
+        if (src->info->slices) {
+            par2_md5_padded(job->slice_size, buffer, slice_length, md5);
+            job->slice_ok[slice] = memcmp(md5, src->info->slices[slice - src->first_slice].md5_hash, 16) == 0;
+        } else
+            job->slice_ok[slice] = true;    // no IFSC, nothing to compare against.
+    }
+    free (buffer);
+}
+
+/// @brief gauss-jordan over GF(2^16)
+/// @param matrix size x size, destroyed
+/// @param inverse size x size
+/// @param size
+/// @return false if singular
+bool par2_invert_matrix(uint16_t *matrix, uint16_t *inverse, uint32_t size) {
+    for (uint32_t r = 0; r < size; r++) {
+        for (uint32_t c = 0; c < size; c++)
+            inverse[(size_t)r * size + c] = r == c;
+    }
+
+    for (uint32_t col = 0; col < size; col++) {
+        uint32_t pivot = col;
+        uint16_t scale;
+
+        while ((pivot < size) && !matrix[(size_t)pivot * size + col])
+            pivot++;
+        if (pivot == size)
+            return false;
+
+        if (pivot != col) {
+            for (uint32_t c = 0; c < size; c++) {
+                uint16_t t = matrix[(size_t)pivot * size + c];
+                matrix[(size_t)pivot * size + c] = matrix[(size_t)col * size + c];
+                matrix[(size_t)col * size + c] = t;
+                t = inverse[(size_t)pivot * size + c];
+                inverse[(size_t)pivot * size + c] = inverse[(size_t)col * size + c];
+                inverse[(size_t)col * size + c] = t;
+            }
+        }
+
+        scale = matrix[(size_t)col * size + col];
+        for (uint32_t c = 0; c < size; c++) {
+            matrix[(size_t)col * size + c] = gf16_div(matrix[(size_t)col * size + c], scale);
+            inverse[(size_t)col * size + c] = gf16_div(inverse[(size_t)col * size + c], scale);
+        }
+
+        for (uint32_t r = 0; r < size; r++) {
+            uint16_t factor = matrix[(size_t)r * size + col];
+            if ((r == col) || !factor)
+                continue;
+            for (uint32_t c = 0; c < size; c++) {
+                matrix[(size_t)r * size + c] ^= gf16_mul(factor, matrix[(size_t)col * size + c]);
+                inverse[(size_t)r * size + c] ^= gf16_mul(factor, inverse[(size_t)col * size + c]);
+            }
+        }
+    }
+    return true;
+}
+
+/// @brief unmaps/closes everything
+/// @param job
+void par2_free_job(struct par2_job *job) {
+    for (unsigned int i = 0; i < job->sources_length; i++) {
+        if (job->sources[i].map)
+            munmap(job->sources[i].map, job->sources[i].disk_size);
+        if (job->sources[i].fd != -1)
+            close (job->sources[i].fd);
+        if (job->sources[i].fd_write != -1)
+            close (job->sources[i].fd_write);
+    }
+    free (job->sources);
+    free (job->slice_ok);
+    free (job->slice_source);
+    free (job->constants);
+    free (job->missing);
+    free (job->used);
+    free (job->checking);
+    free (job->exponent_done);
+    free (job->inverse);
+}
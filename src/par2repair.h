@@ -0,0 +1,34 @@
+#ifndef PAR2REPAIR_H
+#define PAR2REPAIR_H
+#include <stdbool.h>
+#include <stdint.h>
+#include "parfiles.h"
+
+enum PAR2Repair_Result {
+    PAR2Repair_Ok = 0,          // every slice verified
+    PAR2Repair_Repaired,        // damage found and fixed
+    PAR2Repair_Repairable,      // damage found, enough recovery blocks (verify only)
+    PAR2Repair_NotEnough,       // damage found, not enough recovery blocks
+    PAR2Repair_Error            // no par2 data, io error, singular matrix...
+};
+
+struct par2_repair_result {
+    uint32_t    total_slices;
+    uint32_t    damaged_slices;
+    uint32_t    recovery_blocks;    // usable recovery blocks found in the *.par2 files
+    unsigned int damaged_files;
+};
+
+// one recovery set for par2_repair_sets:
+struct par2_repair_run {
+    uint8_t     set_id[16];
+    bool        active;             // run it this time
+    int         rc;                 // one of PAR2Repair_Result
+    struct par2_repair_result result;
+    bool        verified;           // the files of the set may be unpacked
+};
+
+int par2_repair(const char *directory, struct par2_set *set, bool do_repair, unsigned int threads, struct par2_repair_result *result);
+void par2_index_directory(const char *directory);
+void par2_repair_sets(const char *directory, struct par2_repair_run *runs, unsigned int runs_length, bool do_repair, unsigned int jobs, unsigned int threads);
+#endif
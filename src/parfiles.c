@@ -2,17 +2,41 @@
  * Because nzb and yenc are perfectly working together,
  * we parse the par2 file for the filenames
  */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <strings.h>
+#include <openssl/evp.h>
 #include "parfiles.h"
 
 // the magic sequence 
 const unsigned char magic_sequence_check[]={"PAR2\0PKT"};
 const unsigned char magic_filepacket_check[]={"PAR 2.0\0FileDesc"};
 const unsigned char magic_mainpacket_check[]={"PAR 2.0\0Main\0\0\0\0"};
+const unsigned char magic_ifscpacket_check[]={"PAR 2.0\0IFSC\0\0\0\0"};
+const unsigned char magic_recvslicepacket_check[]={"PAR 2.0\0RecvSlic"};
 
 // the filenames:
 char **par_filenames = NULL;
 unsigned int par_filenames_length = 0;
 
+// the names as hash set:
+struct par2_name_index par_name_index = { .slots = NULL, .slots_size = 0, .lengths = NULL, .lengths_length = 0, .indexed = 0 };
+struct par2_name_stats par_name_stats = { 0 };
+const uint64_t par2_name_hash_base = 0x100000001B3ULL;
+
+// every packet we've seen, by recovery set:
+struct par2_index par_index = { .sets = NULL, .sets_length = 0, .mappings = NULL, .mappings_length = 0 };
+
+void par2_index_scan(const uint8_t *mem, uint64_t size, bool *isMain);
+void par2_parse_main_packet(struct par2_set *set, const uint8_t *body, uint64_t bodysize);
+void par2_parse_filedesc_packet(struct par2_set *set, const uint8_t *body, uint64_t bodysize);
+void par2_parse_ifsc_packet(struct par2_set *set, const uint8_t *body, uint64_t bodysize);
+void par2_add_recovery_block(struct par2_set *set, const uint8_t *packet, uint64_t packet_length);
+void par2_name_index_build(void);
+uint32_t par2_name_index_find(uint64_t hash, const char *name, size_t length);
+
 /*
 From: https://parchive.sourceforge.net/docs/specifications/parity-volume-spec/article-spec.html#i__134603784_511
 
@@ -32,89 +56,609 @@ Length (bytes)	Type	Description
 16	MD5 Hash	The MD5-16k. That is, the MD5 hash of the first 16kB of the file.
 8	8-byte uint	Length of the file.
 ?*4	ASCII char array	Name of the file. This array is not guaranteed to be null terminated! Subdirectories are indicated by an HTML-style '/' (a.k.a. the UNIX slash). The filename must be unique.
+
+Table 135. Main Packet Body Contents
+8	8-byte uint	Slice size. Must be a multiple of 4.
+4	4-byte uint	Number of files in the recovery set.
+?*16	MD5 Hash array	File IDs of all files in the recovery set.
+?*16	MD5 Hash array	File IDs of all files in the non-recovery set.
+
+Table 180. Input File Slice Checksum Packet Body Contents
+16	MD5 Hash	The File ID of the file.
+?*20	{MD5 Hash, CRC32} array	MD5 Hash and CRC32 pairs for the slices of the file. The last slice is padded with zeros.
 */
 
-/// @brief fills the par_filenames array w. the filenames from par2 file.
-/// @param filename the filename of the PAR2 to parse.
+/// @brief indexes the par2 file and fills the par_filenames array w. the filenames of it.
+/// @param filename the nzb-file of the PAR2 to parse.
+/// @param isMain set if a Main packet was found.
 /// @return true if everything was ok.
 bool get_par2_filenames(struct NZBFile *filename, bool *isMain) {
-    FILE*   io_par2;
-    char*   buffer = NULL;
-    size_t  buffersize = 0;
     extern struct NZB nzb_tree;
-    bool    rv;
+    uint8_t *buffer;
+    uint64_t buffersize = 0, *segment_sizes;
+    char *joinedpath;
+    struct stat segment_stat;
 
     if (par_filenames)
         return true;    // list was populated before.
-    
+
+    *isMain = false;
+
+    // joined already ? then it's one mmap():
+    joinedpath = mprintfv("%s/%s", nzb_tree.download_destination, filename->yenc_filename ? filename->yenc_filename : filename->filename);
+    if (stat(joinedpath, &segment_stat) == 0) {
+        bool rv = par2_index_add_file(joinedpath);
+        free (joinedpath);
+        *isMain = par2_default_set() != NULL;
+        return rv;
+    }
+    free (joinedpath);
+
+    // one segment (the usual index .par2), map it directly:
+    if (filename->segmentsSize == 1) {
+        char *fullfilepath = mprintfv("%s/%s", nzb_tree.download_destination, nzb_segment_article(&filename->segments[0]));
+        bool rv = par2_index_add_file(fullfilepath);
+        free (fullfilepath);
+        *isMain = par2_default_set() != NULL;
+        return rv;
+    }
+
+    // packets can span segment files, so these have to be in one piece: size everything first, read once.
+    segment_sizes = (uint64_t*)calloc(filename->segmentsSize ? filename->segmentsSize : 1, sizeof(uint64_t));
     for (unsigned int segCnt = 0; segCnt < filename->segmentsSize; segCnt++) {
-        char *fullfilepath = mprintfv("%s/%s", nzb_tree.download_destination, filename->segments[segCnt].articleID);
-        size_t curFileSize = 0, readFileSize = 0;
+        char *fullfilepath = mprintfv("%s/%s", nzb_tree.download_destination, nzb_segment_article(&filename->segments[segCnt]));
+        if (stat(fullfilepath, &segment_stat) == 0)
+            segment_sizes[segCnt] = segment_stat.st_size;
+        buffersize += segment_sizes[segCnt];
+        free (fullfilepath);
+    }
+
+    buffer = (uint8_t*)malloc(buffersize ? buffersize : 1);
+    buffersize = 0;
+    for (unsigned int segCnt = 0; segCnt < filename->segmentsSize; segCnt++) {
+        char *fullfilepath;
+        int fd_segment;
 
-        io_par2 = fopen64(fullfilepath, "r");
-        if (!io_par2) {
-            free (fullfilepath);
+        if (!segment_sizes[segCnt])
             continue;
+        fullfilepath = mprintfv("%s/%s", nzb_tree.download_destination, nzb_segment_article(&filename->segments[segCnt]));
+        fd_segment = open(fullfilepath, O_RDONLY);
+        if (fd_segment != -1) {
+            ssize_t readsize = pread(fd_segment, &buffer[buffersize], segment_sizes[segCnt], 0);
+            if (readsize != (ssize_t)segment_sizes[segCnt])
+                LOG_MESSAGE(false, "Warning reading PAR2 File: %s", fullfilepath);
+            if (readsize > 0)
+                buffersize += readsize;
+            close (fd_segment);
         }
-        
-        fseek(io_par2, 0, SEEK_END);
-        curFileSize = ftello64(io_par2);
-        fseek(io_par2, 0, SEEK_SET);
-        buffer = (char*)realloc(buffer, buffersize+curFileSize);
-        readFileSize = fread(&buffer[buffersize], 1, curFileSize, io_par2);
-        if (readFileSize != curFileSize)
-            LOG_MESSAGE(false, "Warning reading PAR2 File: %s", fullfilepath);
-        fclose(io_par2);
-        buffersize += curFileSize;
         free (fullfilepath);
     }
+    free (segment_sizes);
 
-    rv = get_par2_filenames_from_memory(buffer, buffersize, isMain);
-    free (buffer);
-    return rv;
+    return par2_index_add_memory(buffer, buffersize, true, isMain);
 }
 
-/// @brief fills the par_filenames array w. the filenames from pointer to par2-memory
-/// @param parmem the pointer to memory
+/// @brief indexes par2-memory and fills the par_filenames array w. the filenames of it.
+/// @param parmem the pointer to memory, has to stay valid as long as the index is used.
 /// @param parmemsize how big parmem is.
 /// @return true if everything was ok.
 bool get_par2_filenames_from_memory(char *parmem, size_t parmemsize, bool *isMain) {
-    uint64_t data_pos = 0;
-    char    *parname;
-    struct par_header *header;
-    struct par_file   *file;
-
-    (void)file;
-
     if (par_filenames)
         return true;    // list was populated before.
 
+    return par2_index_add_memory((uint8_t*)parmem, parmemsize, false, isMain);
+}
+
+/// @brief mmap()s a par2 file (index or volume) and adds all it's valid packets to the index.
+/// @param path 
+/// @return false if the file couldn't be mapped.
+bool par2_index_add_file(const char *path) {
+    struct stat st;
+    uint8_t *map;
+    int fd;
+    bool isMain;
+
+    for (unsigned int i = 0; i < par_index.mappings_length; i++) {
+        if (par_index.mappings[i].path && (strcmp(par_index.mappings[i].path, path) == 0))
+            return true;    // indexed before.
+    }
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return false;
+    if ((fstat(fd, &st) != 0) || !S_ISREG(st.st_mode) || (st.st_size < (off_t)sizeof(struct par_header))) {
+        close (fd);
+        return false;
+    }
+    map = (uint8_t*)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close (fd);     // the mapping stays valid.
+    if (map == MAP_FAILED) {
+        LOG_MESSAGE(false, "Couldn't mmap %s, errno %i (%s)", path, errno, strerror(errno));
+        return false;
+    }
+
+    par_index.mappings = (struct par2_mapping*)realloc(par_index.mappings, sizeof(struct par2_mapping) * (par_index.mappings_length+1));
+    par_index.mappings[par_index.mappings_length].path = strdup(path);
+    par_index.mappings[par_index.mappings_length].map = map;
+    par_index.mappings[par_index.mappings_length].size = st.st_size;
+    par_index.mappings[par_index.mappings_length].is_mmap = true;
+    par_index.mappings_length++;
+
+    par2_index_scan(map, st.st_size, &isMain);
+    return true;
+}
+
+/// @brief adds all valid packets in memory to the index.
+/// @param mem 
+/// @param size 
+/// @param take_ownership mem was malloc()ed and is free()d by par2_index_free()
+/// @param isMain set if a Main packet was found
+/// @return false if there's no valid packet in mem
+bool par2_index_add_memory(uint8_t *mem, uint64_t size, bool take_ownership, bool *isMain) {
+    par_index.mappings = (struct par2_mapping*)realloc(par_index.mappings, sizeof(struct par2_mapping) * (par_index.mappings_length+1));
+    par_index.mappings[par_index.mappings_length].path = NULL;
+    par_index.mappings[par_index.mappings_length].map = take_ownership ? mem : NULL;
+    par_index.mappings[par_index.mappings_length].size = size;
+    par_index.mappings[par_index.mappings_length].is_mmap = false;
+    par_index.mappings_length++;
+
+    par2_index_scan(mem, size, isMain);
+    return par_index.sets_length > 0;
+}
+
+/// @brief walks the packets, skips garbage (resyncs on the magic sequence) and every packet w. a wrong md5.
+///        RecoverySlice packets are only md5-checked when they are used, so a multi-GB volume costs
+///        us the pages w. the packet headers.
+/// @param mem 
+/// @param size 
+/// @param isMain 
+void par2_index_scan(const uint8_t *mem, uint64_t size, bool *isMain) {
+    uint64_t pos = 0, skipped = 0;
+
     *isMain = false;
 
-    while (data_pos < parmemsize) {
-        header = (struct par_header*)&parmem[data_pos];
-        file = (struct par_file*)&parmem[data_pos+sizeof(struct par_header)];
-        if (!compare_par2_fields(header->magic_sequence, magic_sequence_check, 8))
-            return false;   // is it valid ?
-        if (compare_par2_fields(header->type, magic_mainpacket_check, 16))
+    while (pos + sizeof(struct par_header) <= size) {
+        struct par_header header;
+        struct par2_set *set;
+        const uint8_t *body;
+        uint64_t bodysize;
+
+        memcpy(&header, &mem[pos], sizeof(struct par_header));
+        if (!compare_par2_fields(header.magic_sequence, magic_sequence_check, 8) ||
+            (header.packet_length < sizeof(struct par_header)) || (header.packet_length % 4) ||
+            (header.packet_length > size - pos)) {
+            goto resync;
+        }
+
+        body = &mem[pos + sizeof(struct par_header)];
+        bodysize = header.packet_length - sizeof(struct par_header);
+
+        if (compare_par2_fields(header.type, magic_recvslicepacket_check, 16)) {
+            par2_add_recovery_block(par2_find_set(header.recv_set_id, true), &mem[pos], header.packet_length);
+            pos += header.packet_length;
+            continue;
+        }
+
+        if (!par2_check_packet(&mem[pos], header.packet_length))
+            goto resync;
+
+        set = par2_find_set(header.recv_set_id, true);
+        if (compare_par2_fields(header.type, magic_mainpacket_check, 16)) {
             *isMain = true;
-        // we only want filedescription packets.
-        if (!compare_par2_fields(header->type, magic_filepacket_check, 16)) {
-            data_pos += header->packet_length;  // skip this packet it's not the one we want.
+            par2_parse_main_packet(set, body, bodysize);
+        } else if (compare_par2_fields(header.type, magic_filepacket_check, 16)) {
+            par2_parse_filedesc_packet(set, body, bodysize);
+        } else if (compare_par2_fields(header.type, magic_ifscpacket_check, 16)) {
+            par2_parse_ifsc_packet(set, body, bodysize);
+        }
+        pos += header.packet_length;
+        continue;
+
+resync:
+        // garbage (or a broken packet): go on w. the next magic sequence.
+        skipped++;
+        {
+            const uint8_t *next = &mem[pos+1];
+            while ((next = memchr(next, 'P', &mem[size] - next)) != NULL) {
+                if ((&mem[size] - next >= 8) && compare_par2_fields((uint8_t*)next, magic_sequence_check, 8))
+                    break;
+                next++;
+            }
+            if (!next)
+                break;
+            pos = next - mem;
+        }
+    }
+
+    if (skipped)
+        LOG_MESSAGE(false, "PAR2: skipped %lu broken packets / garbage areas.", skipped);
+}
+
+/// @brief checks the md5 of a packet (from the recovery set id to the end)
+/// @param packet 
+/// @param packet_length 
+/// @return true if it's ok
+bool par2_check_packet(const uint8_t *packet, uint64_t packet_length) {
+    uint8_t md5[16];
+
+    if (packet_length < sizeof(struct par_header))
+        return false;
+
+    EVP_Digest(&packet[32], packet_length - 32, md5, NULL, EVP_md5(), NULL);
+    return memcmp(md5, &packet[16], 16) == 0;
+}
+
+/// @brief reads the slice size and the recovery set file ids.
+/// @param set 
+/// @param body the packet body
+/// @param bodysize size of the body
+void par2_parse_main_packet(struct par2_set *set, const uint8_t *body, uint64_t bodysize) {
+    uint32_t recovery_files;
+
+    if ((bodysize < 12) || set->slice_size)
+        return;
+
+    memcpy(&set->slice_size, body, 8);
+    memcpy(&recovery_files, &body[8], 4);
+
+    // the ids are ordered as par2 sorts them (little-endian 128 bit numbers), the slices follow that order:
+    if (recovery_files > (bodysize - 12) / 16)
+        recovery_files = (bodysize - 12) / 16;
+    free (set->recovery_ids);
+    set->recovery_ids_length = 0;
+    set->recovery_ids = (uint8_t*)malloc(recovery_files ? (uint64_t)recovery_files * 16 : 1);
+    for (uint64_t i = 0; (i < recovery_files) && (12 + (i+1)*16 <= bodysize); i++) {
+        par2_find_fileinfo(set, &body[12 + i*16], true)->in_recovery_set = true;
+        memcpy(&set->recovery_ids[set->recovery_ids_length++ * 16], &body[12 + i*16], 16);
+    }
+}
+
+/// @brief reads the file id, hashes, length and name of a file.
+/// @param set 
+/// @param body the packet body
+/// @param bodysize size of the body
+void par2_parse_filedesc_packet(struct par2_set *set, const uint8_t *body, uint64_t bodysize) {
+    struct par_file file;
+    struct par_fileinfo *info;
+
+    if (bodysize < sizeof(struct par_file))
+        return;
+
+    memcpy(&file, body, sizeof(struct par_file));
+    info = par2_find_fileinfo(set, file.md5_hash_id, true);
+    if (info->name)
+        return; // FileDesc packets are repeated in every volume.
+
+    memcpy(info->md5_hash_file, file.md5_hash_file, 16);
+    memcpy(info->md5_hash_16k, file.md5_hash_16k, 16);
+    info->file_length = file.file_length;
+    info->name = strndup((char*)&body[sizeof(struct par_file)], bodysize - sizeof(struct par_file));
+    // the name is \0 padded to 4 bytes, anything behind the first \0 means it's been tampered with:
+    info->name_ok = par2_name_ok(info->name, strlen(info->name));
+    for (uint64_t i = sizeof(struct par_file) + strlen(info->name); i < bodysize; i++)
+        info->name_ok = info->name_ok && !body[i];
+    if (!info->name_ok)
+        LOG_MESSAGE(true, "par2: refusing the file name \"%s\", it would end up outside the download directory.", info->name);
+    set->md5_16k_dirty = true;
+
+    par_filenames = (char**)realloc(par_filenames, sizeof(char*) * (par_filenames_length+1));
+    par_filenames[par_filenames_length++] = strdup(info->name);
+}
+
+/// @brief reads the md5/crc32 pairs of every slice of a file.
+/// @param set 
+/// @param body the packet body
+/// @param bodysize size of the body
+void par2_parse_ifsc_packet(struct par2_set *set, const uint8_t *body, uint64_t bodysize) {
+    struct par_fileinfo *info;
+    uint32_t slice_count;
+
+    if (bodysize < 16)
+        return;
+
+    info = par2_find_fileinfo(set, body, true);
+    if (info->slices)
+        return; // seen before.
+
+    slice_count = (bodysize - 16) / 20;
+    info->slices = (struct par_slice_checksum*)calloc(slice_count ? slice_count : 1, sizeof(struct par_slice_checksum));
+    for (uint32_t i = 0; i < slice_count; i++) {
+        memcpy(info->slices[i].md5_hash, &body[16 + i*20], 16);
+        memcpy(&info->slices[i].crc32, &body[16 + i*20 + 16], 4);
+    }
+    info->slice_count = slice_count;
+}
+
+/// @brief remembers a RecoverySlice packet, duplicates (the same exponent in another volume) are chained.
+/// @param set 
+/// @param packet 
+/// @param packet_length 
+void par2_add_recovery_block(struct par2_set *set, const uint8_t *packet, uint64_t packet_length) {
+    struct par_recovery_block *block;
+    uint32_t exponent;
+
+    if (packet_length < sizeof(struct par_header) + 4)
+        return;
+    memcpy(&exponent, &packet[sizeof(struct par_header)], 4);
+    if (exponent > 0xFFFF)
+        return; // can't be, the constants would repeat.
+
+    if (!set->block_by_exponent) {
+        set->block_by_exponent = (int32_t*)malloc(sizeof(int32_t) * 0x10000);
+        memset(set->block_by_exponent, 0xFF, sizeof(int32_t) * 0x10000);   // -1
+    }
+
+    // grow geometrically, volumes can hold thousands of blocks.
+    if (!(set->blocks_length & (set->blocks_length - 1)))
+        set->blocks = (struct par_recovery_block*)realloc(set->blocks, sizeof(struct par_recovery_block) * (set->blocks_length ? set->blocks_length * 2 : 1));
+
+    block = &set->blocks[set->blocks_length];
+    block->exponent = exponent;
+    block->packet = packet;
+    block->packet_length = packet_length;
+    block->checked = 0;
+    block->next_duplicate = -1;
+
+    if (set->block_by_exponent[exponent] == -1) {
+        set->block_by_exponent[exponent] = set->blocks_length;
+        set->distinct_blocks++;
+    } else {
+        int32_t last = set->block_by_exponent[exponent];
+        while (set->blocks[last].next_duplicate != -1)
+            last = set->blocks[last].next_duplicate;
+        set->blocks[last].next_duplicate = set->blocks_length;
+    }
+    set->blocks_length++;
+}
+
+/// @brief looks up (or adds) a recovery set.
+/// @param set_id 
+/// @param create 
+/// @return the set or NULL
+struct par2_set *par2_find_set(const uint8_t *set_id, bool create) {
+    for (unsigned int i = 0; i < par_index.sets_length; i++) {
+        if (memcmp(par_index.sets[i].set_id, set_id, 16) == 0)
+            return &par_index.sets[i];
+    }
+
+    if (!create)
+        return NULL;
+
+    par_index.sets = (struct par2_set*)realloc(par_index.sets, sizeof(struct par2_set) * (par_index.sets_length+1));
+    memset(&par_index.sets[par_index.sets_length], 0, sizeof(struct par2_set));
+    memcpy(par_index.sets[par_index.sets_length].set_id, set_id, 16);
+    return &par_index.sets[par_index.sets_length++];
+}
+
+/// @brief the set of the first Main packet we've found (the one of the index .par2).
+/// @param  -
+/// @return the set or NULL
+struct par2_set *par2_default_set(void) {
+    for (unsigned int i = 0; i < par_index.sets_length; i++) {
+        if (par_index.sets[i].slice_size)
+            return &par_index.sets[i];
+    }
+    return NULL;
+}
+
+/// @brief the recovery set of a par2 file on disk: the one of it's first intact packet.
+/// @param path 
+/// @return the set or NULL (no intact packet, or the file can't be read)
+struct par2_set *par2_set_of_file(const char *path) {
+    if (!par2_index_add_file(path))
+        return NULL;
+
+    for (unsigned int i = 0; i < par_index.mappings_length; i++) {
+        struct par2_mapping *mapping = &par_index.mappings[i];
+
+        if (!mapping->path || (strcmp(mapping->path, path) != 0))
             continue;
+        for (uint64_t pos = 0; pos + sizeof(struct par_header) <= mapping->size; pos += 4) {
+            struct par_header header;
+
+            memcpy(&header, &mapping->map[pos], sizeof(struct par_header));
+            if (compare_par2_fields(header.magic_sequence, magic_sequence_check, 8) && (header.packet_length <= mapping->size - pos) &&
+                par2_check_packet(&mapping->map[pos], header.packet_length))
+                return par2_find_set(header.recv_set_id, false);
         }
-        // we have filedescription here, reserve some space:
-        par_filenames = (char**)realloc(par_filenames, sizeof(char*) * (par_filenames_length+1));
-        parname = strndup(&parmem[data_pos+sizeof(struct par_header)+sizeof(struct par_file)], 
-                        header->packet_length-(sizeof(struct par_header)+sizeof(struct par_file)));
-        par_filenames[par_filenames_length] = parname;
-        data_pos += header->packet_length;  // jump to next packet
-        par_filenames_length++; // increase array counter
+        break;
     }
+    return NULL;
+}
+
+/// @brief if a FileDesc name can be opened below the download directory: relative, no "." or ".."
+///        components, no backslashes (windows separators).
+/// @param name
+/// @param length
+/// @return
+bool par2_name_ok(const char *name, size_t length) {
+    size_t start = 0;
 
+    if (!length || (name[0] == '/'))
+        return false;
+    for (size_t i = 0; i <= length; i++) {
+        if ((i < length) && ((name[i] == '\\') || (name[i] == 0)))
+            return false;
+        if ((i < length) && (name[i] != '/'))
+            continue;
+        // a component ends:
+        if ((i == start) || ((i - start == 1) && (name[start] == '.')) || ((i - start == 2) && (name[start] == '.') && (name[start+1] == '.')))
+            return false;
+        start = i + 1;
+    }
     return true;
 }
 
+/// @brief looks up (or adds) a file of the recovery set by its file id. File ids are md5 hashes,
+///        so their first bytes are as good as any hash function.
+/// @param set 
+/// @param file_id the 16 byte file id
+/// @param create add an empty entry if the id is unknown
+/// @return the entry or NULL if not found and !create
+struct par_fileinfo *par2_find_fileinfo(struct par2_set *set, const uint8_t *file_id, bool create) {
+    uint32_t hash, slot;
+
+    if (!set)
+        return NULL;
+
+    memcpy(&hash, file_id, 4);
+    if (set->fileinfo_table_size) {
+        for (slot = hash & (set->fileinfo_table_size - 1); set->fileinfo_table[slot]; slot = (slot + 1) & (set->fileinfo_table_size - 1)) {
+            if (memcmp(set->fileinfos[set->fileinfo_table[slot]-1].file_id, file_id, 16) == 0)
+                return &set->fileinfos[set->fileinfo_table[slot]-1];
+        }
+    }
+
+    if (!create)
+        return NULL;
+
+    // keep the table at most half full:
+    if ((set->fileinfos_length + 1) * 2 > set->fileinfo_table_size) {
+        uint32_t new_size = set->fileinfo_table_size ? set->fileinfo_table_size * 2 : 64;
+        free (set->fileinfo_table);
+        set->fileinfo_table = (uint32_t*)calloc(new_size, sizeof(uint32_t));
+        set->fileinfo_table_size = new_size;
+        for (unsigned int i = 0; i < set->fileinfos_length; i++) {
+            uint32_t h;
+            memcpy(&h, set->fileinfos[i].file_id, 4);
+            for (slot = h & (new_size - 1); set->fileinfo_table[slot]; slot = (slot + 1) & (new_size - 1))
+                ;
+            set->fileinfo_table[slot] = i + 1;
+        }
+    }
+
+    set->fileinfos = (struct par_fileinfo*)realloc(set->fileinfos, sizeof(struct par_fileinfo) * (set->fileinfos_length+1));
+    memset(&set->fileinfos[set->fileinfos_length], 0, sizeof(struct par_fileinfo));
+    memcpy(set->fileinfos[set->fileinfos_length].file_id, file_id, 16);
+    for (slot = hash & (set->fileinfo_table_size - 1); set->fileinfo_table[slot]; slot = (slot + 1) & (set->fileinfo_table_size - 1))
+        ;
+    set->fileinfo_table[slot] = set->fileinfos_length + 1;
+    return &set->fileinfos[set->fileinfos_length++];
+}
+
+/// @brief looks up a file of the recovery set by its (FileDesc) name.
+/// @param set 
+/// @param name 
+/// @return the entry or NULL
+struct par_fileinfo *par2_find_fileinfo_by_name(struct par2_set *set, const char *name) {
+    if (!name || !set)
+        return NULL;
+
+    for (unsigned int i = 0; i < set->fileinfos_length; i++) {
+        if (set->fileinfos[i].name && (strcmp(set->fileinfos[i].name, name) == 0))
+            return &set->fileinfos[i];
+    }
+    return NULL;
+}
+
+/// @brief looks up a file of the recovery set by the md5 of it's first 16k.
+/// @param set 
+/// @param md5_16k 
+/// @return the entry or NULL if not found or more than one file starts w. the same 16k
+struct par_fileinfo *par2_find_fileinfo_by_md5_16k(struct par2_set *set, const uint8_t *md5_16k) {
+    uint32_t hash, slot;
+
+    if (!set)
+        return NULL;
+
+    if (set->md5_16k_dirty) {
+        uint32_t size = 64;
+
+        while (size < set->fileinfos_length * 2)
+            size *= 2;
+        free (set->md5_16k_table);
+        set->md5_16k_table = (uint32_t*)calloc(size, sizeof(uint32_t));
+        set->md5_16k_table_size = size;
+        set->md5_16k_dirty = false;
+
+        for (unsigned int i = 0; i < set->fileinfos_length; i++) {
+            if (!set->fileinfos[i].name)
+                continue;
+            memcpy(&hash, set->fileinfos[i].md5_hash_16k, 4);
+            for (slot = hash & (size - 1); set->md5_16k_table[slot]; slot = (slot + 1) & (size - 1)) {
+                if (memcmp(set->fileinfos[(set->md5_16k_table[slot] & ~PAR2_MD5_16K_AMBIGUOUS)-1].md5_hash_16k, set->fileinfos[i].md5_hash_16k, 16) == 0)
+                    break;
+            }
+            // the same first 16k twice (small or zero-filled files): that's no match for all of them.
+            if (set->md5_16k_table[slot])
+                set->md5_16k_table[slot] |= PAR2_MD5_16K_AMBIGUOUS;
+            else
+                set->md5_16k_table[slot] = i + 1;
+        }
+    }
+
+    if (!set->md5_16k_table_size)
+        return NULL;
+
+    memcpy(&hash, md5_16k, 4);
+    for (slot = hash & (set->md5_16k_table_size - 1); set->md5_16k_table[slot]; slot = (slot + 1) & (set->md5_16k_table_size - 1)) {
+        struct par_fileinfo *info = &set->fileinfos[(set->md5_16k_table[slot] & ~PAR2_MD5_16K_AMBIGUOUS)-1];
+        if (memcmp(info->md5_hash_16k, md5_16k, 16) == 0)
+            return set->md5_16k_table[slot] & PAR2_MD5_16K_AMBIGUOUS ? NULL : info;
+    }
+    return NULL;
+}
+
+/// @brief the first RecoverySlice packet w. that exponent
+/// @param set 
+/// @param exponent 
+/// @return the block or NULL, more of them are chained in ->next_duplicate
+struct par_recovery_block *par2_find_recovery_block(struct par2_set *set, uint32_t exponent) {
+    if (!set || !set->block_by_exponent || (exponent > 0xFFFF) || (set->block_by_exponent[exponent] == -1))
+        return NULL;
+    return &set->blocks[set->block_by_exponent[exponent]];
+}
+
+/// @brief how many slices a file of file_length occupies.
+/// @param set 
+/// @param file_length 
+/// @return the slice count (0 if no Main packet was seen)
+uint32_t par2_slices_of_length(struct par2_set *set, uint64_t file_length) {
+    if (!set || !set->slice_size)
+        return 0;
+    return (uint32_t)((file_length + set->slice_size - 1) / set->slice_size);
+}
+
+/// @brief unmaps/frees the whole index and the filename list.
+/// @param  -
+void par2_index_free(void) {
+    for (unsigned int i = 0; i < par_index.sets_length; i++) {
+        struct par2_set *set = &par_index.sets[i];
+        for (unsigned int f = 0; f < set->fileinfos_length; f++) {
+            free (set->fileinfos[f].name);
+            free (set->fileinfos[f].slices);
+        }
+        free (set->fileinfos);
+        free (set->recovery_ids);
+        free (set->fileinfo_table);
+        free (set->md5_16k_table);
+        free (set->blocks);
+        free (set->block_by_exponent);
+    }
+    free (par_index.sets);
+
+    for (unsigned int i = 0; i < par_index.mappings_length; i++) {
+        if (par_index.mappings[i].is_mmap)
+            munmap(par_index.mappings[i].map, par_index.mappings[i].size);
+        else
+            free (par_index.mappings[i].map);
+        free (par_index.mappings[i].path);
+    }
+    free (par_index.mappings);
+    memset(&par_index, 0, sizeof(struct par2_index));
+
+    for (unsigned int i = 0; i < par_filenames_length; i++)
+        free (par_filenames[i]);
+    free (par_filenames);
+    par_filenames = NULL;
+    par_filenames_length = 0;
+
+    free (par_name_index.slots);
+    free (par_name_index.lengths);
+    memset(&par_name_index, 0, sizeof(struct par2_name_index));
+    memset(&par_name_stats, 0, sizeof(struct par2_name_stats));
+}
+
 /// @brief this is for the sole use to check a string containing a \0
 /// @param parType 
 /// @param typeCheck 
@@ -128,15 +672,250 @@ bool compare_par2_fields(uint8_t *parType, const unsigned char *typeCheck, uint8
     return true;
 }
 
-/// @brief if filename is in our list.
+/// @brief if filename is (or contains) one of the FileDesc names.
 /// @param filename 
 /// @return 
 bool is_par2_list(char* filename) {
-    for (unsigned int i = 0; i < par_filenames_length; i++) {
-        char *fnd = strstr(filename, par_filenames[i]);
-        if (fnd) return true;
-//        if (strcmp(filename, par_filenames[i]) == 0)
-//            return true;
+    size_t length;
+    uint64_t hash = 0, base_power = 1;
+    uint32_t pos = 0;
+
+    if (!filename)
+        return false;
+
+    if (par_name_index.indexed != par_filenames_length)
+        par2_name_index_build();
+    if (!par_name_index.slots_size)
+        return false;
+
+    par_name_stats.lookups++;
+    length = strlen(filename);
+
+    // exact:
+    for (size_t i = 0; i < length; i++)
+        hash = hash * par2_name_hash_base + (uint8_t)filename[i];
+    if (par2_name_index_find(hash, filename, length)) {
+        par_name_stats.exact_hits++;
+        return true;
+    }
+
+    // substring: a window of every distinct name length slides over the filename.
+    for (unsigned int l = 0; l < par_name_index.lengths_length; l++) {
+        uint32_t window = par_name_index.lengths[l];
+
+        if (window >= length)
+            break;  // lengths are sorted, == length was the exact lookup.
+
+        hash = 0;
+        base_power = 1;
+        for (pos = 0; pos < window; pos++) {
+            hash = hash * par2_name_hash_base + (uint8_t)filename[pos];
+            base_power *= par2_name_hash_base;
+        }
+        for (pos = 0; ; pos++) {
+            par_name_stats.windows++;
+            if (par2_name_index_find(hash, &filename[pos], window)) {
+                par_name_stats.substring_hits++;
+                return true;
+            }
+            if (pos + window >= length)
+                break;
+            hash = hash * par2_name_hash_base + (uint8_t)filename[pos + window] - (uint8_t)filename[pos] * base_power;
+        }
     }
     return false;
 }
+
+/// @brief looks up a name (or a part of a filename) in the name index.
+/// @param hash the rolling hash of name[0..length)
+/// @param name not \0 terminated
+/// @param length 
+/// @return par_filenames index + 1, 0 if not found
+uint32_t par2_name_index_find(uint64_t hash, const char *name, size_t length) {
+    for (uint32_t slot = hash & (par_name_index.slots_size - 1); par_name_index.slots[slot].name; slot = (slot + 1) & (par_name_index.slots_size - 1)) {
+        const char *candidate;
+
+        if (par_name_index.slots[slot].hash != hash)
+            continue;
+        par_name_stats.compares++;
+        candidate = par_filenames[par_name_index.slots[slot].name - 1];
+        if ((strlen(candidate) == length) && (memcmp(candidate, name, length) == 0))
+            return par_name_index.slots[slot].name;
+    }
+    return 0;
+}
+
+int par2_compare_lengths(const void *a, const void *b) {
+    uint32_t la = *(uint32_t*)a, lb = *(uint32_t*)b;
+    return la < lb ? -1 : la > lb;
+}
+
+/// @brief (re)builds the hash set over par_filenames, at most half full.
+/// @param  -
+void par2_name_index_build(void) {
+    uint32_t size = 64;
+
+    free (par_name_index.slots);
+    free (par_name_index.lengths);
+    memset(&par_name_index, 0, sizeof(struct par2_name_index));
+    par_name_index.indexed = par_filenames_length;
+    if (!par_filenames_length)
+        return;
+
+    while (size < par_filenames_length * 2)
+        size *= 2;
+    par_name_index.slots = (struct par2_name_slot*)calloc(size, sizeof(struct par2_name_slot));
+    par_name_index.slots_size = size;
+    par_name_index.lengths = (uint32_t*)calloc(par_filenames_length, sizeof(uint32_t));
+
+    for (unsigned int i = 0; i < par_filenames_length; i++) {
+        size_t length = strlen(par_filenames[i]);
+        uint64_t hash = 0;
+        uint32_t slot;
+
+        if (!length)
+            continue;
+        for (size_t c = 0; c < length; c++)
+            hash = hash * par2_name_hash_base + (uint8_t)par_filenames[i][c];
+        if (par2_name_index_find(hash, par_filenames[i], length))
+            continue;   // the same name twice.
+
+        for (slot = hash & (size - 1); par_name_index.slots[slot].name; slot = (slot + 1) & (size - 1))
+            ;
+        par_name_index.slots[slot].hash = hash;
+        par_name_index.slots[slot].name = i + 1;
+        par_name_index.lengths[par_name_index.lengths_length++] = (uint32_t)length;
+    }
+
+    // distinct lengths only:
+    qsort(par_name_index.lengths, par_name_index.lengths_length, sizeof(uint32_t), par2_compare_lengths);
+    {
+        uint32_t distinct = 0;
+        for (uint32_t i = 0; i < par_name_index.lengths_length; i++) {
+            if (!distinct || (par_name_index.lengths[distinct-1] != par_name_index.lengths[i]))
+                par_name_index.lengths[distinct++] = par_name_index.lengths[i];
+        }
+        par_name_index.lengths_length = distinct;
+    }
+}
+
+/// @brief the length of a par2 name w/o ".par2" and ".volNN+MM" (name.vol03+04.par2 -> name).
+/// @param name 
+/// @return 0 if it's no .par2 name
+size_t par2_name_base(const char *name) {
+    size_t length = name ? strlen(name) : 0;
+    const char *vol;
+
+    if ((length < 5) || (strcasecmp(&name[length-5], ".par2") != 0))
+        return 0;
+    length -= 5;
+    for (vol = &name[length]; (vol > name) && (isdigit((unsigned char)vol[-1]) || (vol[-1] == '+')); vol--)
+        ;
+    if ((vol < &name[length]) && (vol - name >= 4) && (strncasecmp(vol - 4, ".vol", 4) == 0))
+        length = vol - 4 - name;
+    return length;
+}
+
+/// @brief the name base of a set's par2 files, from the ones on disk (index or volume) that belong to it.
+/// @param set 
+/// @param base out: points into the path of the file, valid until par2_index_free()
+/// @return the length of the base, 0 if no file of the set is known
+size_t par2_set_name_base(struct par2_set *set, const char **base) {
+    for (unsigned int i = 0; i < par_index.mappings_length; i++) {
+        const char *path = par_index.mappings[i].path, *name;
+        size_t length;
+
+        if (!path || (par2_set_of_file(path) != set))
+            continue;
+        name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+        if ((length = par2_name_base(name)) != 0) {
+            *base = name;
+            return length;
+        }
+    }
+    return 0;
+}
+
+/// @brief marks the cheapest (by size) set of not yet fetched vol-files holding at least blocks_needed recovery blocks plus a margin.
+/// @param blocks_needed the missing blocks (from par2 verify or the damage map)
+/// @param margin_pct extra blocks in percent (at least 1), for vol-files that are damaged themselves.
+/// @param base only the vol-files of this name base (par2_set_name_base), NULL = any. If no vol-file
+///        of the nzb has it (renamed, obfuscated), any is taken too.
+/// @param base_length 
+/// @return the number of blocks selected, 0 if there's nothing left to select.
+uint32_t par2_select_recovery_volumes(uint32_t blocks_needed, unsigned int margin_pct, const char *base, size_t base_length) {
+    extern struct NZB nzb_tree;
+    struct NZBFile **candidates = NULL;
+    unsigned int candidates_length = 0;
+    uint64_t *cost = NULL;
+    uint32_t target, available = 0, rv = 0;
+    bool base_known = false;
+
+    for (unsigned int i = 0; base && (i < nzb_tree.max_files) && !base_known; i++) {
+        struct NZBFile *file = &nzb_tree.files[i];
+        base_known = file->is_par_vol_file && (par2_name_base(file->filename) == base_length) && (strncmp(file->filename, base, base_length) == 0);
+    }
+
+    for (unsigned int i = 0; i < nzb_tree.max_files; i++) {
+        struct NZBFile *file = &nzb_tree.files[i];
+        if (!file->is_par_vol_file || file->recovery_wanted || (file->state == NFState_Done) || !file->par_vol_blocks)
+            continue;
+        if (base_known && ((par2_name_base(file->filename) != base_length) || (strncmp(file->filename, base, base_length) != 0)))
+            continue;   // a vol-file of another set.
+        candidates = (struct NZBFile**)realloc(candidates, sizeof(struct NZBFile*) * (candidates_length+1));
+        candidates[candidates_length++] = file;
+        available += file->par_vol_blocks;
+    }
+
+    if (!candidates_length)
+        return 0;
+
+    target = blocks_needed + (blocks_needed * margin_pct + 99) / 100;
+    if (target == blocks_needed)
+        target++;
+
+    if (available <= target) {
+        // everything we have isn't more than we need.
+        for (unsigned int i = 0; i < candidates_length; i++)
+            candidates[i]->recovery_wanted = true;
+        free (candidates);
+        return available;
+    }
+
+    // 0/1 knapsack (cover): cost[i][b] = fewest bytes using the first i files for min(blocks, target) == b
+    cost = (uint64_t*)malloc(sizeof(uint64_t) * (candidates_length+1) * (target+1));
+    for (uint32_t b = 0; b <= target; b++)
+        cost[b] = b ? UINT64_MAX : 0;
+
+    for (unsigned int i = 0; i < candidates_length; i++) {
+        uint64_t *prev = &cost[(size_t)i * (target+1)], *next = &cost[(size_t)(i+1) * (target+1)];
+
+        memcpy(next, prev, sizeof(uint64_t) * (target+1));
+        for (uint32_t b = 0; b <= target; b++) {
+            uint32_t to = target - b > candidates[i]->par_vol_blocks ? b + candidates[i]->par_vol_blocks : target;
+            if ((prev[b] != UINT64_MAX) && (prev[b] + candidates[i]->file_size < next[to]))
+                next[to] = prev[b] + candidates[i]->file_size;
+        }
+    }
+
+    // walk back from the target, every cost change is a taken file:
+    for (unsigned int i = candidates_length, b = target; i-- > 0; ) {
+        uint64_t *prev = &cost[(size_t)i * (target+1)], *next = &cost[(size_t)(i+1) * (target+1)];
+
+        if (next[b] == prev[b])
+            continue;
+        candidates[i]->recovery_wanted = true;
+        rv += candidates[i]->par_vol_blocks;
+        for (uint32_t p = 0; p <= b; p++) {
+            uint32_t to = target - p > candidates[i]->par_vol_blocks ? p + candidates[i]->par_vol_blocks : target;
+            if ((to == b) && (prev[p] != UINT64_MAX) && (prev[p] + candidates[i]->file_size == next[b])) {
+                b = p;
+                break;
+            }
+        }
+    }
+
+    free (cost);
+    free (candidates);
+    return rv;
+}
@@ -19,11 +19,116 @@ struct par_file {
     uint64_t    file_length;
 };
 
+// Input File Slice Checksum entry, one per slice.
+struct par_slice_checksum {
+    uint8_t     md5_hash[16];
+    uint32_t    crc32;
+};
+
+// everything we know about one file of the recovery set:
+struct par_fileinfo {
+    uint8_t     file_id[16];
+    uint8_t     md5_hash_file[16];
+    uint8_t     md5_hash_16k[16];
+    uint64_t    file_length;
+    char        *name;              // NULL if no FileDesc packet was found (yet)
+    bool        name_ok;            // a relative path w/o "..", safe to open below the download directory
+    bool        in_recovery_set;    // listed in the Main packet's recovery set
+    uint32_t    slice_count;        // number of slices in *slices (IFSC)
+    struct par_slice_checksum *slices;  // NULL if no IFSC packet was found
+};
+
+// a RecoverySlice packet, still in the mmap()ed volume
+struct par_recovery_block {
+    uint32_t    exponent;
+    const uint8_t *packet;          // the whole packet, the data starts at +68
+    uint64_t    packet_length;
+    int8_t      checked;            // packet md5: 0 = not checked yet, 1 = ok, -1 = broken
+    int32_t     next_duplicate;     // the same exponent in another volume, -1 = none
+};
+
+#define PAR2_MD5_16K_AMBIGUOUS  0x80000000U
+
+// everything w. the same Recovery Set ID:
+struct par2_set {
+    uint8_t     set_id[16];
+    uint64_t    slice_size;         // 0 until the Main packet was found
+    uint8_t     *recovery_ids;      // the Main packet's file ids, in it's order (= the slice order), 16 bytes each
+    uint32_t    recovery_ids_length;
+    struct par_fileinfo *fileinfos;
+    unsigned int fileinfos_length;
+    uint32_t    *fileinfo_table;    // file id -> fileinfos index + 1, open addressing
+    uint32_t    fileinfo_table_size;
+    struct par_recovery_block *blocks;
+    uint32_t    blocks_length;
+    int32_t     *block_by_exponent; // exponent -> first block w. that exponent, -1 = none
+    uint32_t    distinct_blocks;
+    uint32_t    *md5_16k_table;     // md5_16k -> fileinfos index + 1, | PAR2_MD5_16K_AMBIGUOUS if not unique
+    uint32_t    md5_16k_table_size;
+    bool        md5_16k_dirty;      // a FileDesc was added since the table was built
+};
+
+// a file (or memory) that's part of the index, the packets point into it.
+struct par2_mapping {
+    char        *path;              // NULL for memory
+    uint8_t     *map;
+    uint64_t    size;
+    bool        is_mmap;            // munmap vs. free
+};
+
+struct par2_index {
+    struct par2_set     *sets;
+    unsigned int        sets_length;
+    struct par2_mapping *mappings;
+    unsigned int        mappings_length;
+};
+
+// the FileDesc names, hashed for is_par2_list(): exact matches are one lookup, substrings
+// (obfuscated NZB subjects) one rolling hash per distinct name length.
+struct par2_name_slot {
+    uint64_t    hash;
+    uint32_t    name;               // par_filenames index + 1, 0 = empty
+};
+
+struct par2_name_index {
+    struct par2_name_slot *slots;
+    uint32_t    slots_size;
+    uint32_t    *lengths;           // distinct name lengths, ascending
+    uint32_t    lengths_length;
+    unsigned int indexed;           // par_filenames_length when it was built
+};
+
+struct par2_name_stats {
+    uint64_t    lookups;
+    uint64_t    exact_hits;
+    uint64_t    substring_hits;
+    uint64_t    windows;            // rolling hash positions looked up
+    uint64_t    compares;           // strcmp/memcmp on hash hits
+};
+
+extern struct par2_name_stats par_name_stats;
 extern unsigned int par_filenames_length;
 extern char **par_filenames;
+extern struct par2_index par_index;
 
 bool get_par2_filenames(struct NZBFile *filename, bool *isMain);
 bool get_par2_filenames_from_memory(char *parmem, size_t parmemsize, bool *isMain);
 bool compare_par2_fields(uint8_t *parType, const unsigned char *typeCheck, uint8_t len);
 bool is_par2_list(char* filename);
-#endif
\ No newline at end of file
+bool par2_index_add_file(const char *path);
+bool par2_index_add_memory(uint8_t *mem, uint64_t size, bool take_ownership, bool *isMain);
+void par2_index_free(void);
+struct par2_set *par2_find_set(const uint8_t *set_id, bool create);
+struct par2_set *par2_default_set(void);
+struct par2_set *par2_set_of_file(const char *path);
+struct par_fileinfo *par2_find_fileinfo(struct par2_set *set, const uint8_t *file_id, bool create);
+struct par_fileinfo *par2_find_fileinfo_by_name(struct par2_set *set, const char *name);
+struct par_fileinfo *par2_find_fileinfo_by_md5_16k(struct par2_set *set, const uint8_t *md5_16k);
+struct par_recovery_block *par2_find_recovery_block(struct par2_set *set, uint32_t exponent);
+bool par2_check_packet(const uint8_t *packet, uint64_t packet_length);
+bool par2_name_ok(const char *name, size_t length);
+uint32_t par2_slices_of_length(struct par2_set *set, uint64_t file_length);
+size_t par2_name_base(const char *name);
+size_t par2_set_name_base(struct par2_set *set, const char **base);
+uint32_t par2_select_recovery_volumes(uint32_t blocks_needed, unsigned int margin_pct, const char *base, size_t base_length);
+#endif
@@ -0,0 +1,302 @@
+/*
+ * Batch prefetch: while a nzb downloads, the next one of the batch is parsed (a light parse, just
+ * the message ids of it's first segments). The connections that have nothing left to do in the
+ * tail of the current nzb fetch them (see mw_prefetch_tail), and the download of the next nzb
+ * takes the replies instead of requesting them again (see mw_get_binary_from_article).
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "prefetch.h"
+#include "xmlhandler.h"
+
+// the light parse of the next nzb:
+struct prefetch_parse {
+    XML_Parser              parser;
+    struct prefetch_article *par2, *content;    // the .par2 files (not the vol-files) go first
+    unsigned int            par2_length, content_length;
+    bool                    file_par2, file_vol;
+    bool                    in_segment;
+    unsigned int            segment_bytes;
+    char                    *id;
+    size_t                  id_length;
+    uint64_t                bytes;              // of the segments taken
+    uint64_t                budget;
+    unsigned int            generation;
+};
+
+// non "exported" functions:
+void *prefetch_parse_work(void *arg);
+void prefetch_parse_start_element(void *userData, const char *name, const char **attribs);
+void prefetch_parse_end_element(void *userData, const char *name);
+void prefetch_parse_text_data(void *userData, const XML_Char *s, int len);
+void prefetch_free_article(struct prefetch_article *article);
+
+// local variables:
+pthread_mutex_t         prefetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_t               prefetch_thread;
+bool                    prefetch_thread_running = false;
+struct prefetch_article *prefetch_articles = NULL;
+unsigned int            prefetch_articles_length = 0;
+unsigned int            prefetch_next = 0;          // the next one to fetch
+unsigned int            prefetch_generation = 0;
+bool                    prefetch_parsed = false;    // the ids of the next nzb are there
+uint64_t                prefetch_bytes = 0;         // of the replies kept
+uint64_t                prefetch_budget = 0;
+const size_t            prefetch_chunk_size = 65536;
+
+/// @brief before a nzb of the batch is downloaded: what was fetched for it is kept, everything else
+///        is dropped, and the one after it is parsed in the background. prefetchmb="N" is the
+///        memory for the replies (default 64), 0 = no prefetch.
+/// @param filename the nzb after the one that's downloaded now, NULL = none
+/// @return true if the parse was started.
+bool prefetch_start(const char *filename) {
+    unsigned int kept = 0;
+    char *path;
+
+    if (prefetch_thread_running)
+        pthread_join(prefetch_thread, NULL);
+    prefetch_thread_running = false;
+
+    pthread_mutex_lock(&prefetch_mutex);
+    prefetch_generation++;
+    for (unsigned int i = 0; i < prefetch_articles_length; i++) {
+        struct prefetch_article *article = &prefetch_articles[i];
+
+        if (article->response && (article->generation == prefetch_generation - 1))
+            prefetch_articles[kept++] = *article;
+        else {
+            prefetch_bytes -= article->response ? article->length : 0;
+            prefetch_free_article(article);
+        }
+    }
+    prefetch_articles_length = kept;
+    prefetch_next = kept;
+    prefetch_parsed = false;
+    prefetch_budget = 64;
+    if (pair_find(config_downloads, "prefetchmb"))
+        prefetch_budget = atoi(pair_find(config_downloads, "prefetchmb"));
+    prefetch_budget *= 1024 * 1024;
+    pthread_mutex_unlock(&prefetch_mutex);
+
+    if (!filename || !prefetch_budget)
+        return false;
+    path = strdup(filename);
+    if (pthread_create(&prefetch_thread, NULL, prefetch_parse_work, path) != 0) {
+        LOG_MESSAGE(false, "Couldn't start the prefetch parser for %s.", filename);
+        free (path);
+        return false;
+    }
+    prefetch_thread_running = true;
+    return true;
+}
+
+/// @brief fetches the next article of the next nzb, if it still fits.
+/// @param connection an idle one
+/// @return false if there's nothing (left) to fetch, or the server didn't deliver.
+bool prefetch_fetch(struct nntp_server *connection) {
+    char *article, *response = NULL;
+    unsigned int index;
+    bool rv;
+
+    pthread_mutex_lock(&prefetch_mutex);
+    if (!prefetch_parsed || (prefetch_next >= prefetch_articles_length) || (prefetch_bytes >= prefetch_budget)) {
+        pthread_mutex_unlock(&prefetch_mutex);
+        return false;
+    }
+    index = prefetch_next++;
+    article = prefetch_articles[index].article;     // the string doesn't move, the array might
+    pthread_mutex_unlock(&prefetch_mutex);
+
+    rv = nntp_get_article(connection, article, &response);
+    LOG_MESSAGE(false, "%d thread %s %s for the next nzb.", connection->connectionID, rv ? "prefetched" : "failed to prefetch", article);
+
+    pthread_mutex_lock(&prefetch_mutex);
+    if (rv) {
+        prefetch_articles[index].response = response;
+        prefetch_articles[index].length = strlen(response);
+        prefetch_bytes += prefetch_articles[index].length;
+    }
+    pthread_mutex_unlock(&prefetch_mutex);
+    return rv;
+}
+
+/// @brief hands a prefetched reply over (it's the callers to free then).
+/// @param article the message id
+/// @param response out: the reply, as nntp_get_article() would have returned it
+/// @return false if it wasn't prefetched.
+bool prefetch_take(const char *article, char **response) {
+    size_t length;
+    bool rv = false;
+
+    // the nzb's ids may carry the whitespace around them:
+    while (isspace((unsigned char)*article))
+        article++;
+    for (length = strlen(article); (length > 0) && isspace((unsigned char)article[length - 1]); length--)
+        ;
+
+    pthread_mutex_lock(&prefetch_mutex);
+    for (unsigned int i = 0; prefetch_bytes && (i < prefetch_articles_length) && !rv; i++) {
+        struct prefetch_article *entry = &prefetch_articles[i];
+
+        if (entry->response && (strncmp(entry->article, article, length) == 0) && !entry->article[length]) {
+            *response = entry->response;
+            entry->response = NULL;
+            prefetch_bytes -= entry->length;
+            rv = true;
+        }
+    }
+    pthread_mutex_unlock(&prefetch_mutex);
+    return rv;
+}
+
+/// @brief waits for a running parse and drops everything.
+/// @param
+void prefetch_reset(void) {
+    if (prefetch_thread_running)
+        pthread_join(prefetch_thread, NULL);
+    prefetch_thread_running = false;
+
+    pthread_mutex_lock(&prefetch_mutex);
+    for (unsigned int i = 0; i < prefetch_articles_length; i++)
+        prefetch_free_article(&prefetch_articles[i]);
+    free (prefetch_articles);
+    prefetch_articles = NULL;
+    prefetch_articles_length = 0;
+    prefetch_next = 0;
+    prefetch_bytes = 0;
+    prefetch_parsed = false;
+    pthread_mutex_unlock(&prefetch_mutex);
+}
+
+void prefetch_free_article(struct prefetch_article *article) {
+    free (article->article);
+    free (article->response);
+    article->article = NULL;
+    article->response = NULL;
+}
+
+/// @brief the parser thread: collects the ids until the budget is reached, then publishes them.
+/// @param arg the path of the nzb (it's to free)
+/// @return NULL
+void *prefetch_parse_work(void *arg) {
+    char *filename = (char*)arg;
+    struct prefetch_parse data = { 0 };
+    int fd = open(filename, O_RDONLY);
+
+    pthread_mutex_lock(&prefetch_mutex);
+    data.budget = prefetch_budget;
+    data.generation = prefetch_generation;
+    pthread_mutex_unlock(&prefetch_mutex);
+
+    data.parser = fd != -1 ? XML_ParserCreate(NULL) : NULL;
+    if (!data.parser) {
+        LOG_MESSAGE(false, "Couldn't prefetch %s, Error: %s (%i)", filename, strerror(errno), errno);
+        if (fd != -1)
+            close (fd);
+        free (filename);
+        return NULL;
+    }
+    XML_SetElementHandler(data.parser, prefetch_parse_start_element, prefetch_parse_end_element);
+    XML_SetCharacterDataHandler(data.parser, prefetch_parse_text_data);
+    XML_SetUserData(data.parser, &data);
+
+    for (;;) {
+        void *buffer = XML_GetBuffer(data.parser, prefetch_chunk_size);
+        ssize_t length;
+
+        if (!buffer)
+            break;
+        length = read(fd, buffer, prefetch_chunk_size);
+        if ((length < 0) && (errno == EINTR))
+            continue;
+        // stopped at the budget, or broken (the download of it will tell):
+        if ((length < 0) || (XML_ParseBuffer(data.parser, length, length == 0) == XML_STATUS_ERROR) || !length)
+            break;
+    }
+    XML_ParserFree(data.parser);
+    close (fd);
+    free (data.id);
+
+    pthread_mutex_lock(&prefetch_mutex);
+    prefetch_articles = (struct prefetch_article*)realloc(prefetch_articles, sizeof(struct prefetch_article) * (prefetch_articles_length + data.par2_length + data.content_length + 1));
+    for (unsigned int i = 0; i < data.par2_length; i++)
+        prefetch_articles[prefetch_articles_length++] = data.par2[i];
+    for (unsigned int i = 0; i < data.content_length; i++)
+        prefetch_articles[prefetch_articles_length++] = data.content[i];
+    prefetch_parsed = true;
+    pthread_mutex_unlock(&prefetch_mutex);
+
+    LOG_MESSAGE(false, "Prefetch: %u articles (%lu bytes) of %s.", data.par2_length + data.content_length, data.bytes, filename);
+    free (data.par2);
+    free (data.content);
+    free (filename);
+    return NULL;
+}
+
+void prefetch_parse_start_element(void *userData, const char *name, const char **attribs) {
+    struct prefetch_parse *data = (struct prefetch_parse*)userData;
+
+    if (strcmp(name, "file") == 0) {
+        data->file_par2 = data->file_vol = false;
+        for (int i = 0; attribs[i]; i += 2) {
+            if (strcasecmp(attribs[i], "subject") == 0) {
+                char *subject = strdup(attribs[i+1]);
+
+                for (char *c = subject; *c; c++)
+                    *c = tolower((unsigned char)*c);
+                data->file_par2 = strstr(subject, ".par2") != NULL;
+                data->file_vol = data->file_par2 && (strstr(subject, ".vol") != NULL);
+                free (subject);
+            }
+        }
+    } else if ((strcmp(name, "segment") == 0) && !data->file_vol) {
+        // the vol-files may not be needed at all (-k), they're left for the download:
+        data->segment_bytes = 0;
+        for (int i = 0; attribs[i]; i += 2) {
+            if (strcasecmp(attribs[i], "bytes") == 0)
+                data->segment_bytes = (unsigned int)strtoul(attribs[i+1], NULL, 10);
+        }
+        data->in_segment = data->segment_bytes > 0;
+        data->id_length = 0;
+    }
+}
+
+void prefetch_parse_end_element(void *userData, const char *name) {
+    struct prefetch_parse *data = (struct prefetch_parse*)userData;
+    struct prefetch_article **list = data->file_par2 ? &data->par2 : &data->content;
+    unsigned int *list_length = data->file_par2 ? &data->par2_length : &data->content_length;
+    size_t start = 0, end = data->id_length;
+
+    if ((strcmp(name, "segment") != 0) || !data->in_segment)
+        return;
+    data->in_segment = false;
+    while ((start < end) && isspace((unsigned char)data->id[start]))
+        start++;
+    while ((end > start) && isspace((unsigned char)data->id[end - 1]))
+        end--;
+    if (start == end)
+        return;
+
+    *list = (struct prefetch_article*)realloc(*list, sizeof(struct prefetch_article) * (*list_length + 1));
+    (*list)[(*list_length)++] = (struct prefetch_article){ .article = strndup(&data->id[start], end - start), .generation = data->generation };
+    data->bytes += data->segment_bytes;
+    if (data->bytes >= data->budget)
+        XML_StopParser(data->parser, false);
+}
+
+void prefetch_parse_text_data(void *userData, const XML_Char *s, int len) {
+    struct prefetch_parse *data = (struct prefetch_parse*)userData;
+
+    if (!data->in_segment)
+        return;
+    data->id = (char*)realloc(data->id, data->id_length + len + 1);
+    memcpy(&data->id[data->id_length], s, len);
+    data->id_length += len;
+    data->id[data->id_length] = 0;
+}
@@ -0,0 +1,22 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "nntp.h"
+
+// Batch prefetch: the next nzb of the batch is parsed in the background while the current one
+// downloads. The connections that run out of segments in it's tail fetch the next one's first
+// articles meanwhile, they're handed to it's download instead of requesting them again.
+struct prefetch_article {
+    char            *article;       // the message id
+    char            *response;      // the server's reply (see nntp_get_article), NULL = not fetched
+    size_t          length;
+    unsigned int    generation;     // the nzb it belongs to, see prefetch_start
+};
+
+bool prefetch_start(const char *filename);
+bool prefetch_fetch(struct nntp_server *connection);
+bool prefetch_take(const char *article, char **response);
+void prefetch_reset(void);
+#endif
@@ -0,0 +1,922 @@
+/*
+ * Direct unpack of store-mode RAR sets (RAR4 and RAR5): the headers in the first segment of
+ * every volume tell where it's data goes in the inner file, the workers write it there as it's
+ * decoded. The joined volumes are checked once more after the download and stay for par2.
+ * The same headers group the volumes on disk into sets for unrar (rarstore_scan).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <rapidyenc.h>
+#include "mindweaver.h"
+#include "rarstore.h"
+
+// non "exported" functions:
+uint16_t rarstore_le16(const uint8_t *data);
+uint32_t rarstore_le32(const uint8_t *data);
+bool rarstore_vint(const uint8_t *data, size_t length, size_t *pos, uint64_t *value);
+bool rarstore_name_ok(const char *name, size_t length);
+int rarstore_block4(const uint8_t *data, size_t length, uint64_t *block_size, struct rarstore_entry *entry);
+int rarstore_block5(const uint8_t *data, size_t length, uint64_t *block_size, struct rarstore_entry *entry);
+bool rarstore_check_volume(char *path, struct rarstore_entry *expected);
+struct rarstore_set *rarstore_set_of(struct NZBFile *file, char *name, unsigned int *number);
+struct rarstore_volume *rarstore_volume_of(struct NZBFile *file, struct rarstore_set **set, unsigned int *v);
+void rarstore_place(struct rarstore_set *set);
+bool rarstore_write(struct rarstore_set *set, unsigned int v, struct NZBSegment *seg, const uint8_t *data);
+void rarstore_replay(struct rarstore_set *set, unsigned int v);
+void rarstore_fail(struct rarstore_set *set, const char *reason);
+uint8_t *rarstore_segment_state(struct NZBSegment *seg);
+bool rarstore_field5(const uint8_t *data, size_t length, uint64_t *type, uint64_t *field);
+bool rarstore_scan_headers(const char *path, struct rarstore_scan_volume *info);
+int rarstore_scan_compare(const void *a, const void *b);
+bool rarstore_scan_same_set(struct rarstore_scan_volume *a, struct rarstore_scan_volume *b);
+
+// local variables:
+pthread_mutex_t     rarstore_lock = PTHREAD_MUTEX_INITIALIZER;
+bool                rarstore_enabled = false;
+struct rarstore_set **rarstore_sets = NULL;     // the sets stay where they are while a worker writes unlocked
+unsigned int        rarstore_sets_length = 0;
+uint8_t             *rarstore_states = NULL;        // RarStore_Segment_State, by index in nzb_tree.segment_arena
+uint64_t            rarstore_states_length = 0;
+
+uint16_t rarstore_le16(const uint8_t *data) {
+    return (uint16_t)(data[0] | (data[1] << 8));
+}
+
+uint32_t rarstore_le32(const uint8_t *data) {
+    return (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+/// @brief reads a RAR5 variable length integer (7 bits per byte, the high bit = more).
+/// @param data
+/// @param length
+/// @param pos in: where it starts, out: behind it
+/// @param value
+/// @return false if it doesn't end within length
+bool rarstore_vint(const uint8_t *data, size_t length, size_t *pos, uint64_t *value) {
+    *value = 0;
+    for (unsigned int shift = 0; (*pos < length) && (shift < 64); shift += 7) {
+        uint8_t byte = data[(*pos)++];
+
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+/// @brief only plain names are written directly, no paths.
+/// @param name
+/// @param length
+/// @return
+bool rarstore_name_ok(const char *name, size_t length) {
+    if (!length || ((length == 1) && (name[0] == '.')) || ((length == 2) && (name[0] == '.') && (name[1] == '.')))
+        return false;
+    for (size_t i = 0; i < length; i++) {
+        if ((name[i] == '/') || (name[i] == '\\') || (name[i] == 0))
+            return false;
+    }
+    return true;
+}
+
+/// @brief parses one RAR4 block.
+/// @param data the start of the block
+/// @param length what's there of it
+/// @param block_size the header & data size, the next block starts there
+/// @param entry filled for a file block, data_start is relative to the block
+/// @return one of RarStore_Block
+int rarstore_block4(const uint8_t *data, size_t length, uint64_t *block_size, struct rarstore_entry *entry) {
+    uint16_t flags, head_size, name_size;
+    size_t pos = 32;
+    uint64_t add_size = 0, pack_size, unpacked_size;
+
+    if (length < 7)
+        return RarStoreBlock_Truncated;
+    flags = rarstore_le16(&data[3]);
+    head_size = rarstore_le16(&data[5]);
+    if (head_size < 7)
+        return RarStoreBlock_Bad;
+    if (length < head_size)
+        return RarStoreBlock_Truncated;
+    if ((rapidyenc_crc(&data[2], head_size - 2, 0) & 0xffff) != rarstore_le16(data))
+        return RarStoreBlock_Bad;
+    if ((flags & 0x8000) && (head_size >= 11))
+        add_size = rarstore_le32(&data[7]);
+
+    switch (data[2]) {
+        case 0x73:  // main header
+            *block_size = head_size;
+            return (flags & 0x0080) ? RarStoreBlock_Encrypted : RarStoreBlock_Other;    // encrypted headers
+        case 0x74:  // file header
+            if (head_size < 32)
+                return RarStoreBlock_Bad;
+            pack_size = rarstore_le32(&data[7]);
+            unpacked_size = rarstore_le32(&data[11]);
+            name_size = rarstore_le16(&data[26]);
+            if (flags & 0x0100) {   // 64 bit sizes
+                if (head_size < 40)
+                    return RarStoreBlock_Bad;
+                pack_size |= (uint64_t)rarstore_le32(&data[32]) << 32;
+                unpacked_size |= (uint64_t)rarstore_le32(&data[36]) << 32;
+                pos = 40;
+            }
+            if (pos + name_size > head_size)
+                return RarStoreBlock_Bad;
+            *block_size = head_size + pack_size;
+            if (flags & 0x0004)
+                return RarStoreBlock_Encrypted;
+            // a directory or not stored:
+            if (((flags & 0x00e0) == 0x00e0) || (data[25] != 0x30))
+                return RarStoreBlock_Unsupported;
+            // a unicode name follows the ascii one after a \0:
+            if (flags & 0x0200)
+                name_size = strnlen((const char*)&data[pos], name_size);
+            if (!rarstore_name_ok((const char*)&data[pos], name_size))
+                return RarStoreBlock_Unsupported;
+            entry->name = strndup((const char*)&data[pos], name_size);
+            entry->unpacked_size = unpacked_size;
+            entry->data_start = head_size;
+            entry->data_size = pack_size;
+            entry->split_before = flags & 0x0001;
+            entry->split_after = flags & 0x0002;
+            return RarStoreBlock_File;
+        case 0x7b:  // end of archive
+            *block_size = head_size;
+            return RarStoreBlock_End;
+    }
+    *block_size = head_size + add_size;
+    return RarStoreBlock_Other;
+}
+
+/// @brief parses one RAR5 block, see rarstore_block4.
+/// @param data
+/// @param length
+/// @param block_size
+/// @param entry
+/// @return one of RarStore_Block
+int rarstore_block5(const uint8_t *data, size_t length, uint64_t *block_size, struct rarstore_entry *entry) {
+    size_t pos = 4, end, name_pos;
+    uint64_t head_size, type, head_flags, extra_size = 0, data_size = 0;
+    uint64_t file_flags, unpacked_size, attributes, compression, host_os, name_length;
+
+    if (!rarstore_vint(data, length, &pos, &head_size))
+        return (length < 4 + 3) ? RarStoreBlock_Truncated : RarStoreBlock_Bad;
+    if (!head_size || (head_size > 2 * 1024 * 1024))
+        return RarStoreBlock_Bad;
+    if (length < pos + head_size)
+        return RarStoreBlock_Truncated;
+    end = pos + head_size;
+    if (rapidyenc_crc(&data[4], end - 4, 0) != rarstore_le32(data))
+        return RarStoreBlock_Bad;
+
+    if (!rarstore_vint(data, end, &pos, &type) || !rarstore_vint(data, end, &pos, &head_flags))
+        return RarStoreBlock_Bad;
+    if ((head_flags & 0x0001) && !rarstore_vint(data, end, &pos, &extra_size))
+        return RarStoreBlock_Bad;
+    if ((head_flags & 0x0002) && !rarstore_vint(data, end, &pos, &data_size))
+        return RarStoreBlock_Bad;
+    if (extra_size > end - pos)
+        return RarStoreBlock_Bad;
+    *block_size = end + data_size;
+
+    switch (type) {
+        case 4:     // archive encryption, every header after it is encrypted
+            return RarStoreBlock_Encrypted;
+        case 5:     // end of archive
+            return RarStoreBlock_End;
+        case 2:     // file header
+            if (!rarstore_vint(data, end, &pos, &file_flags) || !rarstore_vint(data, end, &pos, &unpacked_size) ||
+                !rarstore_vint(data, end, &pos, &attributes))
+                return RarStoreBlock_Bad;
+            pos += (file_flags & 0x0002) ? 4 : 0;     // mtime
+            pos += (file_flags & 0x0004) ? 4 : 0;     // data crc32
+            if (!rarstore_vint(data, end, &pos, &compression) || !rarstore_vint(data, end, &pos, &host_os) ||
+                !rarstore_vint(data, end, &pos, &name_length) || (pos + name_length > end - extra_size))
+                return RarStoreBlock_Bad;
+            name_pos = pos;
+
+            // the extra area: any encryption record ?
+            for (pos = end - extra_size; pos < end; ) {
+                uint64_t record_size, record_type;
+                size_t record_start;
+
+                if (!rarstore_vint(data, end, &pos, &record_size))
+                    return RarStoreBlock_Bad;
+                record_start = pos;
+                if (!rarstore_vint(data, end, &pos, &record_type) || (record_size > end - record_start))
+                    return RarStoreBlock_Bad;
+                if (record_type == 0x01)
+                    return RarStoreBlock_Encrypted;
+                pos = record_start + record_size;
+            }
+            // a directory, the size is unknown or it's not stored:
+            if ((file_flags & 0x0001) || (file_flags & 0x0008) || ((compression >> 7) & 0x07))
+                return RarStoreBlock_Unsupported;
+            if (!rarstore_name_ok((const char*)&data[name_pos], name_length))
+                return RarStoreBlock_Unsupported;
+
+            entry->name = strndup((const char*)&data[name_pos], name_length);
+            entry->unpacked_size = unpacked_size;
+            entry->data_start = end;
+            entry->data_size = data_size;
+            entry->split_before = head_flags & 0x0008;
+            entry->split_after = head_flags & 0x0010;
+            return RarStoreBlock_File;
+    }
+    return RarStoreBlock_Other;
+}
+
+/// @brief finds the first file block of a volume, from the start of it (the first segment).
+/// @param data
+/// @param length
+/// @param entry it's name has to be freed.
+/// @return RarStoreBlock_File if found, data_start is relative to the volume then.
+int rarstore_parse_volume(const uint8_t *data, size_t length, struct rarstore_entry *entry) {
+    int (*block)(const uint8_t*, size_t, uint64_t*, struct rarstore_entry*);
+    uint64_t pos, block_size;
+
+    if ((length >= 8) && (memcmp(data, RARSTORE_RAR5_SIGNATURE, 8) == 0)) {
+        block = rarstore_block5;
+        pos = 8;
+    } else if ((length >= 7) && (memcmp(data, RARSTORE_RAR4_SIGNATURE, 7) == 0)) {
+        block = rarstore_block4;
+        pos = 7;
+    } else
+        return RarStoreBlock_Bad;
+
+    memset(entry, 0, sizeof(struct rarstore_entry));
+    while (pos < length) {
+        int rc = block(&data[pos], length - pos, &block_size, entry);
+
+        if (rc == RarStoreBlock_File) {
+            entry->data_start += pos;
+            return rc;
+        }
+        if (rc != RarStoreBlock_Other)
+            return rc == RarStoreBlock_End ? RarStoreBlock_Unsupported : rc;
+        pos += block_size;
+    }
+    return RarStoreBlock_Truncated;
+}
+
+/// @brief walks every header of a joined volume: it has to carry exactly the file block we used.
+/// @param path
+/// @param expected
+/// @return
+bool rarstore_check_volume(char *path, struct rarstore_entry *expected) {
+    int (*block)(const uint8_t*, size_t, uint64_t*, struct rarstore_entry*) = NULL;
+    uint8_t *buffer = (uint8_t*)malloc(RARSTORE_HEADER_READ);
+    unsigned int files = 0;
+    uint64_t pos = 0, block_size;
+    bool rv = false;
+    int fd = open(path, O_RDONLY);
+
+    if (fd == -1) {
+        LOG_MESSAGE(false, "Couldn't open %s, errno %i (%s)", path, errno, strerror(errno));
+        free (buffer);
+        return false;
+    }
+
+    for (;;) {
+        struct rarstore_entry entry = { 0 };
+        ssize_t length = pread(fd, buffer, RARSTORE_HEADER_READ, pos);
+        int rc;
+
+        if (length <= 0) {
+            rv = false;
+            break;
+        }
+        if (!block) {
+            if ((length >= 8) && (memcmp(buffer, RARSTORE_RAR5_SIGNATURE, 8) == 0)) {
+                block = rarstore_block5;
+                pos = 8;
+            } else if ((length >= 7) && (memcmp(buffer, RARSTORE_RAR4_SIGNATURE, 7) == 0)) {
+                block = rarstore_block4;
+                pos = 7;
+            } else
+                break;
+            continue;
+        }
+
+        rc = block(buffer, length, &block_size, &entry);
+        if (rc == RarStoreBlock_End) {
+            rv = files == 1;
+            break;
+        }
+        if (rc == RarStoreBlock_File) {
+            files++;
+            rv = (files == 1) && (entry.data_start + pos == expected->data_start) && (entry.data_size == expected->data_size) &&
+                (strcmp(entry.name, expected->name) == 0);
+            free (entry.name);
+            if (!rv)
+                break;
+        } else if (rc != RarStoreBlock_Other)
+            break;
+        pos += block_size;
+    }
+
+    close (fd);
+    free (buffer);
+    return rv;
+}
+
+/// @brief the set of a volume, a new one if it's the first volume we see of it.
+/// @param file
+/// @param name it's name
+/// @param number the volume number
+/// @return NULL if the name isn't one of a volume.
+struct rarstore_set *rarstore_set_of(struct NZBFile *file, char *name, unsigned int *number) {
+    size_t base_length;
+    struct rarstore_set *set;
+
+    (void)file;
+    if (!nzb_volume_parse(name, &base_length, number))
+        return NULL;
+
+    for (unsigned int i = 0; i < rarstore_sets_length; i++) {
+        if ((rarstore_sets[i]->base_length == base_length) && (strncmp(rarstore_sets[i]->base, name, base_length) == 0))
+            return rarstore_sets[i];
+    }
+    rarstore_sets = (struct rarstore_set**)realloc(rarstore_sets, sizeof(struct rarstore_set*) * (rarstore_sets_length + 1));
+    set = rarstore_sets[rarstore_sets_length++] = (struct rarstore_set*)calloc(1, sizeof(struct rarstore_set));
+    set->base = strndup(name, base_length);
+    set->base_length = base_length;
+    set->fd = -1;
+    return set;
+}
+
+/// @brief the volume & set a file is part of.
+/// @param file
+/// @param set
+/// @param v the volume number
+/// @return NULL if it's none (yet)
+struct rarstore_volume *rarstore_volume_of(struct NZBFile *file, struct rarstore_set **set, unsigned int *v) {
+    for (unsigned int i = 0; i < rarstore_sets_length; i++) {
+        for (*v = 0; *v < rarstore_sets[i]->volumes_length; (*v)++) {
+            if (rarstore_sets[i]->volumes[*v].file == file) {
+                *set = rarstore_sets[i];
+                return &rarstore_sets[i]->volumes[*v];
+            }
+        }
+    }
+    return NULL;
+}
+
+/// @brief gives up on the direct unpack of a set, unrar does it.
+/// @param set
+/// @param reason
+void rarstore_fail(struct rarstore_set *set, const char *reason) {
+    if (set->failed)
+        return;
+    LOG_MESSAGE(false, "Direct unpack of %s: %s, leaving it to unrar.", set->base, reason);
+    set->failed = true;
+    // the fd is closed after the download, a worker might still write to it:
+    if (set->fd != -1)
+        unlink (set->inner_path);
+}
+
+/// @brief the state of a segment in rarstore_states, grows w. the nzb.
+/// @param seg
+/// @return
+uint8_t *rarstore_segment_state(struct NZBSegment *seg) {
+    extern struct NZB nzb_tree;
+    uint64_t idx = seg - (struct NZBSegment*)nzb_tree.segment_arena.base;
+
+    if (idx >= rarstore_states_length) {
+        uint64_t length = nzb_tree.segment_arena.used / sizeof(struct NZBSegment);
+
+        rarstore_states = (uint8_t*)realloc(rarstore_states, length);
+        memset(&rarstore_states[rarstore_states_length], RarStoreSeg_Pending, length - rarstore_states_length);
+        rarstore_states_length = length;
+    }
+    return &rarstore_states[idx];
+}
+
+/// @brief writes the part of a segment that belongs to the inner file. Called w. rarstore_lock, unlocks it
+///        while writing.
+/// @param set
+/// @param v the volume number, placed
+/// @param seg
+/// @param data the decoded segment
+/// @return false if it couldn't be written
+bool rarstore_write(struct rarstore_set *set, unsigned int v, struct NZBSegment *seg, const uint8_t *data) {
+    // set->volumes may be realloc'ed while we write:
+    struct rarstore_volume volume = set->volumes[v];
+    uint64_t data_end = volume.entry.data_start + volume.entry.data_size;
+    uint64_t from, to;
+    ssize_t written = 0;
+    int fd = set->fd;
+
+    if (seg->offset == NZBSEGMENT_OFFSET_UNKNOWN) {
+        rarstore_fail(set, "segment offset unknown");
+        return false;
+    }
+    from = seg->offset > volume.entry.data_start ? seg->offset : volume.entry.data_start;
+    to = seg->offset + seg->decoded_bytes < data_end ? seg->offset + seg->decoded_bytes : data_end;
+    *rarstore_segment_state(seg) = RarStoreSeg_Written;
+    if (from >= to)
+        return true;    // just headers
+
+    // the range is this segment's alone:
+    pthread_mutex_unlock(&rarstore_lock);
+    written = pwrite(fd, &data[from - seg->offset], to - from, volume.inner_offset + from - volume.entry.data_start);
+    pthread_mutex_lock(&rarstore_lock);
+
+    if (written != (ssize_t)(to - from)) {
+        LOG_MESSAGE(true, "Direct unpack: couldn't write to %s, errno %i (%s)", set->inner_path, errno, strerror(errno));
+        rarstore_fail(set, "write error");
+        return false;
+    }
+    set->written += written;
+    return true;
+}
+
+/// @brief writes the segments of a volume that were downloaded before it was placed, from the segment files.
+/// @param set
+/// @param v the volume number
+void rarstore_replay(struct rarstore_set *set, unsigned int v) {
+    extern struct NZB nzb_tree;
+    struct NZBFile *file = set->volumes[v].file;
+
+    for (unsigned int i = 0; (i < file->segmentsSize) && !set->failed; i++) {
+        struct NZBSegment *seg = &file->segments[i];
+        uint8_t *buffer;
+        char *path;
+        FILE *in;
+        bool ok;
+
+        if (*rarstore_segment_state(seg) != RarStoreSeg_OnDisk)
+            continue;
+        path = mprintfv("%s%s", nzb_tree.download_destination, nzb_segment_article(seg));
+        buffer = (uint8_t*)malloc(seg->decoded_bytes + 1);
+        in = fopen(path, "rb");
+        ok = in && (fread(buffer, 1, seg->decoded_bytes, in) == seg->decoded_bytes);
+        if (in)
+            fclose (in);
+        if (ok)
+            rarstore_write(set, v, seg, buffer);
+        free (buffer);
+        free (path);
+    }
+}
+
+/// @brief gives the volumes their place in the inner file, one after the other as long as their headers
+///        are known, and writes what's there of them already.
+/// @param set
+void rarstore_place(struct rarstore_set *set) {
+    uint64_t offset = 0;
+
+    for (unsigned int v = 0; (v < set->volumes_length) && set->volumes[v].file && !set->failed; v++) {
+        // no pointers kept, rarstore_replay unlocks:
+        struct rarstore_volume *volume = &set->volumes[v];
+        struct rarstore_entry *first = &set->volumes[0].entry;
+
+        if ((v == 0) ? volume->entry.split_before :
+            (!volume->entry.split_before || !set->volumes[v - 1].entry.split_after || (strcmp(volume->entry.name, first->name) != 0) ||
+             (volume->entry.unpacked_size != first->unpacked_size))) {
+            rarstore_fail(set, "the volumes don't carry one file");
+            return;
+        }
+        if (offset + volume->entry.data_size > first->unpacked_size) {
+            rarstore_fail(set, "more data than the file's size");
+            return;
+        }
+
+        if (!volume->placed) {
+            if (v == 0) {
+                extern struct NZB nzb_tree;
+
+                set->inner_path = mprintfv("%s%s", nzb_tree.download_destination, first->name);
+                set->fd = open(set->inner_path, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+                if (set->fd == -1) {
+                    LOG_MESSAGE(true, "Direct unpack: couldn't create %s, errno %i (%s)", set->inner_path, errno, strerror(errno));
+                    rarstore_fail(set, "create error");
+                    return;
+                }
+                LOG_MESSAGE(false, "Direct unpack of %s to %s (%lu bytes).", set->base, first->name, first->unpacked_size);
+            }
+            volume->inner_offset = offset;
+            volume->placed = true;
+            rarstore_replay(set, v);
+        }
+        offset += set->volumes[v].entry.data_size;
+    }
+}
+
+/// @brief enables the direct unpack for the next download, if configured (directunpack="true").
+/// @param
+void rarstore_init(void) {
+    extern struct NZB nzb_tree;
+
+    rarstore_reset();
+    rarstore_enabled = pair_find(config_downloads, "directunpack") && (strcasecmp(pair_find(config_downloads, "directunpack"), "true") == 0);
+    if (!rarstore_enabled)
+        return;
+
+    // resumed segments are on disk already:
+    pthread_mutex_lock(&rarstore_lock);
+    for (unsigned int i = 0; i < nzb_tree.max_files; i++) {
+        for (unsigned int s = 0; s < nzb_tree.files[i].segmentsSize; s++) {
+            struct NZBSegment *seg = &nzb_tree.files[i].segments[s];
+
+            if (seg->claimed && (seg->state == NSState_Done))
+                *rarstore_segment_state(seg) = RarStoreSeg_OnDisk;
+        }
+    }
+    pthread_mutex_unlock(&rarstore_lock);
+}
+
+/// @brief a segment was decoded and written to disk: it's part of the inner file is written, the
+///        first segment of a volume tells where the volume goes.
+/// @param file
+/// @param seg
+/// @param data the decoded segment
+void rarstore_segment(struct NZBFile *file, struct NZBSegment *seg, const uint8_t *data) {
+    struct rarstore_set *set = NULL;
+    struct rarstore_volume *volume;
+    unsigned int v;
+
+    if (!rarstore_enabled)
+        return;
+
+    pthread_mutex_lock(&rarstore_lock);
+    if (seg->number == 1) {
+        char *name = file->par2_filename ? file->par2_filename : (file->yenc_filename ? file->yenc_filename : file->filename);
+        struct rarstore_entry entry;
+        unsigned int number;
+
+        if (!rarstore_volume_of(file, &set, &v) && ((set = rarstore_set_of(file, name, &number)) != NULL) && !set->failed) {
+            int rc = rarstore_parse_volume(data, seg->decoded_bytes, &entry);
+
+            if (rc == RarStoreBlock_File) {
+                if (number >= set->volumes_length) {
+                    set->volumes = (struct rarstore_volume*)realloc(set->volumes, sizeof(struct rarstore_volume) * (number + 1));
+                    memset(&set->volumes[set->volumes_length], 0, sizeof(struct rarstore_volume) * (number + 1 - set->volumes_length));
+                    set->volumes_length = number + 1;
+                }
+                if (set->volumes[number].file) {
+                    free (entry.name);
+                    rarstore_fail(set, "two volumes w. the same number");
+                } else {
+                    set->volumes[number].file = file;
+                    set->volumes[number].entry = entry;
+                    *rarstore_segment_state(seg) = RarStoreSeg_OnDisk;
+                    rarstore_place(set);
+                }
+            } else if (rc != RarStoreBlock_Bad)
+                rarstore_fail(set, rc == RarStoreBlock_Truncated ? "headers beyond the first segment" :
+                    (rc == RarStoreBlock_Encrypted ? "encrypted" : "not stored"));
+        }
+    }
+
+    volume = rarstore_volume_of(file, &set, &v);
+    if (!volume || !volume->placed || set->failed) {
+        *rarstore_segment_state(seg) = RarStoreSeg_OnDisk;
+    } else if (*rarstore_segment_state(seg) != RarStoreSeg_Written)
+        rarstore_write(set, v, seg, data);
+    pthread_mutex_unlock(&rarstore_lock);
+}
+
+/// @brief if the file is a volume of a set that's unpacked directly (so far).
+/// @param file
+/// @return
+bool rarstore_handles(struct NZBFile *file) {
+    struct rarstore_set *set;
+    unsigned int v;
+    bool rv;
+
+    pthread_mutex_lock(&rarstore_lock);
+    rv = rarstore_volume_of(file, &set, &v) && !set->failed;
+    pthread_mutex_unlock(&rarstore_lock);
+    return rv;
+}
+
+/// @brief after the download & join: a set is unpacked if every volume is there, every segment made it
+///        into the inner file and the joined volumes carry nothing else.
+/// @param
+void rarstore_finish(void) {
+    extern struct NZB nzb_tree;
+
+    for (unsigned int i = 0; i < rarstore_sets_length; i++) {
+        struct rarstore_set *set = rarstore_sets[i];
+        uint64_t expected = 0;
+        const char *reason = set->failed ? "failed before" : NULL;
+
+        // no volume of it was a RAR (split files are named like volumes too):
+        if (!set->volumes_length)
+            continue;
+
+        for (unsigned int v = 0; (v < set->volumes_length) && !reason; v++) {
+            struct rarstore_volume *volume = &set->volumes[v];
+
+            if (!volume->file || !volume->placed) {
+                reason = "volumes missing";
+                break;
+            }
+            expected += volume->entry.data_size;
+            if (!volume->file->crcOk)
+                reason = "damaged volume";
+            for (unsigned int s = 0; (s < volume->file->segmentsSize) && !reason; s++) {
+                if (volume->file->segments[s].state == NSState_CRCError)
+                    reason = "crc error";
+            }
+            for (unsigned int s = 0; (s < volume->file->segmentsSize) && !reason; s++) {
+                if (*rarstore_segment_state(&volume->file->segments[s]) != RarStoreSeg_Written)
+                    reason = "segments missing";
+            }
+        }
+        if (!reason && (set->volumes[set->volumes_length - 1].entry.split_after || (expected != set->volumes[0].entry.unpacked_size) || (set->written != expected)))
+            reason = "incomplete";
+
+        // the joined volumes have to carry the one file, nothing else:
+        for (unsigned int v = 0; (v < set->volumes_length) && !reason; v++) {
+            char *path = mprintfv("%s/%s", nzb_tree.download_destination, mw_final_filename(set->volumes[v].file));
+
+            if (!rarstore_check_volume(path, &set->volumes[v].entry))
+                reason = "more than one file";
+            free (path);
+        }
+
+        if (reason)
+            rarstore_fail(set, reason);
+        if (set->fd != -1)
+            close (set->fd);
+        set->fd = -1;
+        if (set->failed)
+            continue;
+        set->unpacked = true;
+        q_printf("Unpacked %s directly while downloading.\n", set->volumes[0].entry.name);
+        LOG_MESSAGE(false, "Direct unpack of %s finished: %s, %u volumes.", set->base, set->inner_path, set->volumes_length);
+    }
+}
+
+/// @brief the volumes of the directly unpacked sets aren't needed if par2 found them ok (or no par2 set
+///        knows them). The inner file of a set that had to be repaired was unpacked from the damaged
+///        volumes: it's removed and unrar unpacks the repaired ones, a set whose verify failed keeps them.
+/// @param
+void rarstore_remove_volumes(void) {
+    extern struct NZB nzb_tree;
+
+    for (unsigned int i = 0; i < rarstore_sets_length; i++) {
+        struct rarstore_set *set = rarstore_sets[i];
+        bool verified = true, untouched = true;
+
+        if (!set->unpacked)
+            continue;
+        for (unsigned int v = 0; v < set->volumes_length; v++) {
+            const char *name = mw_final_filename(set->volumes[v].file);
+            int rc = mw_par2_rc(name);
+
+            verified = verified && mw_par2_verified(name);
+            untouched = untouched && ((rc == -1) || (rc == PAR2Repair_Ok));
+        }
+        if (!verified) {
+            LOG_MESSAGE(true, "%s: par2 verify/repair failed, keeping the volumes.", set->base);
+            continue;
+        }
+        if (!untouched) {
+            LOG_MESSAGE(false, "%s: the volumes were repaired, unrar unpacks them again.", set->base);
+            unlink (set->inner_path);
+            set->unpacked = false;
+            continue;
+        }
+        for (unsigned int v = 0; v < set->volumes_length; v++) {
+            char *path = mprintfv("%s/%s", nzb_tree.download_destination, mw_final_filename(set->volumes[v].file));
+
+            if (unlink(path) != 0)
+                LOG_MESSAGE(false, "Failed to remove %s, errno %i, %s", path, errno, strerror(errno));
+            else
+                LOG_MESSAGE(false, "Removed %s", path);
+            free (path);
+        }
+    }
+}
+
+/// @brief forgets every set, unfinished inner files are removed.
+/// @param
+void rarstore_reset(void) {
+    for (unsigned int i = 0; i < rarstore_sets_length; i++) {
+        struct rarstore_set *set = rarstore_sets[i];
+
+        if (set->fd != -1) {
+            close (set->fd);
+            unlink (set->inner_path);
+        }
+        for (unsigned int v = 0; v < set->volumes_length; v++)
+            free (set->volumes[v].entry.name);
+        free (set->volumes);
+        free (set->inner_path);
+        free (set->base);
+        free (set);
+    }
+    free (rarstore_sets);
+    rarstore_sets = NULL;
+    rarstore_sets_length = 0;
+    free (rarstore_states);
+    rarstore_states = NULL;
+    rarstore_states_length = 0;
+    rarstore_enabled = false;
+}
+
+/// @brief the type of a RAR5 block and the first field behind the common ones: the archive flags of the
+///        main header, the flags of the end of archive...
+/// @param data the block, it's crc was checked (rarstore_block5)
+/// @param length
+/// @param type
+/// @param field
+/// @return
+bool rarstore_field5(const uint8_t *data, size_t length, uint64_t *type, uint64_t *field) {
+    size_t pos = 4;
+    uint64_t head_size, head_flags, size;
+
+    if (!rarstore_vint(data, length, &pos, &head_size) || !rarstore_vint(data, length, &pos, type) ||
+        !rarstore_vint(data, length, &pos, &head_flags))
+        return false;
+    if ((head_flags & 0x0001) && !rarstore_vint(data, length, &pos, &size))    // extra area
+        return false;
+    if ((head_flags & 0x0002) && !rarstore_vint(data, length, &pos, &size))    // data area
+        return false;
+    return rarstore_vint(data, length, &pos, field);
+}
+
+/// @brief reads the main header of a .rar/.rNN and walks the blocks to the end of archive, the data
+///        in between is skipped.
+/// @param path
+/// @param info is_volume, continued, headers_known are set
+/// @return false if it's no RAR
+bool rarstore_scan_headers(const char *path, struct rarstore_scan_volume *info) {
+    int (*block)(const uint8_t*, size_t, uint64_t*, struct rarstore_entry*) = NULL;
+    uint8_t *buffer = (uint8_t*)malloc(RARSTORE_HEADER_READ);
+    uint64_t pos = 0, block_size;
+    bool rar5 = false, main_seen = false;
+    ssize_t length;
+    int fd = open(path, O_RDONLY);
+
+    if (fd == -1) {
+        LOG_MESSAGE(false, "Couldn't open %s, errno %i (%s)", path, errno, strerror(errno));
+        free (buffer);
+        return false;
+    }
+
+    length = pread(fd, buffer, RARSTORE_HEADER_READ, 0);
+    if ((length >= 8) && (memcmp(buffer, RARSTORE_RAR5_SIGNATURE, 8) == 0)) {
+        block = rarstore_block5;
+        rar5 = true;
+        pos = 8;
+    } else if ((length >= 7) && (memcmp(buffer, RARSTORE_RAR4_SIGNATURE, 7) == 0)) {
+        block = rarstore_block4;
+        pos = 7;
+    }
+
+    while (block && ((length = pread(fd, buffer, RARSTORE_HEADER_READ, pos)) > 0)) {
+        struct rarstore_entry entry = { 0 };
+        uint64_t type, flags;
+        int rc = block(buffer, length, &block_size, &entry);
+
+        free (entry.name);
+        if ((rc == RarStoreBlock_Bad) || (rc == RarStoreBlock_Truncated))
+            break;
+        if (rar5) {
+            if (!rarstore_field5(buffer, length, &type, &flags))
+                break;
+        } else {
+            type = buffer[2];
+            flags = rarstore_le16(&buffer[3]);
+        }
+
+        if (type == (rar5 ? 0x01 : 0x73)) {
+            main_seen = true;
+            info->is_volume = flags & 0x0001;
+        }
+        if (rc == RarStoreBlock_End) {
+            info->continued = flags & 0x0001;
+            info->headers_known = main_seen;
+            break;
+        }
+        // encrypted files can be skipped, encrypted headers can't:
+        if ((rc == RarStoreBlock_Encrypted) && (type != (rar5 ? 0x02 : 0x74)))
+            break;
+        pos += block_size;
+    }
+
+    close (fd);
+    free (buffer);
+    return block != NULL;
+}
+
+/// @brief orders the volumes by set (the name w/o the volume part, the naming) and number.
+/// @param a
+/// @param b
+/// @return <0, 0, >0 like strcmp
+int rarstore_scan_compare(const void *a, const void *b) {
+    const struct rarstore_scan_volume *va = (const struct rarstore_scan_volume*)a;
+    const struct rarstore_scan_volume *vb = (const struct rarstore_scan_volume*)b;
+    int rc = strncmp(va->name, vb->name, va->base_length < vb->base_length ? va->base_length : vb->base_length);
+
+    if (rc)
+        return rc;
+    if (va->base_length != vb->base_length)
+        return va->base_length < vb->base_length ? -1 : 1;
+    if (va->new_naming != vb->new_naming)
+        return va->new_naming ? -1 : 1;
+    return (va->number > vb->number) - (va->number < vb->number);
+}
+
+/// @brief if b continues the set of a, both sorted.
+/// @param a
+/// @param b
+/// @return
+bool rarstore_scan_same_set(struct rarstore_scan_volume *a, struct rarstore_scan_volume *b) {
+    // a single archive is a set of it's own:
+    if ((a->headers_known && !a->is_volume) || (b->headers_known && !b->is_volume))
+        return false;
+    return (a->base_length == b->base_length) && (a->new_naming == b->new_naming) && (strncmp(a->name, b->name, a->base_length) == 0);
+}
+
+/// @brief finds the RAR archives in a directory (name.partNN.rar, name.rar & name.rNN, single .rar) and
+///        groups the volumes into sets, w/o unrar.
+/// @param directory
+/// @param sets has to be freed w. rarstore_scan_free
+/// @return the number of sets
+unsigned int rarstore_scan(const char *directory, struct rarstore_scan_set **sets) {
+    struct rarstore_scan_volume *found = NULL;
+    unsigned int found_length = 0, sets_length = 0;
+    struct dirent *dir_entry;
+    DIR *dir = opendir(directory);
+
+    *sets = NULL;
+    if (!dir) {
+        LOG_MESSAGE(false, "Couldn't opendir(%s), errno: %i, %s", directory, errno, strerror(errno));
+        return 0;
+    }
+
+    while ((dir_entry = readdir(dir)) != NULL) {
+        struct rarstore_scan_volume info = { 0 };
+        size_t length = strlen(dir_entry->d_name);
+        bool is_rar;
+        char *path;
+
+        if ((dir_entry->d_type != DT_REG) || !nzb_volume_parse(dir_entry->d_name, &info.base_length, &info.number))
+            continue;
+        // name.NNN is a split file, not a RAR volume:
+        if (!string_ends_width(dir_entry->d_name, ".rar") && (tolower(dir_entry->d_name[length - 3]) != 'r'))
+            continue;
+        info.new_naming = string_ends_width(dir_entry->d_name, ".rar") && (length - info.base_length > 4);
+
+        path = mprintfv("%s/%s", directory, dir_entry->d_name);
+        is_rar = rarstore_scan_headers(path, &info);
+        free (path);
+        if (!is_rar)
+            continue;
+
+        info.name = strdup(dir_entry->d_name);
+        found = (struct rarstore_scan_volume*)realloc(found, sizeof(struct rarstore_scan_volume) * (found_length + 1));
+        found[found_length++] = info;
+    }
+    closedir(dir);
+
+    qsort(found, found_length, sizeof(struct rarstore_scan_volume), rarstore_scan_compare);
+    for (unsigned int i = 0, j; i < found_length; i = j) {
+        struct rarstore_scan_set *set;
+        bool single = found[i].headers_known && !found[i].is_volume;
+
+        for (j = i + 1; (j < found_length) && rarstore_scan_same_set(&found[i], &found[j]); j++)
+            ;
+        *sets = (struct rarstore_scan_set*)realloc(*sets, sizeof(struct rarstore_scan_set) * (sets_length + 1));
+        set = &(*sets)[sets_length++];
+        set->volumes = (char**)malloc(sizeof(char*) * (j - i));
+        set->volumes_length = j - i;
+        set->complete = true;
+
+        // 0, 1, 2... every one but the last continues in the next (if the headers tell):
+        for (unsigned int k = i; k < j; k++) {
+            set->volumes[k - i] = found[k].name;
+            if (!single && (found[k].number != k - i))
+                set->complete = false;
+            if (found[k].headers_known && (found[k].continued != (k + 1 < j)))
+                set->complete = false;
+        }
+        LOG_MESSAGE(false, "RAR set %s: %u volumes%s.", set->volumes[0], set->volumes_length, set->complete ? "" : ", incomplete");
+    }
+
+    free (found);
+    return sets_length;
+}
+
+/// @brief frees what rarstore_scan returned.
+/// @param sets
+/// @param sets_length
+void rarstore_scan_free(struct rarstore_scan_set *sets, unsigned int sets_length) {
+    for (unsigned int i = 0; i < sets_length; i++) {
+        for (unsigned int v = 0; v < sets[i].volumes_length; v++)
+            free (sets[i].volumes[v]);
+        free (sets[i].volumes);
+    }
+    free (sets);
+}
@@ -0,0 +1,88 @@
+#ifndef RARSTORE_H
+#define RARSTORE_H
+#include <stdbool.h>
+#include <stdint.h>
+#include "xmlhandler.h"
+
+// Direct unpack of store-mode (-m0) RAR sets: the file inside is nothing but byte ranges of the
+// volumes, so every decoded segment is written to it right away. Only unencrypted sets of stored
+// volumes that carry one file are done like this, everything else is left to unrar.
+// rarstore_scan finds the volume sets in a directory for unrar, by their main & end headers.
+#define RARSTORE_RAR4_SIGNATURE     "Rar!\x1a\x07\x00"
+#define RARSTORE_RAR5_SIGNATURE     "Rar!\x1a\x07\x01\x00"
+#define RARSTORE_HEADER_READ        65536       // read at once when the headers of a joined volume are checked
+
+enum RarStore_Block {
+    RarStoreBlock_Truncated = 0,    // more data needed
+    RarStoreBlock_Bad,              // not RAR, or a broken header
+    RarStoreBlock_Unsupported,      // compressed, a directory...
+    RarStoreBlock_Encrypted,        // the headers or the file
+    RarStoreBlock_Other,
+    RarStoreBlock_File,
+    RarStoreBlock_End
+};
+
+enum RarStore_Segment_State {
+    RarStoreSeg_Pending = 0,
+    RarStoreSeg_OnDisk,             // only in the segment file (the volume wasn't placed yet)
+    RarStoreSeg_Written             // in the inner file
+};
+
+// the (first) file block of a volume:
+struct rarstore_entry {
+    char        *name;
+    uint64_t    unpacked_size;
+    uint64_t    data_start;         // offset in the volume
+    uint64_t    data_size;
+    bool        split_before;       // continued from the previous volume
+    bool        split_after;        // continues in the next one
+};
+
+struct rarstore_volume {
+    struct NZBFile *file;           // NULL = not seen yet
+    struct rarstore_entry entry;
+    bool        placed;             // inner_offset is valid, the segments go to the inner file
+    uint64_t    inner_offset;
+};
+
+struct rarstore_set {
+    char        *base;              // the volume name w/o the volume part
+    size_t      base_length;
+    struct rarstore_volume *volumes;    // by volume number
+    unsigned int volumes_length;
+    int         fd;                 // the inner file, -1 = not open
+    char        *inner_path;
+    uint64_t    written;            // bytes
+    bool        failed;             // left to unrar
+    bool        unpacked;           // complete, the volumes are kept for verify only
+};
+
+// what the headers of a .rar/.rNN on disk say:
+struct rarstore_scan_volume {
+    char        *name;
+    size_t      base_length;        // see nzb_volume_parse
+    unsigned int number;            // 0-based, by the name
+    bool        new_naming;         // name.partNN.rar, not name.rar, name.r00...
+    bool        headers_known;      // false if they're encrypted (or broken), the name is all we have
+    bool        is_volume;          // main header: part of a multi-volume archive
+    bool        first;              // main header: the first volume
+    bool        continued;          // end header: not the last volume
+};
+
+// a volume set found by rarstore_scan:
+struct rarstore_scan_set {
+    char        **volumes;          // the names, in volume order, volumes[0] is the first
+    unsigned int volumes_length;
+    bool        complete;           // no volume missing, as far as the headers tell
+};
+
+void rarstore_init(void);
+void rarstore_segment(struct NZBFile *file, struct NZBSegment *seg, const uint8_t *data);
+bool rarstore_handles(struct NZBFile *file);
+void rarstore_finish(void);
+void rarstore_remove_volumes(void);
+void rarstore_reset(void);
+int rarstore_parse_volume(const uint8_t *data, size_t length, struct rarstore_entry *entry);
+unsigned int rarstore_scan(const char *directory, struct rarstore_scan_set **sets);
+void rarstore_scan_free(struct rarstore_scan_set *sets, unsigned int sets_length);
+#endif
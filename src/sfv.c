@@ -0,0 +1,297 @@
+/*
+ * SFV check: a .sfv lists "name crc32" for the files of a release. The workers keep the crc32
+ * of every decoded segment, rapidyenc_crc_combine() chains them to the crc of the whole file.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "mindweaver.h"
+#include "sfv.h"
+
+// non "exported" functions:
+bool sfv_is_sfv(struct NZBFile *file);
+bool sfv_load(struct NZBFile *file);
+bool sfv_name_matches(struct NZBFile *file, const char *name);
+void sfv_check_file(struct NZBFile *file);
+
+// local variables:
+pthread_mutex_t     sfv_lock = PTHREAD_MUTEX_INITIALIZER;
+struct sfv_entry    *sfv_entries = NULL;
+unsigned int        sfv_entries_length = 0;
+struct NZBFile      **sfv_files = NULL;     // the .sfv files loaded already
+unsigned int        sfv_files_length = 0;
+
+/// @brief adds the entries of a .sfv, lines are "name crc32", the ones starting w. ';' are comments.
+/// @param data the content
+/// @param length
+/// @return true if there was at least one entry
+bool sfv_parse(const char *data, size_t length) {
+    const char *end = data + length;
+    bool rv = false;
+
+    while (data < end) {
+        const char *eol = memchr(data, '\n', end - data), *crc_start;
+        size_t line_length;
+        char crc_text[9];
+        char *crc_end;
+        uint32_t crc;
+
+        if (!eol)
+            eol = end;
+        line_length = eol - data;
+        while (line_length && isspace((unsigned char)data[line_length-1]))
+            line_length--;
+
+        // the crc is the last word, exactly 8 hex digits, separated by whitespace from the name:
+        if ((data[0] == ';') || (line_length < 10) || !isspace((unsigned char)data[line_length-9])) {
+            data = eol + 1;
+            continue;
+        }
+        crc_start = &data[line_length-8];
+        memcpy(crc_text, crc_start, 8);
+        crc_text[8] = 0;
+        crc = strtoul(crc_text, &crc_end, 16);
+        if (*crc_end) {
+            data = eol + 1;
+            continue;
+        }
+        line_length -= 9;
+        while (line_length && isspace((unsigned char)data[line_length-1]))
+            line_length--;
+        if (line_length) {
+            sfv_entries = (struct sfv_entry*)realloc(sfv_entries, sizeof(struct sfv_entry) * (sfv_entries_length + 1));
+            memset(&sfv_entries[sfv_entries_length], 0, sizeof(struct sfv_entry));
+            sfv_entries[sfv_entries_length].name = mprintfv("%.*s", (int)line_length, data);
+            sfv_entries[sfv_entries_length++].crc32 = crc;
+            rv = true;
+        }
+        data = eol + 1;
+    }
+    return rv;
+}
+
+/// @brief the crc32 of the whole file, from the crc32s of it's segments.
+/// @param file
+/// @param crc out
+/// @return false if a segment is missing, or the segments don't line up
+bool sfv_file_crc(struct NZBFile *file, uint32_t *crc) {
+    uint64_t position = 0;
+    uint32_t rv = 0;
+
+    if (file->missing_segments || !file->segmentsSize)
+        return false;
+
+    for (unsigned int i = 0; i < file->segmentsSize; i++) {
+        struct NZBSegment *seg = &file->segments[i];
+
+        if (((seg->state != NSState_Done) && (seg->state != NSState_CRCError)) || !seg->decoded_bytes)
+            return false;
+        if ((seg->offset != NZBSEGMENT_OFFSET_UNKNOWN) && (seg->offset != position))
+            return false;
+        rv = rapidyenc_crc_combine(rv, seg->crc32, seg->decoded_bytes);
+        position += seg->decoded_bytes;
+    }
+    if (file->file_size && (position != file->file_size))
+        return false;
+
+    *crc = rv;
+    return true;
+}
+
+/// @brief a worker got the last segment of a file: a .sfv is loaded, every other file is checked.
+/// @param file
+void sfv_file_complete(struct NZBFile *file) {
+    extern struct NZB nzb_tree;
+
+    pthread_mutex_lock(&sfv_lock);
+    if (sfv_is_sfv(file)) {
+        if (sfv_load(file)) {
+            // the files that were complete before the .sfv:
+            for (unsigned int i = 0; i < nzb_tree.max_files; i++) {
+                struct NZBFile *other = &nzb_tree.files[i];
+                if ((other->state == NFState_Done) || (other->segmentsSize && !other->remaining_segments && !other->open_segments))
+                    sfv_check_file(other);
+            }
+        }
+    } else
+        sfv_check_file(file);
+    pthread_mutex_unlock(&sfv_lock);
+}
+
+/// @brief the last chance for files whose completion was missed, before they're joined.
+/// @param
+void sfv_check_all(void) {
+    extern struct NZB nzb_tree;
+
+    for (unsigned int i = 0; i < nzb_tree.max_files; i++) {
+        if (sfv_is_sfv(&nzb_tree.files[i]) && nzb_file_in_download_pass(&nzb_tree.files[i]))
+            sfv_file_complete(&nzb_tree.files[i]);
+    }
+    pthread_mutex_lock(&sfv_lock);
+    for (unsigned int i = 0; i < nzb_tree.max_files; i++) {
+        if (nzb_file_in_download_pass(&nzb_tree.files[i]))
+            sfv_check_file(&nzb_tree.files[i]);
+    }
+    pthread_mutex_unlock(&sfv_lock);
+}
+
+/// @brief counts the states of the entries.
+/// @param ok
+/// @param bad
+/// @param unknown unchecked or unknown
+/// @return the number of entries, 0 = no .sfv
+unsigned int sfv_summary(unsigned int *ok, unsigned int *bad, unsigned int *unknown) {
+    *ok = *bad = *unknown = 0;
+
+    pthread_mutex_lock(&sfv_lock);
+    for (unsigned int i = 0; i < sfv_entries_length; i++) {
+        if (sfv_entries[i].state == SFV_Ok)
+            (*ok)++;
+        else if (sfv_entries[i].state == SFV_Bad)
+            (*bad)++;
+        else
+            (*unknown)++;
+    }
+    pthread_mutex_unlock(&sfv_lock);
+    return sfv_entries_length;
+}
+
+/// @brief if every downloaded file except the .par2 and .sfv ones was verified by a .sfv, and every
+///        entry of the .sfv was too (a file listed there but missing from the nzb isn't ok).
+/// @param
+/// @return false if there's no .sfv, a file isn't in it, or an entry isn't ok
+bool sfv_release_ok(void) {
+    extern struct NZB nzb_tree;
+    bool rv = true, any = false;
+
+    pthread_mutex_lock(&sfv_lock);
+    for (unsigned int i = 0; (i < nzb_tree.max_files) && rv; i++) {
+        struct NZBFile *file = &nzb_tree.files[i];
+        bool found = false;
+
+        if (file->is_par_vol_file || sfv_is_sfv(file) || string_ends_width(mw_final_filename(file), ".par2"))
+            continue;
+        for (unsigned int e = 0; (e < sfv_entries_length) && !found; e++)
+            found = (sfv_entries[e].file == file) && (sfv_entries[e].state == SFV_Ok);
+        rv = found;
+        any = true;
+    }
+    for (unsigned int e = 0; (e < sfv_entries_length) && rv; e++)
+        rv = sfv_entries[e].state == SFV_Ok;
+    pthread_mutex_unlock(&sfv_lock);
+    return rv && any;
+}
+
+/// @brief forgets every entry.
+/// @param
+void sfv_reset(void) {
+    pthread_mutex_lock(&sfv_lock);
+    for (unsigned int i = 0; i < sfv_entries_length; i++)
+        free (sfv_entries[i].name);
+    free (sfv_entries);
+    sfv_entries = NULL;
+    sfv_entries_length = 0;
+    free (sfv_files);
+    sfv_files = NULL;
+    sfv_files_length = 0;
+    pthread_mutex_unlock(&sfv_lock);
+}
+
+/// @brief if the file is a .sfv, by any of it's names.
+/// @param file
+/// @return
+bool sfv_is_sfv(struct NZBFile *file) {
+    return (file->filename && string_ends_width(file->filename, ".sfv")) ||
+        (file->yenc_filename && string_ends_width(file->yenc_filename, ".sfv")) ||
+        (file->par2_filename && string_ends_width(file->par2_filename, ".sfv"));
+}
+
+/// @brief reads a .sfv (from it's segments, or the joined file) and parses it. It's loaded once.
+/// @param file
+/// @return true if it had entries
+bool sfv_load(struct NZBFile *file) {
+    extern struct NZB nzb_tree;
+    char *data = NULL;
+    size_t length = 0;
+    bool rv;
+
+    for (unsigned int i = 0; i < sfv_files_length; i++) {
+        if (sfv_files[i] == file)
+            return false;
+    }
+    sfv_files = (struct NZBFile**)realloc(sfv_files, sizeof(struct NZBFile*) * (sfv_files_length + 1));
+    sfv_files[sfv_files_length++] = file;
+
+    for (unsigned int i = 0; i < file->segmentsSize; i++) {
+        struct NZBSegment *seg = &file->segments[i];
+        char *path = (file->state == NFState_Done) ? mprintfv("%s/%s", nzb_tree.download_destination, mw_final_filename(file)) : mprintfv("%s/%s", nzb_tree.download_destination, nzb_segment_article(seg));
+        FILE *in = fopen(path, "rb");
+        size_t got = 0;
+
+        free (path);
+        if (!in)
+            continue;
+        do {
+            data = (char*)realloc(data, length + 4096);
+            got = fread(&data[length], 1, 4096, in);
+            length += got;
+        } while (got == 4096);
+        fclose(in);
+        if (file->state == NFState_Done)
+            break;
+    }
+
+    rv = sfv_parse(data ? data : "", length);
+    free (data);
+    LOG_MESSAGE(false, "SFV %s loaded, %u files listed.", mw_final_filename(file), sfv_entries_length);
+    return rv;
+}
+
+/// @brief if one of the file's names is the one in the .sfv (sfv is from windows, so w/o case).
+/// @param file
+/// @param name
+/// @return
+bool sfv_name_matches(struct NZBFile *file, const char *name) {
+    extern pthread_mutex_t mw_par2_index_lock;
+    bool rv;
+
+    // the par2 names are set by the workers:
+    pthread_mutex_lock(&mw_par2_index_lock);
+    rv = (file->par2_filename && (strcasecmp(file->par2_filename, name) == 0)) ||
+        (file->yenc_filename && (strcasecmp(file->yenc_filename, name) == 0)) ||
+        (file->filename && (strcasecmp(file->filename, name) == 0));
+    pthread_mutex_unlock(&mw_par2_index_lock);
+    return rv;
+}
+
+/// @brief checks a complete file against it's entry (if it has one), sfv_lock has to be locked.
+/// @param file
+void sfv_check_file(struct NZBFile *file) {
+    for (unsigned int i = 0; i < sfv_entries_length; i++) {
+        struct sfv_entry *entry = &sfv_entries[i];
+        int old_state = entry->state;
+        uint32_t crc;
+
+        if ((entry->state == SFV_Ok) || !sfv_name_matches(file, entry->name))
+            continue;   // the others are checked again, the segments may have changed.
+
+        entry->file = file;
+        if (sfv_file_crc(file, &crc))
+            entry->state = crc == entry->crc32 ? SFV_Ok : SFV_Bad;
+        else {
+            // a failed segment is damage for sure, anything else just can't be told:
+            entry->state = SFV_Unknown;
+            for (unsigned int s = 0; s < file->segmentsSize; s++) {
+                if (file->segments[s].state == NSState_Failed)
+                    entry->state = SFV_Bad;
+            }
+            if (file->missing_segments)
+                entry->state = SFV_Bad;
+        }
+        if (entry->state != old_state)
+            LOG_MESSAGE(false, "SFV: %s %s (%08x).", entry->name, entry->state == SFV_Ok ? "ok" : entry->state == SFV_Bad ? "damaged" : "can't be checked", entry->crc32);
+        return;
+    }
+}
@@ -0,0 +1,30 @@
+#ifndef SFV_H
+#define SFV_H
+#include <stdbool.h>
+#include <stdint.h>
+#include "xmlhandler.h"
+
+// SFV check: the crc32 of every decoded segment is combined to the crc32 of the whole file, so
+// the files listed in a .sfv are verified as they complete, w/o reading them back from disk.
+enum SFV_State {
+    SFV_Unchecked = 0,          // the file isn't complete (or not in the nzb)
+    SFV_Ok,
+    SFV_Bad,                    // the crc doesn't match or segments are missing
+    SFV_Unknown                 // the segments don't tell (no or inconsistent offsets)
+};
+
+struct sfv_entry {
+    char        *name;
+    uint32_t    crc32;
+    int         state;          // one of SFV_State
+    struct NZBFile *file;       // the file it was checked against
+};
+
+bool sfv_parse(const char *data, size_t length);
+bool sfv_file_crc(struct NZBFile *file, uint32_t *crc);
+void sfv_file_complete(struct NZBFile *file);
+void sfv_check_all(void);
+unsigned int sfv_summary(unsigned int *ok, unsigned int *bad, unsigned int *unknown);
+bool sfv_release_ok(void);
+void sfv_reset(void);
+#endif
@@ -0,0 +1,70 @@
+/*
+ * Download statistics w/o shared cache lines: one padded slot per worker.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "stats.h"
+
+// local variables:
+struct stats_slot   stats_shared;               // main thread, nzb loader..
+struct stats_slot   *stats_slots = NULL;        // one per worker
+unsigned int        stats_slots_length = 0;
+
+/// @brief reserves the slots of the workers, once.
+/// @param workers the number of worker threads, slot = 0..workers-1
+/// @return false if there's no memory
+bool stats_init(unsigned int workers) {
+    if (stats_slots_length >= workers)
+        return true;
+
+    stats_free();
+    stats_slots = (struct stats_slot*)aligned_alloc(STATS_CACHE_LINE, sizeof(struct stats_slot) * (workers ? workers : 1));
+    if (!stats_slots)
+        return false;
+    for (unsigned int i = 0; i < workers; i++) {
+        for (int c = 0; c < Stats_Counters; c++)
+            atomic_init(&stats_slots[i].counters[c], 0);
+    }
+    stats_slots_length = workers;
+    return true;
+}
+
+/// @brief adds to a counter of a slot, relaxed: nobody orders anything by the statistics.
+/// @param slot the worker, STATS_SHARED for any other thread
+/// @param counter one of Stats_Counter
+/// @param value
+void stats_add(unsigned int slot, int counter, uint64_t value) {
+    struct stats_slot *target = slot < stats_slots_length ? &stats_slots[slot] : &stats_shared;
+
+    atomic_fetch_add_explicit(&target->counters[counter], value, memory_order_relaxed);
+}
+
+/// @brief the sum of a counter over every slot.
+/// @param counter one of Stats_Counter
+/// @return
+uint64_t stats_sum(int counter) {
+    uint64_t rv = atomic_load_explicit(&stats_shared.counters[counter], memory_order_relaxed);
+
+    for (unsigned int i = 0; i < stats_slots_length; i++)
+        rv += atomic_load_explicit(&stats_slots[i].counters[counter], memory_order_relaxed);
+    return rv;
+}
+
+/// @brief every counter starts over, for the next nzb. The workers have to be done.
+/// @param
+void stats_reset(void) {
+    for (int c = 0; c < Stats_Counters; c++) {
+        atomic_store_explicit(&stats_shared.counters[c], 0, memory_order_relaxed);
+        for (unsigned int i = 0; i < stats_slots_length; i++)
+            atomic_store_explicit(&stats_slots[i].counters[c], 0, memory_order_relaxed);
+    }
+}
+
+/// @brief frees the slots of the workers.
+/// @param
+void stats_free(void) {
+    free (stats_slots);
+    stats_slots = NULL;
+    stats_slots_length = 0;
+}
@@ -0,0 +1,27 @@
+#ifndef STATS_H
+#define STATS_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+// the download statistics: every worker counts in it's own slot (no other thread writes that
+// cache line), the readers sum the slots up.
+#define STATS_CACHE_LINE    64
+#define STATS_SHARED        UINT32_MAX  // the slot of every thread that isn't a worker
+
+enum Stats_Counter {
+    Stats_ReleaseDownloaded = 0,        // the nzb bytes of the fetched segments (like release_size)
+    Stats_FailedSegments,
+    Stats_Counters
+};
+
+struct stats_slot {
+    _Alignas(STATS_CACHE_LINE) atomic_uint_fast64_t counters[Stats_Counters];
+};
+
+bool stats_init(unsigned int workers);
+void stats_add(unsigned int slot, int counter, uint64_t value);
+uint64_t stats_sum(int counter);
+void stats_reset(void);
+void stats_free(void);
+#endif
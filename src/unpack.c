@@ -0,0 +1,212 @@
+/*
+ * Streaming unpack: a clean release is unrar'ed while it's downloaded, volume by volume.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include "mindweaver.h"
+#include "unpack.h"
+
+// non "exported" functions:
+struct NZBFile *unpack_stream_volume(unsigned int number);
+bool unpack_stream_complete(struct NZBFile *file);
+bool unpack_stream_find_first(void);
+bool unpack_stream_start(void);
+void unpack_stream_abort(const char *reason);
+
+// local variables:
+struct unpack_stream unpack_stream = { .state = UnpackStream_Off, .unrar = NULL, .first_volume = NULL };
+
+/// @brief the file of the volume in the set of unpack_stream.first_volume, by it's par2 name.
+/// @param number 0-based
+/// @return NULL if there's no such file (or it's not identified yet)
+struct NZBFile *unpack_stream_volume(unsigned int number) {
+    extern struct NZB nzb_tree;
+    extern pthread_mutex_t mw_par2_index_lock;
+    struct NZBFile *rv = NULL;
+    char *name = mprintfv("%.*s.part%0*u.rar", (int)unpack_stream.base_length, unpack_stream.first_volume, unpack_stream.digits, number + 1);
+
+    // the par2 names are set by the workers:
+    pthread_mutex_lock(&mw_par2_index_lock);
+    for (unsigned int i = 0; (i < nzb_tree.max_files) && !rv; i++) {
+        if (nzb_tree.files[i].par2_filename && (strcmp(nzb_tree.files[i].par2_filename, name) == 0))
+            rv = &nzb_tree.files[i];
+    }
+    pthread_mutex_unlock(&mw_par2_index_lock);
+    free (name);
+    return rv;
+}
+
+/// @brief if every segment of the file was fetched (or tried to).
+/// @param file
+/// @return
+bool unpack_stream_complete(struct NZBFile *file) {
+    return (file->state == NFState_Done) || (file->segmentsSize && !file->remaining_segments && !file->open_segments);
+}
+
+/// @brief looks for a name.partNN.rar w. NN = 1. Only names from the par2 index are used, they're
+///        what the volumes are joined to.
+/// @param
+/// @return true if found
+bool unpack_stream_find_first(void) {
+    extern struct NZB nzb_tree;
+    extern pthread_mutex_t mw_par2_index_lock;
+
+    pthread_mutex_lock(&mw_par2_index_lock);
+    for (unsigned int i = 0; (i < nzb_tree.max_files) && !unpack_stream.first_volume; i++) {
+        char *name = nzb_tree.files[i].par2_filename;
+        size_t base_length;
+        unsigned int number;
+
+        if (!nzb_volume_parse(name, &base_length, &number) || number || (strncasecmp(&name[base_length], ".part", 5) != 0))
+            continue;
+        unpack_stream.first_volume = strdup(name);
+        unpack_stream.base_length = base_length;
+        unpack_stream.digits = (int)(strlen(name) - base_length - 9);   // .part & .rar
+        unpack_stream.next_volume = 0;
+    }
+    pthread_mutex_unlock(&mw_par2_index_lock);
+    return unpack_stream.first_volume != NULL;
+}
+
+/// @brief runs unrar on the first volume, it's stdin stays open for the next ones.
+/// @param
+/// @return false if unrar couldn't be started.
+bool unpack_stream_start(void) {
+    extern struct NZB nzb_tree;
+    char *syscmd;
+    char *rarPassWd = mw_rar_password_provided();
+
+    if (rarPassWd) {
+        syscmd = mprintfv("%s x -vp -o+ -p%s \"%s/%s\" \"%s\" > /dev/null 2>&1", pair_find(config_downloads, "unrarbin"), rarPassWd, nzb_tree.download_destination, unpack_stream.first_volume, nzb_tree.download_destination);
+    } else {
+        syscmd = mprintfv("%s x -vp -o+ \"%s/%s\" \"%s\" > /dev/null 2>&1", pair_find(config_downloads, "unrarbin"), nzb_tree.download_destination, unpack_stream.first_volume, nzb_tree.download_destination);
+    }
+
+    unpack_stream.unrar = popen(syscmd, "w");
+    free (syscmd);
+    if (!unpack_stream.unrar) {
+        LOG_MESSAGE(false, "Couldn't start unrar on %s, errno %i (%s)", unpack_stream.first_volume, errno, strerror(errno));
+        return false;
+    }
+    LOG_MESSAGE(false, "Streaming unpack of %s started.", unpack_stream.first_volume);
+    return true;
+}
+
+/// @brief tells unrar to quit at the next volume, it's waited for in unpack_stream_finish.
+/// @param reason
+void unpack_stream_abort(const char *reason) {
+    LOG_MESSAGE(false, "Streaming unpack of %s stopped: %s, unpacking after verify/repair.", unpack_stream.first_volume ? unpack_stream.first_volume : "-", reason);
+    if (unpack_stream.unrar) {
+        fputs("Q\n", unpack_stream.unrar);
+        fflush(unpack_stream.unrar);
+    }
+    unpack_stream.state = UnpackStream_Aborted;
+}
+
+/// @brief enables the streaming unpack for the next download, if configured (streamunpack="true").
+/// @param
+void unpack_stream_init(void) {
+    unpack_stream_reset();
+    if (!pair_find(config_downloads, "unrarbin") || !pair_find(config_downloads, "streamunpack") ||
+        (strcasecmp(pair_find(config_downloads, "streamunpack"), "true") != 0))
+        return;
+
+    // unrar might be gone when we write to it:
+    signal(SIGPIPE, SIG_IGN);
+    unpack_stream.state = UnpackStream_Waiting;
+}
+
+/// @brief joins the volumes that are complete (in order) and passes them on to unrar.
+///        Called by the main loop while downloading.
+/// @param
+void unpack_stream_poll(void) {
+    if ((unpack_stream.state != UnpackStream_Waiting) && (unpack_stream.state != UnpackStream_Running))
+        return;
+    if (stats_sum(Stats_FailedSegments)) {
+        unpack_stream_abort("failed segments");
+        return;
+    }
+    if ((unpack_stream.state == UnpackStream_Waiting) && !unpack_stream.first_volume && !unpack_stream_find_first())
+        return;
+
+    for (;;) {
+        struct NZBFile *file = unpack_stream_volume(unpack_stream.next_volume);
+
+        if (!file || !unpack_stream_complete(file))
+            break;
+        if (!file->crcOk) {
+            unpack_stream_abort("CRC error");
+            return;
+        }
+        // stored volumes are unpacked by the workers already:
+        if ((unpack_stream.state == UnpackStream_Waiting) && rarstore_handles(file)) {
+            LOG_MESSAGE(false, "%s is unpacked directly, no streaming unpack.", unpack_stream.first_volume);
+            unpack_stream.state = UnpackStream_Off;
+            return;
+        }
+        if (file->state != NFState_Done)
+            mw_join_segments(file);
+
+        if (unpack_stream.state == UnpackStream_Waiting) {
+            if (!unpack_stream_start()) {
+                unpack_stream.state = UnpackStream_Aborted;
+                return;
+            }
+            unpack_stream.state = UnpackStream_Running;
+        } else {
+            // the answer to the -vp question before the next volume:
+            fputs("C\n", unpack_stream.unrar);
+            fflush(unpack_stream.unrar);
+        }
+        unpack_stream.next_volume++;
+    }
+}
+
+/// @brief feeds the volumes that are left and waits for unrar, after everything was joined.
+/// @param
+/// @return true if the archive was unpacked completely.
+bool unpack_stream_finish(void) {
+    int rc;
+
+    unpack_stream_poll();
+    if (!unpack_stream.unrar)
+        return false;
+
+    // only read if unrar asks for a volume beyond the last one we have:
+    fputs("Q\n", unpack_stream.unrar);
+    rc = pclose(unpack_stream.unrar);
+    unpack_stream.unrar = NULL;
+    if (WIFEXITED(rc))
+        rc = WEXITSTATUS(rc);
+
+    if (unpack_stream.state != UnpackStream_Running)
+        return false;
+    if (rc != 0) {
+        LOG_MESSAGE(false, "Streaming unpack of %s failed, unrar returned %i.", unpack_stream.first_volume, rc);
+        unpack_stream.state = UnpackStream_Aborted;
+        return false;
+    }
+    LOG_MESSAGE(false, "Streaming unpack of %s finished, %u volumes.", unpack_stream.first_volume, unpack_stream.next_volume);
+    unpack_stream.state = UnpackStream_Done;
+    return true;
+}
+
+/// @brief if the archive w. this first volume was unpacked while downloading.
+/// @param first_volume
+/// @return
+bool unpack_stream_unpacked(const char *first_volume) {
+    return (unpack_stream.state == UnpackStream_Done) && (strcmp(unpack_stream.first_volume, first_volume) == 0);
+}
+
+/// @brief stops a running unrar and forgets everything.
+/// @param
+void unpack_stream_reset(void) {
+    if (unpack_stream.unrar) {
+        fputs("Q\n", unpack_stream.unrar);
+        pclose(unpack_stream.unrar);
+    }
+    free (unpack_stream.first_volume);
+    memset(&unpack_stream, 0, sizeof(struct unpack_stream));
+}
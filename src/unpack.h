@@ -0,0 +1,31 @@
+#ifndef UNPACK_H
+#define UNPACK_H
+#include <stdbool.h>
+#include <stdio.h>
+
+// Streaming unpack: unrar starts on part01 while the download is still running and is fed
+// the next volume as soon as it's complete. Any damage ends it, the archive is unpacked after
+// verify/repair then (mw_unrar).
+enum Unpack_Stream_State {
+    UnpackStream_Off = 0,       // not configured, or not possible for this nzb
+    UnpackStream_Waiting,       // for part01
+    UnpackStream_Running,       // unrar runs, the volumes up to next_volume were fed
+    UnpackStream_Aborted,       // damage, or unrar failed
+    UnpackStream_Done           // the archive is unpacked
+};
+
+struct unpack_stream {
+    int         state;          // one of Unpack_Stream_State
+    FILE        *unrar;         // unrar's stdin, it waits for a "C" before every next volume (-vp)
+    char        *first_volume;  // the name of part01
+    size_t      base_length;    // name.partNN.rar: the length of "name"
+    int         digits;         // of NN
+    unsigned int next_volume;   // 0-based, the volume unrar asks for next
+};
+
+void unpack_stream_init(void);
+void unpack_stream_poll(void);
+bool unpack_stream_finish(void);
+bool unpack_stream_unpacked(const char *first_volume);
+void unpack_stream_reset(void);
+#endif
@@ -1,6 +1,7 @@
 /*
  * debug/helper stuff
  */
+#include <sys/mman.h>
 #include "utils.h"
 
 const char *fmtFile = "%s %s%s";
@@ -208,3 +209,63 @@ char* mprintfv(char *fmt, ...) {
     return rv;
     
 }
+
+/// @brief reserves size bytes of address space for an arena (no memory is used until it's touched).
+/// @param arena 
+/// @param size 
+/// @return false if the reservation failed.
+bool arena_reserve(struct arena *arena, uint64_t size) {
+    arena->used = 0;
+    arena->reserved = 0;
+    arena->base = (uint8_t*)mmap(NULL, size ? size : 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (arena->base == MAP_FAILED) {
+        LOG_MESSAGE(true, "Couldn't reserve %lu bytes, errno %i (%s)", size, errno, strerror(errno));
+        arena->base = NULL;
+        return false;
+    }
+    arena->reserved = size;
+    return true;
+}
+
+/// @brief takes size bytes from the arena, they're zeroed.
+/// @param arena 
+/// @param size 
+/// @param align a power of 2
+/// @return NULL if the arena is full.
+void *arena_alloc(struct arena *arena, uint64_t size, uint64_t align) {
+    uint64_t start = (arena->used + align - 1) & ~(align - 1);
+
+    if (!arena->base || (start + size > arena->reserved))
+        return NULL;
+    arena->used = start + size;
+    return &arena->base[start];
+}
+
+/// @brief maps size bytes of a file as a (full) arena, arena_release() unmaps it like any other.
+/// @param arena 
+/// @param fd 
+/// @param offset page aligned
+/// @param size 
+/// @param shared true = changes go back to the file
+/// @return false if the mapping failed.
+bool arena_map_file(struct arena *arena, int fd, uint64_t offset, uint64_t size, bool shared) {
+    arena->used = 0;
+    arena->reserved = 0;
+    arena->base = (uint8_t*)mmap(NULL, size ? size : 1, PROT_READ | PROT_WRITE, shared ? MAP_SHARED : MAP_PRIVATE, fd, (off_t)offset);
+    if (arena->base == MAP_FAILED) {
+        LOG_MESSAGE(true, "Couldn't map %lu bytes at %lu, errno %i (%s)", size, offset, errno, strerror(errno));
+        arena->base = NULL;
+        return false;
+    }
+    arena->used = size;
+    arena->reserved = size;
+    return true;
+}
+
+/// @brief gives the whole arena back.
+/// @param arena 
+void arena_release(struct arena *arena) {
+    if (arena->base)
+        munmap(arena->base, arena->reserved ? arena->reserved : 1);
+    memset(arena, 0, sizeof(struct arena));
+}
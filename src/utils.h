@@ -14,6 +14,14 @@
 
 #define LOG_MESSAGE(to_stderr, fmt, ...) logMessage(__FILE__, __LINE__, to_stderr, fmt, ##__VA_ARGS__)
 
+// address space that's reserved once and backed by the kernel page by page as it's used,
+// growing it never copies and nothing allocated from it ever moves.
+struct arena {
+    uint8_t     *base;
+    uint64_t    used;
+    uint64_t    reserved;
+};
+
 char* mprintfv(char *fmt, ...);
 void logMessage(char *file, unsigned int line, bool to_stderr, char *fmt, ...);
 const char *convert_value_to_human(uint64_t value, double *human);
@@ -21,4 +29,8 @@ bool contains_filename(const char *haystack, char **dupstr);
 void q_printf(char* fmt, ...);
 bool string_ends_width(char* haystack, char* needle);
 bool write_to_file(char* filepath, uint8_t *buffer, uint64_t size);
+bool arena_reserve(struct arena *arena, uint64_t size);
+void *arena_alloc(struct arena *arena, uint64_t size, uint64_t align);
+bool arena_map_file(struct arena *arena, int fd, uint64_t offset, uint64_t size, bool shared);
+void arena_release(struct arena *arena);
 #endif 
\ No newline at end of file
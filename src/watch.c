@@ -0,0 +1,135 @@
+/*
+ * Watch-folder mode: every nzb written to (or moved into) a directory is downloaded, then moved
+ * to done/ or failed/. It sleeps in read() on the inotify fd while there's nothing to do.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <dirent.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "utils.h"
+#include "watch.h"
+
+// non "exported" functions:
+bool watch_prepare_dir(const char *dir, const char *sub);
+void watch_process(const char *dir, char *name, bool (*download)(char *filename));
+void watch_scan(const char *dir, bool (*download)(char *filename));
+
+bool watch_prepare_dir(const char *dir, const char *sub) {
+    char *path = mprintfv("%s/%s", dir, sub);
+    bool rv = true;
+
+    if ((mkdir(path, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) != 0) && (errno != EEXIST)) {
+        LOG_MESSAGE(true, "Couldn't create directory: %s, Errno: %d - %s\n", path, errno, strerror(errno));
+        rv = false;
+    }
+    free (path);
+    return rv;
+}
+
+/// @brief downloads one nzb of the watched directory and moves it out of the way.
+/// @param dir the watched directory
+/// @param name the nzb in it
+/// @param download
+void watch_process(const char *dir, char *name, bool (*download)(char *filename)) {
+    char *path, *target;
+    struct stat nzb_stat;
+    bool ok;
+
+    if (!string_ends_width(name, ".nzb"))
+        return;
+
+    // an event of a nzb we did already (found by the scan and moved):
+    path = mprintfv("%s/%s", dir, name);
+    if ((stat(path, &nzb_stat) != 0) || !S_ISREG(nzb_stat.st_mode)) {
+        free (path);
+        return;
+    }
+
+    LOG_MESSAGE(false, "Watch: %s", path);
+    ok = download(path);
+
+    // -r might have removed it already:
+    target = mprintfv("%s/%s/%s", dir, ok ? WATCH_DONE_DIR : WATCH_FAILED_DIR, name);
+    if ((rename(path, target) != 0) && (errno != ENOENT))
+        LOG_MESSAGE(true, "Couldn't move %s to %s, Errno: %d - %s\n", path, target, errno, strerror(errno));
+    q_printf("%s: %s\n", name, ok ? "done" : "failed");
+    free (target);
+    free (path);
+}
+
+/// @brief downloads every nzb that's in the directory (at the start, after an event overflow).
+/// @param dir
+/// @param download
+void watch_scan(const char *dir, bool (*download)(char *filename)) {
+    struct dirent **entries;
+    int entries_length = scandir(dir, &entries, NULL, alphasort);
+
+    if (entries_length < 0) {
+        LOG_MESSAGE(true, "Couldn't read %s, Errno: %d - %s\n", dir, errno, strerror(errno));
+        return;
+    }
+    for (int i = 0; i < entries_length; i++) {
+        watch_process(dir, entries[i]->d_name, download);
+        free (entries[i]);
+    }
+    free (entries);
+}
+
+/// @brief watches dir for nzbs (finished writes and moves into it) and downloads them one by one.
+///        Runs until the watch fails.
+/// @param watched the directory, relative or absolute
+/// @param download downloads a nzb, true if it's complete
+/// @return false (the directory can't be watched (anymore)).
+bool watch_folder(const char *watched, bool (*download)(char *filename)) {
+    char events[sizeof(struct inotify_event) * 64 + NAME_MAX + 1] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char dir[PATH_MAX];
+    int fd;
+
+    // the nzbs are queued w. absolute paths, nothing depends on the current directory:
+    if (!realpath(watched, dir)) {
+        LOG_MESSAGE(true, "Couldn't find %s, Errno: %d - %s\n", watched, errno, strerror(errno));
+        return false;
+    }
+    if (!watch_prepare_dir(dir, WATCH_DONE_DIR) || !watch_prepare_dir(dir, WATCH_FAILED_DIR))
+        return false;
+
+    // the watch comes first, so nothing gets lost between the scan and the first event:
+    fd = inotify_init1(IN_CLOEXEC);
+    if ((fd == -1) || (inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) == -1)) {
+        LOG_MESSAGE(true, "Couldn't watch %s, Errno: %d - %s\n", dir, errno, strerror(errno));
+        if (fd != -1)
+            close (fd);
+        return false;
+    }
+
+    q_printf("Watching %s for nzb files.\n", dir);
+    watch_scan(dir, download);
+
+    for (;;) {
+        ssize_t length = read(fd, events, sizeof(events));
+
+        if (length <= 0) {
+            if ((length == -1) && (errno == EINTR))
+                continue;
+            LOG_MESSAGE(true, "Watching %s failed, Errno: %d - %s\n", dir, errno, strerror(errno));
+            break;
+        }
+        for (char *pos = events; pos < events + length; ) {
+            struct inotify_event *event = (struct inotify_event*)pos;
+
+            if (event->mask & IN_Q_OVERFLOW)
+                watch_scan(dir, download);
+            else if (event->len && !(event->mask & IN_ISDIR))
+                watch_process(dir, event->name, download);
+            pos += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    close (fd);
+    return false;
+}
@@ -0,0 +1,10 @@
+#ifndef WATCH_H
+#define WATCH_H
+#include <stdbool.h>
+
+// the subdirectories of the watched directory the nzbs are moved to:
+#define WATCH_DONE_DIR      "done"
+#define WATCH_FAILED_DIR    "failed"
+
+bool watch_folder(const char *watched, bool (*download)(char *filename));
+#endif
@@ -8,7 +8,14 @@
 #include <ctype.h>
 #include <pcre2.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <openssl/evp.h>
 #include "xmlhandler.h"
+#include "nzbcache.h"
 
 // non "exported" functions:
 char *xml_load_file(char *filename);
@@ -23,20 +30,52 @@ void parse_nzb_text_data(void *userData, const XML_Char *s, int len);
 
 void parse_nzb_element_file(const char **attribs, struct NZBFile* file);
 void parse_nzb_element_segment(void *userData, const char **attribs);
+void nzb_article_append(struct NZBSegment *seg, const char *s, int len);
 
 struct NZBSegment* nzb_tree_find_segment_from_file (struct NZBFile *haystack, unsigned int needle);
+int nzb_segment_compare (const void *a, const void *b);
+unsigned int nzb_segment_lower_bound (struct NZBSegment *segments, unsigned int length, unsigned int number);
+unsigned int nzb_segment_index (struct NZBFile *file, unsigned int number);
+void *nzb_loader_work (void *arg);
+void nzb_pass_build (void);
+bool nzb_pass_pop (struct nzb_pass_worker *worker, uint32_t *entry);
+bool nzb_pass_steal (struct nzb_pass_worker *thief);
+int nzb_pass_chunk_compare (const void *a, const void *b);
+bool nzb_pass_claim (unsigned int worker, struct NZBFile **inpFile, struct NZBSegment **inpSeg);
 
 // local variables:
 struct pair *config_server = NULL;
 struct pair *config_downloads = NULL;
 
-struct NZB  nzb_tree = { .files = NULL, .max_files = 0, .name = NULL, .release_size = 0, .current_file = 0, .release_downloaded = 0, .rename_files_to = 0 } ;
+struct NZB  nzb_tree = { .files = NULL, .max_files = 0, .name = NULL, .release_size = 0, .rename_files_to = 0 } ;
 bool        parse_is_nzb_head = false;
 XML_Parser  nzbParser; 
 
 char*       nzb_meta_password = NULL;
 
 pthread_mutex_t     nzb_tree_next_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t      nzb_tree_published = PTHREAD_COND_INITIALIZER;     // new segments or the end of the nzb
+
+// the streaming parser, it runs while the download already started:
+pthread_t           nzb_loader_thread;
+bool                nzb_loader_running = false;     // started and not joined yet
+int                 nzb_loader_fd = -1;
+struct stat         nzb_loader_stat;
+unsigned int        nzb_pass_workers = 1;           // the number of connections asking for segments, see nzb_schedule_set_workers
+struct parse_userdata nzb_loader_userdata = { .file = NULL, .segment = NULL, .text_type = XMLText_ArticleID };
+const size_t        nzb_loader_chunk_size = 1024 * 1024;
+const long          nzb_loader_head_start_ms = 200;
+pcre2_code          *volpar_comp = NULL;
+pcre2_match_data    *volpar_match = NULL;
+
+// the download orders, "schedule" in the config:
+const struct nzb_schedule_policy nzb_schedule_policies[] = {
+    { "nzb",        nzb_priority_nzb_order, NULL },
+    { "metadata",   nzb_priority_metadata_first, NULL },
+    { "volumes",    nzb_priority_volumes, nzb_compare_volumes },
+    { NULL, NULL, NULL }
+};
+const char *nzb_schedule_default = "metadata";
 
 char *xml_load_file(char *filename) {
     FILE *inFile = NULL;
@@ -251,25 +290,24 @@ char* pair_find(struct pair *keyval, char* needle) {
     return rv;
 }
 
-/// @brief loads a nzb File and parses it.
+/// @brief opens a nzb file and starts parsing it in the background. Returns as soon as the
+///        first <file/> is complete, everything else is published to the scheduler as it's parsed.
 /// @param filename 
 /// @return success
 bool nzb_load(char *filename) {
-    char *buffer = xml_load_file(filename);
     char *p_name_start, *p_name_end;
-    nzbParser = XML_ParserCreate(NULL);
-    struct parse_userdata my_userdata =  { .file = NULL, .segment = NULL, .text_type = XMLText_ArticleID};
-    const PCRE2_SPTR RE_volpar = (PCRE2_SPTR8)"vol[0-9]{2,3}\\+[0-9]{2,3}.par2";
-    pcre2_code *volpar_comp;
-    pcre2_match_data *volpar_match;
+    const PCRE2_SPTR RE_volpar = (PCRE2_SPTR8)"vol([0-9]{2,5})\\+([0-9]{2,5}).par2";
     int pcre_err;
     PCRE2_SIZE errOffset;
+    struct timespec head_start;
+    const char *schedule;
+    bool rv, head_start_over = false;
 
-    if (!buffer)
-        return false;
-
-    if (!nzbParser)
+    nzb_loader_fd = open(filename, O_RDONLY);
+    if ((nzb_loader_fd == -1) || (fstat(nzb_loader_fd, &nzb_loader_stat) != 0)) {
+        LOG_MESSAGE(true, "Couldn't open: %s, Error: %s (%i)", filename, strerror(errno), errno);
         return false;
+    }
 
     nzb_tree.name = strdup(filename);
 
@@ -281,29 +319,139 @@ bool nzb_load(char *filename) {
 
     if (p_name_end > p_name_start)
         nzb_tree.display_name = strndup(p_name_start, (int)(p_name_end-p_name_start)-1);
-    
+
+    // the filename contains vol[0-9]{2,5}+[0-9]{2,5}.par2 ?
+    volpar_comp = pcre2_compile(RE_volpar, PCRE2_ZERO_TERMINATED, 0, &pcre_err, &errOffset, NULL);
+    volpar_match = pcre2_match_data_create_from_pattern(volpar_comp, NULL);
+
+    // the streaming unpack wants the volumes in order:
+    schedule = pair_find(config_downloads, "schedule");
+    if (!schedule && pair_find(config_downloads, "streamunpack") && (strcasecmp(pair_find(config_downloads, "streamunpack"), "true") == 0))
+        schedule = "volumes";
+    nzb_schedule_init(schedule);
+
+    // parsed before ? then it's all there already:
+    if (nzb_cache_load(nzb_loader_fd, &nzb_loader_stat)) {
+        close (nzb_loader_fd);
+        nzb_loader_fd = -1;
+        pcre2_match_data_free(volpar_match);
+        pcre2_code_free(volpar_comp);
+        return nzb_tree.max_files > 0;
+    }
+
+    // every <file></file> is at least 13 bytes, a <segment/> 10 and a message id can't be longer
+    // than the nzb, so these can't run out. The pages are only backed when they're used and
+    // nothing moves while the download threads use it.
+    if (!arena_reserve(&nzb_tree.file_arena, sizeof(struct NZBFile) * (nzb_loader_stat.st_size / 13 + 1)) ||
+        !arena_reserve(&nzb_tree.segment_arena, sizeof(struct NZBSegment) * (nzb_loader_stat.st_size / 10 + 1)) ||
+        !arena_reserve(&nzb_tree.articles, (uint64_t)nzb_loader_stat.st_size + 1 < UINT32_MAX ? (uint64_t)nzb_loader_stat.st_size + 1 : UINT32_MAX) ||
+        !arena_reserve(&nzb_tree.positions, sizeof(uint64_t) * (nzb_loader_stat.st_size / 10 + nzb_loader_stat.st_size / 13 + 2))) {
+        close (nzb_loader_fd);
+        return false;
+    }
+    nzb_tree.files = (struct NZBFile*)nzb_tree.file_arena.base;
+    arena_alloc(&nzb_tree.articles, 1, 1);   // article 0 is "" (no message id)
+
+    nzbParser = XML_ParserCreate(NULL);
+    if (!nzbParser)
+        return false;
+
     XML_SetElementHandler(nzbParser, parse_nzb_start_element, parse_nzb_end_element);
     XML_SetCharacterDataHandler(nzbParser, parse_nzb_text_data);
-    XML_SetUserData(nzbParser, &my_userdata);
-    if (XML_Parse(nzbParser, buffer, strlen(buffer), true) == XML_STATUS_ERROR)  {
-        LOG_MESSAGE(true, "Parse error at line %lu:\n%s\n", XML_GetCurrentLineNumber(nzbParser), XML_ErrorString(XML_GetErrorCode(nzbParser)));       
-        XML_ParserFree(nzbParser);
+    XML_SetUserData(nzbParser, &nzb_loader_userdata);
+
+    nzb_tree.loading = true;
+    if (pthread_create(&nzb_loader_thread, NULL, nzb_loader_work, NULL) != 0) {
+        LOG_MESSAGE(true, "Couldn't start the nzb parser thread.");
+        nzb_tree.loading = false;
         return false;
     }
+    nzb_loader_running = true;
 
-    // iterate thru the list, check if
-    // the filename contains vol[0-9]{2,3]}+[0-9]{2,3}.par2 
-    volpar_comp = pcre2_compile(RE_volpar, PCRE2_ZERO_TERMINATED, 0, &pcre_err, &errOffset, NULL);
-    volpar_match = pcre2_match_data_create_from_pattern(volpar_comp, NULL);
+    // give the parser a head start, so small nzbs are complete (and scheduled by priority) before
+    // the first request. Big ones go on in the background as soon as a file is there.
+    clock_gettime(CLOCK_REALTIME, &head_start);
+    head_start.tv_nsec += nzb_loader_head_start_ms * 1000000L;
+    head_start.tv_sec += head_start.tv_nsec / 1000000000L;
+    head_start.tv_nsec %= 1000000000L;
 
-    for (unsigned int fileCnt = 0; fileCnt < nzb_tree.max_files; fileCnt++) {
-        if (pcre2_match(volpar_comp, (const PCRE2_SPTR8)nzb_tree.files[fileCnt].filename, PCRE2_ZERO_TERMINATED, 0, 0, volpar_match, NULL) >= 0)
-            nzb_tree.files[fileCnt].is_par_vol_file = true;
-        else
-            nzb_tree.files[fileCnt].is_par_vol_file = false;
+    pthread_mutex_lock(&nzb_tree_next_mutex);
+    while (nzb_tree.loading) {
+        // once the head start is over, the first file (a huge one, a long <head>..) is waited for w/o timeout:
+        if (head_start_over)
+            pthread_cond_wait(&nzb_tree_published, &nzb_tree_next_mutex);
+        else if (pthread_cond_timedwait(&nzb_tree_published, &nzb_tree_next_mutex, &head_start) == ETIMEDOUT)
+            head_start_over = true;
+        if (head_start_over && nzb_tree.max_files)
+            break;
     }
+    rv = (nzb_tree.max_files > 0) && !nzb_tree.parse_failed;
+    pthread_mutex_unlock(&nzb_tree_next_mutex);
 
-    return true;
+    return rv;
+}
+
+/// @brief the parser thread: reads the nzb in chunks into expat's buffer.
+/// @param arg -
+/// @return NULL
+void *nzb_loader_work (void *arg) {
+    extern bool mw_quit_download;
+    EVP_MD_CTX *md5_ctx = EVP_MD_CTX_new();
+    uint8_t nzb_md5[16];
+    bool parsed = false;
+    (void)arg;
+
+    // the md5 identifies the nzb for the cache:
+    EVP_DigestInit_ex(md5_ctx, EVP_md5(), NULL);
+    for (;;) {
+        void *buffer = XML_GetBuffer(nzbParser, nzb_loader_chunk_size);
+        ssize_t length;
+
+        if (!buffer) {
+            LOG_MESSAGE(true, "Parse error: out of memory.");
+            break;
+        }
+        length = read(nzb_loader_fd, buffer, nzb_loader_chunk_size);
+        if (length < 0) {
+            if (errno == EINTR)
+                continue;
+            LOG_MESSAGE(true, "Couldn't read %s, Error: %s (%i)", nzb_tree.name, strerror(errno), errno);
+            break;
+        }
+        EVP_DigestUpdate(md5_ctx, buffer, length);
+        if (XML_ParseBuffer(nzbParser, length, length == 0) == XML_STATUS_ERROR) {
+            LOG_MESSAGE(true, "Parse error at line %lu:\n%s\n", XML_GetCurrentLineNumber(nzbParser), XML_ErrorString(XML_GetErrorCode(nzbParser)));
+            break;
+        }
+        if (!length) {
+            parsed = true;
+            break;
+        }
+    }
+    EVP_DigestFinal_ex(md5_ctx, nzb_md5, NULL);
+    EVP_MD_CTX_free(md5_ctx);
+
+    close (nzb_loader_fd);
+    nzb_loader_fd = -1;
+    XML_ParserFree(nzbParser);
+    pcre2_match_data_free(volpar_match);
+    pcre2_code_free(volpar_comp);
+
+    pthread_mutex_lock(&nzb_tree_next_mutex);
+    nzb_tree.loading = false;
+    // the download of a truncated tree can't complete the release, the workers stop:
+    if (!parsed) {
+        nzb_tree.parse_failed = true;
+        mw_quit_download = true;
+    }
+    LOG_MESSAGE(false, "NZB parsed: %u files, %lu segments, %lu missing.", nzb_tree.max_files, nzb_tree.schedule_length, nzb_tree.missing_segments);
+    pthread_cond_broadcast(&nzb_tree_published);
+    pthread_mutex_unlock(&nzb_tree_next_mutex);
+
+    // the next start of this nzb maps it instead:
+    if (parsed)
+        nzb_cache_write(nzb_md5, &nzb_loader_stat);
+    return NULL;
 }
 
 /// @brief extract the necessary data from the xml-nzb attribs, trys to read a filename.
@@ -352,11 +500,18 @@ void parse_nzb_element_segment(void *userData, const char **attribs) {
     nzbfile->file_size += bytes;
     // we only download stuff, so bytes > 0 AND number is a 1-based index.
     if ((bytes > 0) && (number > 0)) {
-        nzbfile->segments = (struct NZBSegment*)realloc(nzbfile->segments, sizeof(struct NZBSegment) * (nzbfile->segmentsSize+1));
-        nzbfile->segments[nzbfile->segmentsSize].articleID = NULL;
-        nzbfile->segments[nzbfile->segmentsSize].bytes = bytes;
-        nzbfile->segments[nzbfile->segmentsSize].number = number;
-        data->segment = &nzbfile->segments[nzbfile->segmentsSize];
+        // the file's segments are the tail of the arena, so this is &nzbfile->segments[segmentsSize]:
+        struct NZBSegment *seg = (struct NZBSegment*)arena_alloc(&nzb_tree.segment_arena, sizeof(struct NZBSegment), _Alignof(struct NZBSegment));
+        if (!seg) {
+            LOG_MESSAGE(true, "Too many segments in the nzb.");
+            XML_StopParser(nzbParser, false);
+            return;
+        }
+        seg->bytes = bytes;
+        seg->number = number;
+        seg->offset = NZBSEGMENT_OFFSET_UNKNOWN;
+        seg->state = NSState_Pending;
+        data->segment = seg;
         nzbfile->segmentsSize++;
     }
 }
@@ -376,13 +531,18 @@ void parse_nzb_start_element(void *userData, const char *name, const char **attr
             }
         }
     } else if (strcmp(name, "file") == 0) {
-        // begins a "<file..>":
-        nzb_tree.files = (struct NZBFile*)realloc(nzb_tree.files, sizeof(struct NZBFile)*(nzb_tree.max_files+1));
-        parse_nzb_element_file(attribs, &nzb_tree.files[nzb_tree.max_files]);
-        data->file = &nzb_tree.files[nzb_tree.max_files];
+        // begins a "<file..>", it's invisible for everyone else until </file>:
+        data->file = (struct NZBFile*)arena_alloc(&nzb_tree.file_arena, sizeof(struct NZBFile), _Alignof(struct NZBFile));
+        if (!data->file) {
+            LOG_MESSAGE(true, "Too many files in the nzb.");
+            XML_StopParser(nzbParser, false);
+            return;
+        }
+        parse_nzb_element_file(attribs, data->file);
+        // it's segments follow in the segment arena:
+        data->file->segments = (struct NZBSegment*)&nzb_tree.segment_arena.base[nzb_tree.segment_arena.used];
         data->text_type = XMLText_ArticleID;
-        nzb_tree.max_files++;
-    } else if (strcmp(name, "segment") == 0) {
+    } else if ((strcmp(name, "segment") == 0) && data->file) {
         parse_nzb_element_segment(userData, attribs);
     }
 }
@@ -395,14 +555,51 @@ void parse_nzb_end_element(void *userData, const char* name) {
     if (strcmp(name, "meta") == 0) {
         parse_is_nzb_head = false;
         data->text_type = XMLText_ArticleID;
-    } else if (strcmp(name, "file") == 0) {
+    } else if ((strcmp(name, "file") == 0) && data->file) {
+        if (!nzb_file_index_segments(data->file)) {
+            XML_StopParser(nzbParser, false);
+            data->file = NULL;
+            return;
+        }
         data->file->remaining_segments = data->file->segmentsSize;
+        nzb_schedule_publish_file(data->file - nzb_tree.files);
         data->file = NULL; // after file/>
     } else if (strcmp(name, "segment") == 0) {
         data->segment = NULL; // after segment/>
     }
 }
 
+/// @brief appends message id text to the pool. The segment being parsed always owns the last string
+///        of the pool, so a 2nd piece of the same id (chunk borders, entities) just continues it.
+/// @param seg 
+/// @param s 
+/// @param len 
+void nzb_article_append(struct NZBSegment *seg, const char *s, int len) {
+    char *dst;
+
+    if (seg->article)
+        nzb_tree.articles.used--;   // overwrite the \0
+    else
+        seg->article = (uint32_t)nzb_tree.articles.used;
+
+    dst = (char*)arena_alloc(&nzb_tree.articles, len + 1, 1);
+    if (!dst) {
+        LOG_MESSAGE(true, "Message ids of the nzb don't fit into the pool.");
+        seg->article = 0;
+        XML_StopParser(nzbParser, false);
+        return;
+    }
+    memcpy(dst, s, len);
+    dst[len] = 0;
+}
+
+/// @brief the message id of a segment.
+/// @param seg 
+/// @return the id, "" if the nzb didn't have one.
+char *nzb_segment_article (struct NZBSegment *seg) {
+    return (char*)&nzb_tree.articles.base[seg->article];
+}
+
 /// @brief this reads the articleIDs from the text-area of the node.
 /// @param userData the parse-userdata-struct
 /// @param s the text itself.
@@ -410,22 +607,18 @@ void parse_nzb_end_element(void *userData, const char* name) {
 void parse_nzb_text_data(void *userData, const XML_Char *s, int len) {
     struct parse_userdata *data = (struct parse_userdata*)userData;    
     bool isBlankText = true;
-    char *text = strndup(s, len);
 
     switch (data->text_type) {
         case XMLText_ArticleID:
             if (data->segment) {
-                if (text) {
-                    for (int c = 0; c < len; c++) {
-                        if (!isspace(text[c])) {
-                            isBlankText = false;
-                            break;
-                        }
+                for (int c = 0; c < len; c++) {
+                    if (!isspace(s[c])) {
+                        isBlankText = false;
+                        break;
                     }
-                    free (text);            
-                    if (!isBlankText)
-                        data->segment->articleID = strndup(s, len);
                 }
+                if (!isBlankText)
+                    nzb_article_append(data->segment, s, len);
             }
             break;
         case XMLText_Password:
@@ -438,114 +631,592 @@ void parse_nzb_text_data(void *userData, const XML_Char *s, int len) {
 /// @param haystack the File we're looking our segment for.
 /// @param needle the number (NZB-1-based !!!!) we're looking for
 /// @return the found segment, or NULL if the segment isn't available.
-struct NZBSegment* nzb_tree_find_segment_from_file (struct NZBFile *haystack, unsigned int needle) {
-    struct NZBSegment* rv = NULL;
-    unsigned int segit = 0;
+/// @brief the order of the segments: by number, the same number in nzb order (the article pool is).
+/// @param a 
+/// @param b 
+/// @return <0, 0, >0
+int nzb_segment_compare (const void *a, const void *b) {
+    const struct NZBSegment *seg_a = (const struct NZBSegment*)a, *seg_b = (const struct NZBSegment*)b;
+
+    if (seg_a->number != seg_b->number)
+        return seg_a->number < seg_b->number ? -1 : 1;
+    return (seg_a->article > seg_b->article) - (seg_a->article < seg_b->article);
+}
+
+/// @brief the first segment w. a number >= number.
+/// @param segments sorted by number
+/// @param length 
+/// @param number 
+/// @return the index, length if there's none.
+unsigned int nzb_segment_lower_bound (struct NZBSegment *segments, unsigned int length, unsigned int number) {
+    unsigned int low = 0, high = length;
+
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        if (segments[mid].number < number)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
 
-    while (segit < haystack->segmentsSize) {
-        if (haystack->segments[segit].number == needle) {
-            rv = &haystack->segments[segit];
+/// @brief the index of number in file->segments, or of the next higher number.
+/// @param file 
+/// @param number 
+/// @return the index, segmentsSize if there's none.
+unsigned int nzb_segment_index (struct NZBFile *file, unsigned int number) {
+    // no gaps in front of it (the usual case), number n is at n-1:
+    if ((number > 0) && (number <= file->segmentsSize) && (file->segments[number - 1].number == number))
+        return number - 1;
+    return nzb_segment_lower_bound(file->segments, file->segmentsSize, number);
+}
+
+/// @brief sorts the segments of a file by number and moves duplicate numbers (reposts) behind the
+///        segments as alternates. Counts the numbers the nzb doesn't have and builds the positions.
+/// @param file a complete <file/>, it's segments are still the tail of the segment arena
+/// @return false if the positions don't fit.
+bool nzb_file_index_segments (struct NZBFile *file) {
+    struct NZBSegment *segments = file->segments, *duplicates = NULL;
+    unsigned int unique = 0, alternates = 0;
+
+    for (unsigned int i = 1; i < file->segmentsSize; i++) {
+        if (nzb_segment_compare(&segments[i - 1], &segments[i]) > 0) {
+            qsort(segments, file->segmentsSize, sizeof(struct NZBSegment), nzb_segment_compare);
             break;
         }
-        segit++;
     }
 
-    return rv;
+    // the first of each number is the one we fetch, the others are only tried if that fails:
+    for (unsigned int i = 0; i < file->segmentsSize; i++) {
+        if (unique && (segments[unique - 1].number == segments[i].number)) {
+            if (!(alternates % 64))
+                duplicates = (struct NZBSegment*)realloc(duplicates, sizeof(struct NZBSegment) * (alternates + 64));
+            duplicates[alternates++] = segments[i];
+            if (segments[unique - 1].alternates < UINT8_MAX)
+                segments[unique - 1].alternates++;
+            continue;
+        }
+        segments[unique++] = segments[i];
+    }
+    if (alternates) {
+        memcpy(&segments[unique], duplicates, sizeof(struct NZBSegment) * alternates);
+        free (duplicates);
+        LOG_MESSAGE(false, "%s: %u segments are reposted, they're kept as alternates.", file->filename, alternates);
+    }
+    file->segmentsSize = unique;
+    file->alternatesSize += alternates;
+
+    file->missing_segments = unique ? segments[unique - 1].number - unique : 0;
+    if (file->missing_segments) {
+        nzb_tree.missing_segments += file->missing_segments;
+        LOG_MESSAGE(false, "%s: %u of %u segments are missing in the nzb.", file->filename, file->missing_segments, segments[unique - 1].number);
+    }
+
+    file->positions = (uint64_t*)arena_alloc(&nzb_tree.positions, sizeof(uint64_t) * (unique + 1), _Alignof(uint64_t));
+    if (!file->positions) {
+        LOG_MESSAGE(true, "Too many segments in the nzb.");
+        return false;
+    }
+    for (unsigned int i = 0; i < unique; i++)
+        file->positions[i + 1] = file->positions[i] + segments[i].bytes;
+
+    // the reposts and the dropped segments aren't part of the size:
+    nzb_tree.release_size -= file->file_size;
+    file->file_size = file->positions[unique];
+    nzb_tree.release_size += file->file_size;
+    return true;
 }
 
-/// @brief gets the next segment in line, returning the filename and the articleID
-/// @param curFile - pointer to pointer of current file processing
-/// @param curSeg - poiner to pointer of current segment processing
-/// @return true = more segments/filenames
-bool nzb_tree_next_segment (struct NZBFile **inpFile, struct NZBSegment **inpSeg) {
-    struct NZBFile *curFile;
+/// @brief a repost of the same segment.
+/// @param file 
+/// @param seg one of file->segments
+/// @param alternate 0..seg->alternates-1
+/// @return the alternate or NULL.
+struct NZBSegment *nzb_segment_alternate (struct NZBFile *file, struct NZBSegment *seg, unsigned int alternate) {
+    unsigned int first;
+
+    if (alternate >= seg->alternates)
+        return NULL;
+    first = nzb_segment_lower_bound(&file->segments[file->segmentsSize], file->alternatesSize, seg->number);
+    if (first + alternate >= file->alternatesSize)
+        return NULL;
+    return &file->segments[file->segmentsSize + first + alternate];
+}
+
+struct NZBSegment* nzb_tree_find_segment_from_file (struct NZBFile *haystack, unsigned int needle) {
+    unsigned int idx = nzb_segment_index(haystack, needle);
+
+    if ((idx < haystack->segmentsSize) && (haystack->segments[idx].number == needle))
+        return &haystack->segments[idx];
+    return NULL;
+}
+
+/// @brief if a file belongs to the current download pass (mw_download_type)
+/// @param file 
+/// @return true if it's segments should be fetched now.
+bool nzb_file_in_download_pass (struct NZBFile *file) {
     extern int mw_download_type;
 
-    if (nzb_tree.current_file >= nzb_tree.max_files) {     // file idx out of bounds ?
-        *inpFile = NULL;
-        *inpSeg = NULL;
-        return false;
+    switch (mw_download_type) {
+        case NZBDownload_Content:
+            return !file->is_par_vol_file;
+        case NZBDownload_Recovery:
+            return file->is_par_vol_file && file->recovery_wanted;
     }
+    return true;
+}
 
-    // this a valid file here:
-    pthread_mutex_lock(&nzb_tree_next_mutex);
-    curFile = &nzb_tree.files[nzb_tree.current_file];    
-    if (curFile->current_segment < curFile->segmentsSize) {   // are there segments left ?
-        *inpFile = curFile;
-        *inpSeg = &curFile->segments[curFile->current_segment];
-        curFile->current_segment++; // for next caller..
-        pthread_mutex_unlock(&nzb_tree_next_mutex);
+/// @brief the plain NZB order.
+/// @param file 
+/// @param segment 
+/// @return always 0
+unsigned int nzb_priority_nzb_order (struct NZBFile *file, unsigned int segment) {
+    (void)file;
+    (void)segment;
+    return 0;
+}
+
+/// @brief if the filename is the first volume of a RAR set (name.rar, name.part1.rar, name.part001.rar) or of a split file (name.001)
+/// @param filename 
+/// @return 
+bool nzb_is_first_volume (char *filename) {
+    char *part = NULL;
+
+    if (string_ends_width(filename, ".001"))
         return true;
-    } 
-
-    // it's over - so quit quick here:
-    nzb_tree.current_file++;    
-    if (nzb_tree.current_file >= nzb_tree.max_files) {
-        pthread_mutex_unlock(&nzb_tree_next_mutex);
-        *inpFile = NULL;
-        *inpSeg = NULL;
+    if (!string_ends_width(filename, ".rar"))
+        return false;
+
+    for (char *c = filename; *c; c++) {
+        if ((strncasecmp(c, ".part", 5) == 0) && isdigit(c[5]))
+            part = c;
+    }
+    // old style: name.rar, name.r00, name.r01... -> the .rar comes first.
+    if (!part)
+        return true;
+    return strtoul(&part[5], NULL, 10) == 1;
+}
+
+/// @brief index par2 first (renaming/verify), then the small control files, the first RAR volumes,
+///        the first segment of every other file (yEnc name/size, 16k-md5) and then the bulk.
+/// @param file 
+/// @param segment 
+/// @return 0..4
+unsigned int nzb_priority_metadata_first (struct NZBFile *file, unsigned int segment) {
+    if (string_ends_width(file->filename, ".par2"))
+        return file->is_par_vol_file ? 4 : 0;
+    if (string_ends_width(file->filename, ".sfv") || string_ends_width(file->filename, ".nfo") ||
+        string_ends_width(file->filename, ".md5") || string_ends_width(file->filename, ".srr"))
+        return 1;
+    if (nzb_is_first_volume(file->filename))
+        return 2;
+    if (file->segments[segment].number == 1)
+        return 3;
+    return 4;
+}
+
+/// @brief splits the name of a RAR volume (name.partNN.rar, name.rar, name.rNN) or of a split file (name.NNN).
+/// @param filename 
+/// @param base_length the length of the name w/o the volume part, the same for every volume of a set
+/// @param number the volume, 0-based
+/// @return false if it's no volume
+bool nzb_volume_parse (const char *filename, size_t *base_length, unsigned int *number) {
+    size_t length, digits = 0;
+
+    if (!filename)
         return false;
+    length = strlen(filename);
+
+    if (string_ends_width((char*)filename, ".rar")) {
+        // name.partNN.rar, the digits right before .rar:
+        while ((digits < length - 4) && isdigit(filename[length - 5 - digits]))
+            digits++;
+        if (digits && (length - 4 - digits >= 5) && (strncasecmp(&filename[length - 9 - digits], ".part", 5) == 0)) {
+            *base_length = length - 9 - digits;
+            *number = strtoul(&filename[length - 4 - digits], NULL, 10) - 1;
+            return true;
+        }
+        // old style, the .rar comes before .r00:
+        *base_length = length - 4;
+        *number = 0;
+        return true;
     }
 
-    if (mw_download_type == NZBDownload_Everything) {
-        curFile = &nzb_tree.files[nzb_tree.current_file];   // ... get next file
-        *inpFile = curFile;
-        *inpSeg = curFile->segments;
-        curFile->current_segment++;
-        pthread_mutex_unlock(&nzb_tree_next_mutex);
+    // name.rNN or name.NNN:
+    while ((digits < length) && isdigit(filename[length - 1 - digits]))
+        digits++;
+    if ((digits < 2) || (digits > 3) || (length - digits < 2))
+        return false;
+    if (filename[length - 1 - digits] == '.') {
+        *base_length = length - 1 - digits;
+        *number = strtoul(&filename[length - digits], NULL, 10);
+        if (*number == 0)
+            return false;
+        (*number)--;
+        return true;
+    }
+    if ((digits == 2) && (length - digits >= 3) && (tolower(filename[length - 3]) == 'r') && (filename[length - 4] == '.')) {
+        *base_length = length - 4;
+        *number = strtoul(&filename[length - 2], NULL, 10) + 1;
         return true;
-    } else {
-        do {
-            curFile = &nzb_tree.files[nzb_tree.current_file];
-            *inpFile = curFile;
-            *inpSeg = curFile->segments;
-            // are vol files wanted ? And is the current file a recovery file ?
-            if ((mw_download_type == NZBDownload_Recovery) && curFile->is_par_vol_file) {
-                curFile->current_segment++;
-                pthread_mutex_unlock(&nzb_tree_next_mutex);
-                return true;
-            } else if ((mw_download_type == NZBDownload_Content) && !curFile->is_par_vol_file) { // and the other check
-                curFile->current_segment++;
-                pthread_mutex_unlock(&nzb_tree_next_mutex);
-                return true;
-            }
-            nzb_tree.current_file++;
-        } while (nzb_tree.current_file < nzb_tree.max_files);
     }
-    // nothing found AND we're at the end of the tree:
-    pthread_mutex_unlock(&nzb_tree_next_mutex);
-    *inpFile = NULL;
-    *inpSeg = NULL;
     return false;
 }
 
-/// @brief returns the binary position of the segment with the (1-based)nzbnum
-/// @param file the file structure
-/// @param nzbNum the nzb-number
-/// @return the binary position (if nzbnum is 1 this returns 0)
-unsigned int nzb_get_binary_position_of_segment (struct NZBFile *file, unsigned int nzbNum) {
-    unsigned int rv = 0;
+/// @brief like metadata, but the RAR volumes come as a whole and in volume order (nzb_compare_volumes),
+///        so they're complete one after the other (for the streaming unpack).
+/// @param file 
+/// @param segment 
+/// @return 0..4
+unsigned int nzb_priority_volumes (struct NZBFile *file, unsigned int segment) {
+    size_t base_length;
+    unsigned int number;
+
+    if (string_ends_width(file->filename, ".par2"))
+        return file->is_par_vol_file ? 4 : 0;
+    if (string_ends_width(file->filename, ".sfv") || string_ends_width(file->filename, ".nfo") ||
+        string_ends_width(file->filename, ".md5") || string_ends_width(file->filename, ".srr"))
+        return 1;
+    if (nzb_volume_parse(file->filename, &base_length, &number))
+        return 2;
+    if (file->segments[segment].number == 1)
+        return 3;
+    return 4;
+}
 
-    if (nzbNum == 1)
+/// @brief orders the volumes of a set by number, the sets by name.
+/// @param a 
+/// @param b 
+/// @return <0, 0, >0 like strcmp
+int nzb_compare_volumes (struct NZBFile *a, struct NZBFile *b) {
+    size_t a_base, b_base;
+    unsigned int a_number, b_number;
+    int rv;
+
+    if (!nzb_volume_parse(a->filename, &a_base, &a_number) || !nzb_volume_parse(b->filename, &b_base, &b_number))
         return 0;
+    rv = strncmp(a->filename, b->filename, a_base < b_base ? a_base : b_base);
+    if (rv || (a_base != b_base))
+        return rv ? rv : (a_base < b_base ? -1 : 1);
+    return (a_number > b_number) - (a_number < b_number);
+}
 
-    for (unsigned int i = 0; i < file->segmentsSize; i++) {
-        if (file->segments[i].number == nzbNum)
+/// @brief selects the download order for the files published from now on.
+/// @param policy the name of the policy, NULL = default.
+/// @return false if policy is unknown (the default is used then).
+bool nzb_schedule_init (const char *policy) {
+    if (!policy)
+        policy = nzb_schedule_default;
+
+    nzb_tree.schedule_policy = NULL;
+    for (unsigned int i = 0; nzb_schedule_policies[i].name && !nzb_tree.schedule_policy; i++) {
+        if (strcasecmp(nzb_schedule_policies[i].name, policy) == 0)
+            nzb_tree.schedule_policy = &nzb_schedule_policies[i];
+    }
+    if (!nzb_tree.schedule_policy) {
+        LOG_MESSAGE(false, "Unknown schedule \"%s\", using \"%s\".", policy, nzb_schedule_default);
+        nzb_schedule_init(nzb_schedule_default);
+        return false;
+    }
+
+    LOG_MESSAGE(false, "Download order: \"%s\".", nzb_tree.schedule_policy->name);
+    return true;
+}
+
+/// @brief makes a completely parsed file visible: it's segments go into the queue of their priority.
+///        Ties stay in NZB order, so the queues are a stable sort of everything published so far.
+/// @param fileIdx the index in nzb_tree.files, == nzb_tree.max_files
+void nzb_schedule_publish_file (unsigned int fileIdx) {
+    struct NZBFile *file = &nzb_tree.files[fileIdx];
+
+    if (file->filename && (pcre2_match(volpar_comp, (const PCRE2_SPTR8)file->filename, PCRE2_ZERO_TERMINATED, 0, 0, volpar_match, NULL) >= 0)) {
+        PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(volpar_match);
+        file->is_par_vol_file = true;
+        // the block range is encoded in the name: vol<first>+<count>
+        file->par_vol_first = strtoul(&file->filename[ovector[2]], NULL, 10);
+        file->par_vol_blocks = strtoul(&file->filename[ovector[4]], NULL, 10);
+    } else
+        file->is_par_vol_file = false;
+
+    pthread_mutex_lock(&nzb_tree_next_mutex);
+    for (unsigned int sg = 0; sg < file->segmentsSize; sg++) {
+        unsigned int prio = nzb_tree.schedule_policy->priority(file, sg);
+        struct nzb_schedule_queue *queue;
+
+        if (prio >= NZB_SCHEDULE_PRIORITIES)
+            prio = NZB_SCHEDULE_PRIORITIES - 1;
+        queue = &nzb_tree.schedule[prio];
+        if (queue->length == queue->capacity) {
+            queue->capacity = queue->capacity ? queue->capacity * 2 : 1024;
+            queue->entries = (struct nzb_schedule_entry*)realloc(queue->entries, sizeof(struct nzb_schedule_entry) * queue->capacity);
+        }
+        queue->entries[queue->length].file = fileIdx;
+        queue->entries[queue->length].segment = sg;
+        queue->length++;
+    }
+    nzb_tree.schedule_length += file->segmentsSize;
+    nzb_tree.max_files = fileIdx + 1;
+    pthread_cond_broadcast(&nzb_tree_published);
+    pthread_mutex_unlock(&nzb_tree_next_mutex);
+}
+
+/// @brief starts over at the beginning of the schedule (for the next download pass).
+///        The pass index is built again on the next request, w. the files of the new pass.
+/// @param  -
+void nzb_schedule_rewind (void) {
+    pthread_mutex_lock(&nzb_tree_next_mutex);
+    for (unsigned int p = 0; p < NZB_SCHEDULE_PRIORITIES; p++)
+        nzb_tree.schedule[p].next = 0;
+    nzb_tree.pass.length = 0;
+    nzb_tree.pass.chunks_length = 0;
+    atomic_store(&nzb_tree.pass.next, 0);
+    atomic_store(&nzb_tree.pass.built, false);
+    pthread_mutex_unlock(&nzb_tree_next_mutex);
+}
+
+/// @brief sets the number of connections, each one gets it's own share of the pass index.
+/// @param count 
+void nzb_schedule_set_workers (unsigned int count) {
+    nzb_pass_workers = count ? count : 1;
+}
+
+/// @brief flattens the schedule into the pass index: every unclaimed segment of the pass, in priority order,
+///        cut into chunks of one file each. Called w. nzb_tree_next_mutex locked, once the nzb is loaded completely.
+/// @param  -
+void nzb_pass_build (void) {
+    struct nzb_pass_index *pass = &nzb_tree.pass;
+
+    if (pass->capacity < nzb_tree.schedule_length) {
+        pass->capacity = nzb_tree.schedule_length;
+        pass->entries = (struct nzb_schedule_entry*)realloc(pass->entries, sizeof(struct nzb_schedule_entry) * pass->capacity);
+    }
+    pass->length = 0;
+    pass->chunks_length = 0;
+    for (unsigned int p = 0; p < NZB_SCHEDULE_PRIORITIES; p++) {
+        struct nzb_schedule_queue *queue = &nzb_tree.schedule[p];
+
+        for (uint64_t i = queue->next; i < queue->length; i++) {
+            struct nzb_schedule_entry *entry = &queue->entries[i];
+            struct NZBFile *curFile = &nzb_tree.files[entry->file];
+
+            if (curFile->segments[entry->segment].claimed || !nzb_file_in_download_pass(curFile))
+                continue;
+            // a new file (or priority) starts a new chunk:
+            if (!pass->chunks_length || (pass->chunks[pass->chunks_length - 1].priority != p) ||
+                (pass->entries[pass->length - 1].file != entry->file)) {
+                if (pass->chunks_length == pass->chunks_capacity) {
+                    pass->chunks_capacity = pass->chunks_capacity ? pass->chunks_capacity * 2 : 256;
+                    pass->chunks = (struct nzb_pass_chunk*)realloc(pass->chunks, sizeof(struct nzb_pass_chunk) * pass->chunks_capacity);
+                }
+                pass->chunks[pass->chunks_length].begin = pass->length;
+                pass->chunks[pass->chunks_length].priority = p;
+                pass->chunks_length++;
+            }
+            pass->entries[pass->length++] = *entry;
+            pass->chunks[pass->chunks_length - 1].end = pass->length;
+        }
+        queue->next = queue->length;
+    }
+    if (nzb_tree.schedule_policy->compare)
+        qsort(pass->chunks, pass->chunks_length, sizeof(struct nzb_pass_chunk), nzb_pass_chunk_compare);
+
+    if (pass->workers_length != nzb_pass_workers) {
+        free (pass->workers);
+        pass->workers_length = nzb_pass_workers;
+        pass->workers = (struct nzb_pass_worker*)aligned_alloc(__alignof__(struct nzb_pass_worker), sizeof(struct nzb_pass_worker) * pass->workers_length);
+    }
+    for (unsigned int w = 0; w < pass->workers_length; w++)
+        atomic_init(&pass->workers[w].range, 0);
+    atomic_store(&pass->next, 0);
+    // publishes entries & chunks to the workers that don't take the mutex:
+    atomic_store(&pass->built, true);
+}
+
+/// @brief the chunks by priority, then by the policy's order of their files (qsort).
+/// @param a 
+/// @param b 
+/// @return 
+int nzb_pass_chunk_compare (const void *a, const void *b) {
+    const struct nzb_pass_chunk *chunk_a = (const struct nzb_pass_chunk*)a, *chunk_b = (const struct nzb_pass_chunk*)b;
+    int rv;
+
+    if (chunk_a->priority != chunk_b->priority)
+        return chunk_a->priority < chunk_b->priority ? -1 : 1;
+    rv = nzb_tree.schedule_policy->compare(&nzb_tree.files[nzb_tree.pass.entries[chunk_a->begin].file], &nzb_tree.files[nzb_tree.pass.entries[chunk_b->begin].file]);
+    if (rv)
+        return rv;
+    // qsort isn't stable, the schedule order is:
+    return (chunk_a->begin > chunk_b->begin) - (chunk_a->begin < chunk_b->begin);
+}
+
+/// @brief takes the first entry of a worker's range.
+/// @param worker 
+/// @param entry the index into the pass index
+/// @return false = the range is empty
+bool nzb_pass_pop (struct nzb_pass_worker *worker, uint32_t *entry) {
+    uint64_t range = atomic_load_explicit(&worker->range, memory_order_acquire);
+
+    for (;;) {
+        uint32_t begin = (uint32_t)range, end = (uint32_t)(range >> 32);
+
+        if (begin >= end)
+            return false;
+        // fails (and reloads range) if a thief took the back in the meantime:
+        if (atomic_compare_exchange_weak_explicit(&worker->range, &range, NZB_PASS_RANGE(begin + 1, end), memory_order_acq_rel, memory_order_acquire)) {
+            *entry = begin;
+            return true;
+        }
+    }
+}
+
+/// @brief moves the back half of the largest range to the (empty) range of the thief.
+/// @param thief 
+/// @return false = there's nothing left anywhere
+bool nzb_pass_steal (struct nzb_pass_worker *thief) {
+    struct nzb_pass_index *pass = &nzb_tree.pass;
+
+    for (;;) {
+        struct nzb_pass_worker *victim = NULL;
+        uint64_t victim_range = 0;
+        uint32_t most = 0;
+
+        for (unsigned int w = 0; w < pass->workers_length; w++) {
+            uint64_t range = atomic_load_explicit(&pass->workers[w].range, memory_order_acquire);
+            uint32_t begin = (uint32_t)range, end = (uint32_t)(range >> 32);
+
+            if ((begin < end) && (end - begin > most)) {
+                most = end - begin;
+                victim = &pass->workers[w];
+                victim_range = range;
+            }
+        }
+        if (!victim)
+            return false;
+
+        uint32_t begin = (uint32_t)victim_range, end = (uint32_t)(victim_range >> 32);
+        uint32_t split = end - (most + 1) / 2;
+
+        if (atomic_compare_exchange_strong_explicit(&victim->range, &victim_range, NZB_PASS_RANGE(begin, split), memory_order_acq_rel, memory_order_acquire)) {
+            atomic_store_explicit(&thief->range, NZB_PASS_RANGE(split, end), memory_order_release);
+            return true;
+        }
+    }
+}
+
+/// @brief claims the next segment of a worker: from it's own range, the next chunk or stolen from another worker.
+/// @param worker the connection asking
+/// @param inpFile 
+/// @param inpSeg 
+/// @return false = the pass index is used up.
+bool nzb_pass_claim (unsigned int worker, struct NZBFile **inpFile, struct NZBSegment **inpSeg) {
+    struct nzb_pass_index *pass = &nzb_tree.pass;
+    struct nzb_pass_worker *own = &pass->workers[worker % pass->workers_length];
+    uint32_t idx;
+
+    while (!nzb_pass_pop(own, &idx)) {
+        uint64_t chunk = atomic_fetch_add_explicit(&pass->next, 1, memory_order_relaxed);
+
+        if (chunk < pass->chunks_length)
+            atomic_store_explicit(&own->range, NZB_PASS_RANGE(pass->chunks[chunk].begin, pass->chunks[chunk].end), memory_order_release);
+        else if (!nzb_pass_steal(own)) {
+            *inpFile = NULL;
+            *inpSeg = NULL;
+            return false;
+        }
+    }
+    *inpFile = &nzb_tree.files[pass->entries[idx].file];
+    *inpSeg = &(*inpFile)->segments[pass->entries[idx].segment];
+    // the entry is ours alone, just for the resume state & the next pass:
+    (*inpSeg)->claimed = true;
+    return true;
+}
+
+/// @brief gets the next segment in line (see nzb_schedule_publish_file), returning the filename and the articleID.
+///        Waits for the parser if everything published so far is taken. Once the nzb is loaded, the
+///        segments come from the pass index w/o locking (see nzb_pass_claim).
+/// @param worker the connection asking, < the count of nzb_schedule_set_workers
+/// @param curFile - pointer to pointer of current file processing
+/// @param curSeg - poiner to pointer of current segment processing
+/// @return true = more segments/filenames
+bool nzb_tree_next_segment (unsigned int worker, struct NZBFile **inpFile, struct NZBSegment **inpSeg) {
+    if (atomic_load(&nzb_tree.pass.built))
+        return nzb_pass_claim(worker, inpFile, inpSeg);
+
+    pthread_mutex_lock(&nzb_tree_next_mutex);
+    while (!atomic_load(&nzb_tree.pass.built)) {
+        if (!nzb_tree.loading) {
+            // the schedule is complete, what's left goes to the pass index:
+            nzb_pass_build();
             break;
-        rv += file->segments[i].bytes;
+        }
+        for (unsigned int p = 0; p < NZB_SCHEDULE_PRIORITIES; p++) {
+            struct nzb_schedule_queue *queue = &nzb_tree.schedule[p];
+
+            while (queue->next < queue->length) {
+                struct nzb_schedule_entry *entry = &queue->entries[queue->next++];
+                struct NZBFile *curFile = &nzb_tree.files[entry->file];
+                struct NZBSegment *curSeg = &curFile->segments[entry->segment];
+
+                // not fetched yet, and do we want it in this pass ?
+                if (!curSeg->claimed && nzb_file_in_download_pass(curFile)) {
+                    curSeg->claimed = true;
+                    *inpFile = curFile;
+                    *inpSeg = curSeg;
+                    pthread_mutex_unlock(&nzb_tree_next_mutex);
+                    return true;
+                }
+            }
+        }
+        pthread_cond_wait(&nzb_tree_published, &nzb_tree_next_mutex);
     }
-        
-    return rv;
+    pthread_mutex_unlock(&nzb_tree_next_mutex);
+
+    return nzb_pass_claim(worker, inpFile, inpSeg);
+}
+
+/// @brief returns the binary position of the segment with the (1-based)nzbnum, from the nzb's bytes.
+/// @param file the file structure
+/// @param nzbNum the nzb-number
+/// @return the binary position (if nzbnum is 1 this returns 0)
+uint64_t nzb_get_binary_position_of_segment (struct NZBFile *file, unsigned int nzbNum) {
+    if (!file->positions)
+        return 0;
+    return file->positions[nzb_segment_index(file, nzbNum)];
 }
 
-/// @brief cleans up any resources.
+/// @brief cleans up any resources, the next nzb_load() starts from scratch.
 /// @param  
 void cleanup_xmlhandler(void) {
+    // the parser thread ends w. writing the cache:
+    if (nzb_loader_running)
+        pthread_join(nzb_loader_thread, NULL);
+    nzb_loader_running = false;
+    cleanup_nzbcache();
+
     for (unsigned int i = 0; i < nzb_tree.max_files; i++) {
-        for (unsigned int j = 0; j < nzb_tree.files[i].segmentsSize; j++) {
-            free (nzb_tree.files[i].segments[j].articleID);
-        }
-        free (nzb_tree.files[i].segments);
+        free (nzb_tree.files[i].filename);
+        free (nzb_tree.files[i].yenc_filename);
+        free (nzb_tree.files[i].par2_filename);
+        free (nzb_tree.files[i].holes);
     }
-    free (nzb_tree.files);
-}
\ No newline at end of file
+    arena_release(&nzb_tree.file_arena);
+    arena_release(&nzb_tree.segment_arena);
+    arena_release(&nzb_tree.articles);
+    arena_release(&nzb_tree.positions);
+    for (unsigned int p = 0; p < NZB_SCHEDULE_PRIORITIES; p++)
+        free (nzb_tree.schedule[p].entries);
+    free (nzb_tree.pass.entries);
+    free (nzb_tree.pass.chunks);
+    free (nzb_tree.pass.workers);
+    free (nzb_tree.name);
+    free (nzb_tree.display_name);
+    free (nzb_tree.download_destination);
+    memset(&nzb_tree, 0, sizeof(struct NZB));
+
+    free (nzb_meta_password);
+    nzb_meta_password = NULL;
+    parse_is_nzb_head = false;
+    memset(&nzb_loader_userdata, 0, sizeof(struct parse_userdata));
+    nzb_loader_userdata.text_type = XMLText_ArticleID;
+}
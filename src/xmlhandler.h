@@ -1,47 +1,134 @@
 #ifndef XMLHANDLER_H
 #define XMLHANDLER_H
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <expat.h>
 
 #include "utils.h"
 
 // BEG This describes the NZB itself
+#define NZBSEGMENT_OFFSET_UNKNOWN   UINT64_MAX
+
 struct NZBSegment {
+    uint64_t        offset; // binary offset inside the file (=ypart begin), NZBSEGMENT_OFFSET_UNKNOWN if not known
     unsigned int    number; // the "number" property
     unsigned int    bytes;  // the "bytes" property
     unsigned int    decoded_bytes; // real(!) binary-size of this segment
-    char    *articleID;
+    uint32_t        article; // the message id: offset into nzb_tree.articles, see nzb_segment_article()
+    uint32_t        crc32;  // crc32 of the decoded data
+    uint8_t         state;  // one of NZBSegment_State
+    bool            claimed; // handed out by nzb_tree_next_segment
+    uint8_t         alternates; // reposts of the same number, see nzb_segment_alternate()
+};
+
+// a byte range of a file:
+struct NZBRange {
+    uint64_t        offset;
+    uint64_t        length;
 };
 
 struct NZBFile {
     char            *filename;          // the filename the articles are part of
     char            *yenc_filename;     // the filename reported back from yBegin
-    struct NZBSegment *segments;        // the articles - segments of the file
-    unsigned int    segmentsSize;       // size of segments for this file.
+    struct NZBSegment *segments;        // the articles - segments of the file, part of nzb_tree.segment_arena
+    unsigned int    segmentsSize;       // size of segments for this file, sorted by number, unique.
+    unsigned int    alternatesSize;     // duplicate numbers, after the segments (sorted too)
+    unsigned int    missing_segments;   // numbers the nzb doesn't have at all
+    uint64_t        *positions;         // prefix sums of the segments' bytes, segmentsSize+1 entries (part of nzb_tree.positions)
     uint64_t        file_size;          // the reported size from the yenc-meta-entry (ybegin)
-    uint64_t        download_size;      // the current downloaded size (binary)
+    atomic_uint_fast64_t download_size; // the current downloaded size (binary)
     bool            crcOk;              // if a segment fails to load OR fails to verify via crc32
-    unsigned int    remaining_segments; // for an easy check like if (!remaining_segments)... 
-    unsigned int    open_segments;      // like requested but the request is not finished.
+    atomic_uint     remaining_segments; // for an easy check like if (!remaining_segments)... 
+    atomic_uint     open_segments;      // like requested but the request is not finished.
     uint64_t        joined_size;        // for progressbar to "join" all files
     uint8_t         state;              // one of the NZBFile_State
-    unsigned int    current_segment;    // moved from static to this point here
     char            *final_filename;    // a pointer either to filename or yenc_filename
     bool            is_par_vol_file;    // if this is supposed to be downloaded in the first iteration thru the nzb file ?
+    uint32_t        par_vol_first;      // volXX+YY: XX, the first recovery block (exponent)
+    uint32_t        par_vol_blocks;     // volXX+YY: YY, the number of recovery blocks
+    bool            recovery_wanted;    // selected for the NZBDownload_Recovery pass
+    uint8_t         md5_16k[16];        // md5 of the first 16k, from the first segment
+    bool            has_md5_16k;
+    char            *par2_filename;     // the FileDesc name w. the same md5_16k, NULL = not matched (yet)
+    struct NZBRange *holes;             // the missing ranges mw_join_segments zero-filled
+    unsigned int    holes_length;
+};
+
+// one segment in the download order:
+struct nzb_schedule_entry {
+    uint32_t        file;               // index into nzb_tree.files
+    uint32_t        segment;            // index into files[file].segments
+};
+
+// a download order: lower priority values are fetched first, ties stay in NZB order.
+#define NZB_SCHEDULE_PRIORITIES     8
+
+// the published segments of one priority, in NZB order:
+struct nzb_schedule_queue {
+    struct nzb_schedule_entry *entries;
+    uint64_t        length;
+    uint64_t        capacity;
+    uint64_t        next;               // the next entry nzb_tree_next_segment looks at
+};
+
+// a run of pass index entries of one file, handed to one connection as a whole:
+struct nzb_pass_chunk {
+    uint32_t        begin;
+    uint32_t        end;
+    uint32_t        priority;
+};
+
+// a connection's share of the pass index, the entries [begin, end) packed in one word: the owner
+// takes them from the front, the other connections steal from the back (see nzb_pass_steal()).
+#define NZB_PASS_RANGE(begin, end)  ((uint64_t)(begin) | ((uint64_t)(end) << 32))
+
+struct nzb_pass_worker {
+    atomic_uint_fast64_t range;
+} __attribute__((aligned(64)));         // the owner updates it per segment, one cache line each
+
+// the segments of one download pass, once the nzb is loaded: the schedule w/o the segments
+// that are claimed or not in the pass, cut into chunks per file. Every connection works thru
+// it's own chunk w/o a lock and steals half of another one's when there are no chunks left.
+struct nzb_pass_index {
+    struct nzb_schedule_entry *entries;
+    uint64_t        length;
+    uint64_t        capacity;
+    struct nzb_pass_chunk *chunks;      // in schedule order
+    uint64_t        chunks_length;
+    uint64_t        chunks_capacity;
+    struct nzb_pass_worker *workers;    // one per connection
+    unsigned int    workers_length;
+    atomic_uint_fast64_t next;          // the next chunk to hand out, >= chunks_length: only stealing left
+    atomic_bool     built;              // entries & chunks are valid (until nzb_schedule_rewind)
+};
+
+struct nzb_schedule_policy {
+    const char      *name;
+    unsigned int    (*priority)(struct NZBFile *file, unsigned int segment);   // < NZB_SCHEDULE_PRIORITIES
+    int             (*compare)(struct NZBFile *a, struct NZBFile *b);         // the files of one priority, NULL = NZB order
 };
 
 struct NZB {
     char            *name;              // the file name, w. path
     char            *display_name;      // the display-name w/o path and extension.
-    struct NZBFile  *files;             // description of files.
-    unsigned int    max_files;          // size of array
-    uint64_t        release_size;
-    uint64_t        release_downloaded;
+    struct NZBFile  *files;             // description of files, the base of file_arena (never moves).
+    unsigned int    max_files;          // published files (complete <file/>-nodes)
+    struct arena    file_arena;
+    struct arena    segment_arena;      // the segments of all files, one file after the other
+    struct arena    articles;           // every message id, \0 terminated
+    struct arena    positions;          // the files' positions
+    uint64_t        missing_segments;   // sum of the files' missing_segments
+    uint64_t        release_size;       // what's downloaded is in the statistics, see stats.h
     char            *download_destination;
-    unsigned int    current_file;        // 
     bool            skip_recovery;           // true = download all non *.par2 files.
     int             rename_files_to;    // See enum NZBRename
     bool            post_join_files;    // .001, .002... files
+    struct nzb_schedule_queue schedule[NZB_SCHEDULE_PRIORITIES];    // the download order, lowest priority first
+    const struct nzb_schedule_policy *schedule_policy;
+    uint64_t        schedule_length;    // all published segments
+    struct nzb_pass_index pass;         // the current pass, built when the nzb is loaded
+    bool            loading;            // the nzb is still being parsed
+    bool            parse_failed;       // a read or xml error cut it short, the tree is incomplete
 };
 
 enum NZBFile_State {
@@ -51,6 +138,13 @@ enum NZBFile_State {
     NFState_Done
 };
 
+enum NZBSegment_State {
+    NSState_Pending = 0,
+    NSState_Done = 1,
+    NSState_Failed,         // article not available / not decodable
+    NSState_CRCError        // decoded, but the crc32 doesn't match
+};
+
 enum NZBRename {
     NZBRename_undefined = 0,
     NZBRename_NZB = 1,
@@ -97,7 +191,20 @@ char* pair_find(struct pair *keyval, char* needle);
 void parse_config_start_element(void *userData, const char *name, const char **attribs);
 void parse_config_end_element(void *userData, const char *name);
 bool nzb_load(char *filename);
-bool nzb_tree_next_segment (struct NZBFile **inpFile, struct NZBSegment **inpSeg);
-unsigned int nzb_get_binary_position_of_segment (struct NZBFile *file, unsigned int nzbNum);
+bool nzb_tree_next_segment (unsigned int worker, struct NZBFile **inpFile, struct NZBSegment **inpSeg);
+bool nzb_file_in_download_pass (struct NZBFile *file);
+char *nzb_segment_article (struct NZBSegment *seg);
+bool nzb_schedule_init (const char *policy);
+void nzb_schedule_publish_file (unsigned int fileIdx);
+void nzb_schedule_rewind (void);
+void nzb_schedule_set_workers (unsigned int count);
+unsigned int nzb_priority_nzb_order (struct NZBFile *file, unsigned int segment);
+unsigned int nzb_priority_metadata_first (struct NZBFile *file, unsigned int segment);
+unsigned int nzb_priority_volumes (struct NZBFile *file, unsigned int segment);
+int nzb_compare_volumes (struct NZBFile *a, struct NZBFile *b);
+bool nzb_volume_parse (const char *filename, size_t *base_length, unsigned int *number);
+bool nzb_file_index_segments (struct NZBFile *file);
+struct NZBSegment *nzb_segment_alternate (struct NZBFile *file, struct NZBSegment *seg, unsigned int alternate);
+uint64_t nzb_get_binary_position_of_segment (struct NZBFile *file, unsigned int nzbNum);
 void cleanup_xmlhandler(void);
 #endif
\ No newline at end of file
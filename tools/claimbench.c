@@ -0,0 +1,142 @@
+/*
+ * claimbench: how fast the connections take the segments of a pass (nzb_tree_next_segment, the
+ * chunk claiming & stealing of nzb_pass_claim), w. 8..256 threads that do nothing but claim:
+ *   claimbench [-r rounds] file.nzb [threads..]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "xmlhandler.h"
+
+// the pass index is built by the first claim, the bench builds it before the clock starts:
+void nzb_pass_build(void);
+
+extern struct NZB nzb_tree;
+extern pthread_mutex_t nzb_tree_next_mutex;
+
+atomic_uint_fast64_t claimbench_claims;
+const unsigned int claimbench_default_threads[] = { 8, 16, 32, 64, 128, 256 };
+
+/// @brief one connection: claims until the pass is empty.
+/// @param arg the worker number
+/// @return NULL
+void *claimbench_worker(void *arg) {
+    unsigned int worker = (unsigned int)(uintptr_t)arg;
+    struct NZBFile *file;
+    struct NZBSegment *seg;
+    uint64_t claims = 0;
+
+    while (nzb_tree_next_segment(worker, &file, &seg))
+        claims++;
+    atomic_fetch_add(&claimbench_claims, claims);
+    return NULL;
+}
+
+/// @brief every segment is unclaimed again, the pass index is rebuilt for threads workers.
+/// @param threads
+void claimbench_rewind(unsigned int threads) {
+    for (unsigned int f = 0; f < nzb_tree.max_files; f++) {
+        for (unsigned int s = 0; s < nzb_tree.files[f].segmentsSize; s++)
+            nzb_tree.files[f].segments[s].claimed = false;
+    }
+    nzb_schedule_set_workers(threads);
+    nzb_schedule_rewind();
+    pthread_mutex_lock(&nzb_tree_next_mutex);
+    nzb_pass_build();
+    pthread_mutex_unlock(&nzb_tree_next_mutex);
+}
+
+/// @brief one round w. threads claiming at once.
+/// @param threads
+/// @param claims out: the segments handed out
+/// @param seconds out: the time until the last one found the pass empty
+/// @return false if a thread couldn't be started
+bool claimbench_round(unsigned int threads, uint64_t *claims, double *seconds) {
+    pthread_t *workers = (pthread_t*)calloc(threads, sizeof(pthread_t));
+    struct timespec start, end;
+    unsigned int started = 0;
+
+    claimbench_rewind(threads);
+    atomic_store(&claimbench_claims, 0);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (; started < threads; started++) {
+        if (pthread_create(&workers[started], NULL, claimbench_worker, (void*)(uintptr_t)started) != 0)
+            break;
+    }
+    for (unsigned int i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    free (workers);
+
+    *claims = atomic_load(&claimbench_claims);
+    *seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    return started == threads;
+}
+
+int main(int argc, char **argv) {
+    unsigned int rounds = 5, segments = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:")) != -1) {
+        switch (opt) {
+            case 'r':
+                rounds = (unsigned int)atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-r rounds] file.nzb [threads..]\n", argv[0]);
+                return 2;
+        }
+    }
+    if ((optind >= argc) || !rounds) {
+        fprintf(stderr, "usage: %s [-r rounds] file.nzb [threads..]\n", argv[0]);
+        return 2;
+    }
+
+    if (!nzb_load(argv[optind]))
+        return 1;
+    while (nzb_tree.loading)
+        usleep(1000);
+    for (unsigned int f = 0; f < nzb_tree.max_files; f++)
+        segments += nzb_tree.files[f].segmentsSize;
+    printf("%s: %u files, %u segments, %u rounds each.\n", argv[optind], nzb_tree.max_files, segments, rounds);
+
+    for (int i = 0; ; i++) {
+        unsigned int threads;
+        uint64_t claims_total = 0;
+        double seconds_total = 0, best = 0;
+
+        if (optind + 1 < argc) {
+            if (optind + 1 + i >= argc)
+                break;
+            threads = (unsigned int)atoi(argv[optind + 1 + i]);
+        } else if (i < (int)(sizeof(claimbench_default_threads) / sizeof(claimbench_default_threads[0])))
+            threads = claimbench_default_threads[i];
+        else
+            break;
+        if (!threads)
+            continue;
+
+        for (unsigned int r = 0; r < rounds; r++) {
+            uint64_t claims;
+            double seconds;
+
+            if (!claimbench_round(threads, &claims, &seconds)) {
+                fprintf(stderr, "couldn't start %u threads.\n", threads);
+                return 1;
+            }
+            if (claims != segments)
+                fprintf(stderr, "%u threads: %lu claims for %u segments!\n", threads, (unsigned long)claims, segments);
+            claims_total += claims;
+            seconds_total += seconds;
+            if ((seconds > 0) && ((double)claims / seconds > best))
+                best = (double)claims / seconds;
+        }
+        printf("%3u threads: %12.0f claims/s (best %12.0f)\n", threads, seconds_total > 0 ? (double)claims_total / seconds_total : 0, best);
+    }
+    return 0;
+}
@@ -0,0 +1,60 @@
+/*
+ * par2check: verifies (or repairs) the par2 recovery sets of a directory with nzbweaver's own
+ * par2 code, to check it against sets made by other tools (par2cmdline, MultiPar..):
+ *   par2check [-r] [-t threads] directory
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "parfiles.h"
+#include "par2repair.h"
+
+const char* par2check_results[] = { "ok", "repaired", "repairable", "not enough recovery blocks", "error" };
+
+int main(int argc, char **argv) {
+    bool do_repair = false;
+    unsigned int threads = 0;
+    int opt, rv = 0;
+
+    while ((opt = getopt(argc, argv, "rt:")) != -1) {
+        switch (opt) {
+            case 'r':
+                do_repair = true;
+                break;
+            case 't':
+                threads = (unsigned int)atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-r] [-t threads] directory\n", argv[0]);
+                return 2;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "usage: %s [-r] [-t threads] directory\n", argv[0]);
+        return 2;
+    }
+
+    par2_index_directory(argv[optind]);
+    if (!par_index.sets_length) {
+        fprintf(stderr, "%s: no par2 recovery set found.\n", argv[optind]);
+        return 2;
+    }
+
+    for (unsigned int i = 0; i < par_index.sets_length; i++) {
+        struct par2_set *set = &par_index.sets[i];
+        struct par2_repair_result result;
+        int rc;
+
+        memset(&result, 0, sizeof(struct par2_repair_result));
+        rc = par2_repair(argv[optind], set, do_repair, threads, &result);
+        printf("set %02x%02x%02x%02x: %u files, %u slices, %u damaged in %u files, %u recovery blocks: %s\n",
+            set->set_id[0], set->set_id[1], set->set_id[2], set->set_id[3], set->fileinfos_length,
+            result.total_slices, result.damaged_slices, result.damaged_files, result.recovery_blocks, par2check_results[rc]);
+        if ((rc != PAR2Repair_Ok) && (rc != PAR2Repair_Repaired))
+            rv = 1;
+    }
+    par2_index_free();
+    return rv;
+}
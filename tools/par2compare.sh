@@ -0,0 +1,109 @@
+#!/bin/sh
+#
+# par2compare: makes par2 sets w. par2cmdline, damages them and compares par2check's verify/repair
+# to par2cmdline's ("par2 v"/"par2 r"). The verify results have to agree, every file that's
+# repaired has to match the original:
+#   par2compare.sh path/to/par2check [workdir]   (the sets are made in workdir/par2compare.PID)
+#
+# needs par2 (par2cmdline) in $PATH, exits w. 77 (skipped) if it isn't there.
+
+PAR2CHECK=$1
+WORK=${2:-${TMPDIR:-/tmp}}/par2compare.$$
+FAILED=0
+CASES=0
+
+if [ -z "$PAR2CHECK" ] || [ ! -x "$PAR2CHECK" ]; then
+    echo "usage: $0 path/to/par2check [workdir]" >&2
+    exit 2
+fi
+if ! command -v par2 >/dev/null 2>&1; then
+    echo "par2 (par2cmdline) isn't installed, nothing to compare against." >&2
+    exit 77
+fi
+
+# the files of a set: non-aligned sizes, one smaller than a slice.
+make_files() {   # dir count slice
+    i=0
+    while [ "$i" -lt "$2" ]; do
+        size=$(( $3 * (i + 2) + 123 * i + 1 ))
+        [ "$i" -eq 1 ] && size=100
+        head -c "$size" /dev/urandom > "$1/data$i.bin"
+        i=$((i + 1))
+    done
+}
+
+# damage: none, flip (a byte), zero (a slice), truncate, delete (a file), many (a slice of every file, more than the recovery blocks)
+damage() {   # dir kind slice
+    case "$2" in
+        none) ;;
+        flip) printf '\377' | dd of="$1/data0.bin" bs=1 seek=$(($3 + 7)) conv=notrunc 2>/dev/null ;;
+        zero) dd if=/dev/zero of="$1/data0.bin" bs="$3" seek=1 count=1 conv=notrunc 2>/dev/null ;;
+        truncate) truncate -s $(( $(wc -c < "$1/data0.bin") / 2 )) "$1/data0.bin" ;;
+        delete) rm -f "$1/data0.bin" ;;
+        many)
+            for f in "$1"/data*.bin; do
+                dd if=/dev/zero of="$f" bs=4 count=1 conv=notrunc 2>/dev/null
+            done
+            rm -f "$1"/set.vol*.par2 ;;
+    esac
+}
+
+# par2cmdline's verify exit code: 0 = ok, 1 = repairable, 2 = not repairable
+par2check_verdict() {   # dir
+    out=$("$PAR2CHECK" "$1" 2>&1)
+    case "$out" in
+        *": ok"*) echo 0 ;;
+        *": repairable"*) echo 1 ;;
+        *": not enough recovery blocks"*) echo 2 ;;
+        *) echo 3 ;;
+    esac
+}
+
+# how many files of the set differ from the originals after the repair:
+files_wrong() {   # dir originals
+    wrong=0
+    for f in "$2"/data*.bin; do
+        cmp -s "$f" "$1/$(basename "$f")" || wrong=$((wrong + 1))
+    done
+    echo "$wrong"
+}
+
+mkdir -p "$WORK" || exit 2
+printf "%-22s %8s %10s %12s %14s\n" "case" "par2 v" "par2check" "par2 r wrong" "par2check -r"
+for count in 1 3 7; do
+    for slice in 4096 65536; do
+        for kind in none flip zero truncate delete many; do
+            dir="$WORK/$count-$slice-$kind"
+            rm -rf "$dir"
+            mkdir -p "$dir/orig" "$dir/cmdline" "$dir/check"
+            make_files "$dir/orig" "$count" "$slice"
+            (cd "$dir/orig" && par2 create -q -q -s"$slice" -r10 -n2 set.par2 data*.bin >/dev/null) || {
+                echo "$count-$slice-$kind: par2 create failed" >&2
+                FAILED=$((FAILED + 1))
+                continue
+            }
+            cp "$dir/orig"/* "$dir/cmdline"
+            damage "$dir/cmdline" "$kind" "$slice"
+            cp "$dir/cmdline"/* "$dir/check"
+
+            (cd "$dir/cmdline" && par2 v -q -q set.par2 >/dev/null 2>&1)
+            verify_cmdline=$?
+            verify_check=$(par2check_verdict "$dir/check")
+            (cd "$dir/cmdline" && par2 r -q -q set.par2 >/dev/null 2>&1)
+            "$PAR2CHECK" -r "$dir/check" >/dev/null 2>&1
+            wrong_cmdline=$(files_wrong "$dir/cmdline" "$dir/orig")
+            wrong_check=$(files_wrong "$dir/check" "$dir/orig")
+
+            result=""
+            [ "$verify_cmdline" -ne "$verify_check" ] && result=" <- verify differs"
+            [ "$wrong_cmdline" -ne "$wrong_check" ] && result="$result <- repair differs"
+            [ -n "$result" ] && FAILED=$((FAILED + 1))
+            CASES=$((CASES + 1))
+            printf "%-22s %8s %10s %12s %14s%s\n" "$count-$slice-$kind" "$verify_cmdline" "$verify_check" "$wrong_cmdline" "$wrong_check" "$result"
+        done
+    done
+done
+
+echo "$CASES cases, $FAILED differ."
+[ "$FAILED" -eq 0 ] && rm -rf "$WORK"
+[ "$FAILED" -eq 0 ]